@@ -0,0 +1,45 @@
+#!/usr/bin/env python
+#
+# Generates large.pwn, a benchmark for compilation speed. The script has
+# many functions with lots of arithmetic and branches, and a public that
+# calls them in a loop. With the default arguments the compiled AMX is
+# about 20 MB.
+#
+# Usage:
+#
+#   python gen_large.py [num_functions] [function_size] > large.pwn
+#   pawncc large.pwn -i. -d0 -O1
+#
+# Then run the server with gamemode0 set to "large" and jit_report_time set
+# to 1, and compare the reported compilation time for different values of
+# jit_threads (e.g. 1, 2, 4, 8).
+
+import sys
+
+num_functions = int(sys.argv[1]) if len(sys.argv) > 1 else 4096
+function_size = int(sys.argv[2]) if len(sys.argv) > 2 else 64
+
+out = sys.stdout
+out.write('#include "bench"\n\n')
+out.write('#define ITERATIONS 100\n\n')
+
+for i in range(num_functions):
+  out.write('Func%d(x) {\n' % i)
+  for j in range(function_size):
+    out.write('\tif (x > %d) {\n' % (i + j))
+    out.write('\t\tx = x * %d + %d;\n' % (j + 3, i))
+    out.write('\t} else {\n')
+    out.write('\t\tx = x / %d - %d;\n' % (j + 2, i))
+    out.write('\t}\n')
+  if i + 1 < num_functions:
+    out.write('\treturn x + %d;\n' % i)
+  else:
+    out.write('\treturn x;\n')
+  out.write('}\n\n')
+
+out.write('main() {\n')
+out.write('\tBENCH_BEGIN(call_all, ITERATIONS)\n')
+for i in range(num_functions):
+  out.write('\t\tFunc%d(i_);\n' % i)
+out.write('\tBENCH_END()\n')
+out.write('}\n')
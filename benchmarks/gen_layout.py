@@ -0,0 +1,51 @@
+#!/usr/bin/env python
+#
+# Generates layout.pwn, a benchmark for code placement. The script consists
+# of a chain of small "hot" functions that call each other, separated by
+# large "cold" functions that are never called. In bytecode order every hot
+# function ends up on its own page of JIT code.
+#
+# Usage:
+#
+#   python gen_layout.py [num_hot] [cold_size] > layout.pwn
+#   pawncc layout.pwn -i. -d0 -O1
+#
+# Then run the server with gamemode0 set to "layout" and compare the
+# numbers with jit_reorder_functions set to 0 and 1:
+#
+#   perf stat -e iTLB-load-misses,L1-icache-load-misses ./samp03svr
+
+import sys
+
+num_hot = int(sys.argv[1]) if len(sys.argv) > 1 else 256
+cold_size = int(sys.argv[2]) if len(sys.argv) > 2 else 256
+
+out = sys.stdout
+out.write('#include "bench"\n\n')
+out.write('#define ITERATIONS 1000000\n\n')
+out.write('forward ColdEntry(x);\n\n')
+
+for i in range(num_hot):
+  out.write('Hot%d(x) {\n' % i)
+  if i + 1 < num_hot:
+    out.write('\treturn Hot%d(x + %d);\n' % (i + 1, i))
+  else:
+    out.write('\treturn x;\n')
+  out.write('}\n\n')
+  out.write('Cold%d(x) {\n' % i)
+  for j in range(cold_size):
+    out.write('\tx = x * %d + %d;\n' % (j + 3, i))
+  out.write('\treturn x;\n')
+  out.write('}\n\n')
+
+out.write('public ColdEntry(x) {\n')
+for i in range(num_hot):
+  out.write('\tx = Cold%d(x);\n' % i)
+out.write('\treturn x;\n')
+out.write('}\n\n')
+
+out.write('main() {\n')
+out.write('\tBENCH_BEGIN(call_chain, ITERATIONS)\n')
+out.write('\t\tHot0(i_);\n')
+out.write('\tBENCH_END()\n')
+out.write('}\n')
@@ -38,12 +38,17 @@ class AMXHandler {
  public:
   static T *CreateHandler(AMX *amx);
   static T *GetHandler(AMX *amx);
+  static T *FindHandler(AMX *amx);
   static void DestroyHandler(AMX *amx);
 
  private:
   AMX *amx_;
 
  private:
+  // Handlers are also stored in a user data slot of their AMX, which is
+  // quicker to look up than the map on every amx_Exec().
+  static const long kUserTag = AMX_USERTAG('J', 'I', 'T', 'H');
+
   typedef std::map<AMX*, T*> HandlerMap;
   static HandlerMap handlers_;
 };
@@ -56,18 +61,46 @@ template<typename T>
 T *AMXHandler<T>::CreateHandler(AMX *amx) {
   T *handler = new T(amx);
   handlers_.insert(std::make_pair(amx, handler));
+  for (int i = 0; i < AMX_USERNUM; i++) {
+    if (amx->usertags[i] == 0 || amx->usertags[i] == kUserTag) {
+      amx->usertags[i] = kUserTag;
+      amx->userdata[i] = handler;
+      break;
+    }
+  }
   return handler;
 }
 
 // static
 template<typename T>
 T *AMXHandler<T>::GetHandler(AMX *amx) {
+  T *handler = FindHandler(amx);
+  if (handler != 0) {
+    return handler;
+  } else {
+    return CreateHandler(amx);
+  }
+}
+
+// static
+template<typename T>
+T *AMXHandler<T>::FindHandler(AMX *amx) {
+  for (int i = 0; i < AMX_USERNUM; i++) {
+    // amx_Clone() copies the user data of the original AMX, so the slot
+    // may belong to another instance.
+    if (amx->usertags[i] == kUserTag) {
+      T *handler = static_cast<T*>(amx->userdata[i]);
+      if (handler->amx() == amx) {
+        return handler;
+      }
+      break;
+    }
+  }
   typename HandlerMap::const_iterator iterator = handlers_.find(amx);
   if (iterator != handlers_.end()) {
     return iterator->second;
-  } else {
-    return CreateHandler(amx);
   }
+  return 0;
 }
 
 // static
@@ -77,6 +110,12 @@ void AMXHandler<T>::DestroyHandler(AMX *amx) {
   if (iterator != handlers_.end()) {
     T *handler = iterator->second;
     handlers_.erase(iterator);
+    for (int i = 0; i < AMX_USERNUM; i++) {
+      if (amx->usertags[i] == kUserTag) {
+        amx->usertags[i] = 0;
+        amx->userdata[i] = 0;
+      }
+    }
     delete handler;
   }
 }
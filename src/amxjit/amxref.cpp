@@ -71,6 +71,11 @@ int AMXRef::num_natives() const {
           / header()->defsize;
 }
 
+int AMXRef::num_pubvars() const {
+  return (header()->tags - header()->pubvars)
+          / header()->defsize;
+}
+
 AMX_FUNCSTUBNT *AMXRef::publics() const {
   return reinterpret_cast<AMX_FUNCSTUBNT*>(header()->publics
                                             + AccessAmx()->base);
@@ -81,6 +86,11 @@ AMX_FUNCSTUBNT *AMXRef::natives() const {
                                             + AccessAmx()->base);
 }
 
+AMX_FUNCSTUBNT *AMXRef::pubvars() const {
+  return reinterpret_cast<AMX_FUNCSTUBNT*>(header()->pubvars
+                                            + AccessAmx()->base);
+}
+
 cell AMXRef::GetPublicAddress(cell index) const {
   if (index == AMX_EXEC_MAIN) {
     AMX_HEADER *hdr = header();
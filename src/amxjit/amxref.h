@@ -54,9 +54,11 @@ class AMXRef {
 
   int num_publics() const;
   int num_natives() const;
+  int num_pubvars() const;
 
   AMX_FUNCSTUBNT *publics() const;
   AMX_FUNCSTUBNT *natives() const;
+  AMX_FUNCSTUBNT *pubvars() const;
 
   cell GetPublicAddress(cell index) const;
   cell GetNativeAddress(cell index) const;
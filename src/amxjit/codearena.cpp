@@ -0,0 +1,224 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <algorithm>
+#include <cassert>
+#include <map>
+#include <vector>
+#include "codearena.h"
+#include "platform.h"
+
+namespace amxjit {
+namespace {
+
+// Regions are reserved in multiples of the huge page size (2 MB on x86)
+// and only the pages that are used take up memory.
+const std::size_t kHugePageSize = 2 * 1024 * 1024;
+const std::size_t kRegionSize = 16 * kHugePageSize;
+
+std::size_t AlignSize(std::size_t size, std::size_t alignment) {
+  return (size + alignment - 1) & ~(alignment - 1);
+}
+
+// Free ranges of pages by start address. Adjacent ranges are merged.
+std::map<unsigned char*, std::size_t> free_ranges;
+Mutex mutex;
+
+// Owners of blocks are looked up from trap handlers, which can't take the
+// mutex, so they are kept in a list that can be read without it. Entries
+// are added under the mutex and are never removed, only cleared and
+// reused. An entry is valid while its owner is not 0; the owner is set
+// after the other fields and cleared before they change (x86 doesn't
+// reorder stores).
+struct OwnerEntry {
+  unsigned char *volatile start;
+  volatile std::size_t size;
+  void *volatile owner;
+};
+
+const std::size_t kOwnerChunkSize = 1024;
+
+struct OwnerChunk {
+  OwnerEntry entries[kOwnerChunkSize];
+  volatile std::size_t count;
+  OwnerChunk *volatile next;
+};
+
+OwnerChunk owner_chunks;
+std::vector<OwnerEntry*> free_owner_entries;
+
+// Allocated blocks by start address: their sizes and owner entries.
+std::map<unsigned char*, std::pair<std::size_t, OwnerEntry*> > blocks;
+
+// Takes a range from the first free range that fits, so allocations are
+// packed towards the start of the arena.
+unsigned char *TakeRange(std::size_t size) {
+  for (std::map<unsigned char*, std::size_t>::iterator it =
+         free_ranges.begin();
+       it != free_ranges.end(); it++) {
+    if (it->second >= size) {
+      unsigned char *address = it->first;
+      std::size_t rest = it->second - size;
+      free_ranges.erase(it);
+      if (rest > 0) {
+        free_ranges[address + size] = rest;
+      }
+      return address;
+    }
+  }
+  return 0;
+}
+
+void PutRange(unsigned char *address, std::size_t size) {
+  std::map<unsigned char*, std::size_t>::iterator next =
+    free_ranges.lower_bound(address);
+  if (next != free_ranges.end() && address + size == next->first) {
+    size += next->second;
+    free_ranges.erase(next++);
+  }
+  if (next != free_ranges.begin()) {
+    std::map<unsigned char*, std::size_t>::iterator prev = next;
+    prev--;
+    if (prev->first + prev->second == address) {
+      prev->second += size;
+      return;
+    }
+  }
+  free_ranges[address] = size;
+}
+
+OwnerEntry *NewOwnerEntry() {
+  if (!free_owner_entries.empty()) {
+    OwnerEntry *entry = free_owner_entries.back();
+    free_owner_entries.pop_back();
+    return entry;
+  }
+  OwnerChunk *chunk = &owner_chunks;
+  while (chunk->count == kOwnerChunkSize) {
+    if (chunk->next == 0) {
+      chunk->next = new OwnerChunk();
+    }
+    chunk = chunk->next;
+  }
+  return &chunk->entries[chunk->count++];
+}
+
+} // anonymous namespace
+
+void *CodeArena::Allocate(std::size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  size = AlignSize(size, GetPageSize());
+
+  ScopedLock lock(mutex);
+  unsigned char *address = TakeRange(size);
+  if (address == 0) {
+    // Regions are never given back, so reserve them in big chunks.
+    std::size_t region_size =
+      std::max(kRegionSize, AlignSize(size, kHugePageSize));
+    unsigned char *region =
+      static_cast<unsigned char*>(AllocatePages(region_size));
+    if (region == 0) {
+      return 0;
+    }
+    AdviseHugePages(region, region_size);
+    PutRange(region, region_size);
+    address = TakeRange(size);
+    assert(address != 0);
+  }
+  blocks[address] = std::make_pair(size, static_cast<OwnerEntry*>(0));
+  return address;
+}
+
+void CodeArena::Free(void *address, std::size_t size) {
+  if (address == 0) {
+    return;
+  }
+  size = AlignSize(size, GetPageSize());
+
+  // Freed code must not stay executable.
+  ProtectPages(address, size, false);
+
+  ScopedLock lock(mutex);
+  std::map<unsigned char*, std::pair<std::size_t, OwnerEntry*> >::iterator
+    it = blocks.find(static_cast<unsigned char*>(address));
+  if (it != blocks.end()) {
+    OwnerEntry *entry = it->second.second;
+    if (entry != 0) {
+      entry->owner = 0;
+      free_owner_entries.push_back(entry);
+    }
+    blocks.erase(it);
+  }
+  PutRange(static_cast<unsigned char*>(address), size);
+}
+
+void CodeArena::SetOwner(void *address, void *owner) {
+  ScopedLock lock(mutex);
+  std::map<unsigned char*, std::pair<std::size_t, OwnerEntry*> >::iterator
+    it = blocks.find(static_cast<unsigned char*>(address));
+  if (it == blocks.end()) {
+    return;
+  }
+  OwnerEntry *entry = it->second.second;
+  if (entry == 0) {
+    entry = NewOwnerEntry();
+    entry->start = it->first;
+    entry->size = it->second.first;
+    it->second.second = entry;
+  }
+  entry->owner = owner;
+}
+
+void *CodeArena::FindOwner(const void *address,
+                           void **block,
+                           std::size_t *block_size) {
+  const unsigned char *ptr = static_cast<const unsigned char*>(address);
+
+  // No lock: this is called from trap handlers. An entry is used only if
+  // its owner is the same before and after reading the other fields.
+  for (const OwnerChunk *chunk = &owner_chunks;
+       chunk != 0;
+       chunk = chunk->next) {
+    std::size_t count = chunk->count;
+    for (std::size_t i = 0; i < count; i++) {
+      const OwnerEntry &entry = chunk->entries[i];
+      void *owner = entry.owner;
+      if (owner == 0) {
+        continue;
+      }
+      unsigned char *start = entry.start;
+      std::size_t size = entry.size;
+      if (ptr >= start && ptr < start + size && entry.owner == owner) {
+        *block = start;
+        *block_size = size;
+        return owner;
+      }
+    }
+  }
+  return 0;
+}
+
+} // namespace amxjit
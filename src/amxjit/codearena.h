@@ -0,0 +1,56 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef AMXJIT_CODEARENA_H
+#define AMXJIT_CODEARENA_H
+
+#include <cstddef>
+
+namespace amxjit {
+
+// CodeArena hands out pages for compiled code from large regions that are
+// shared by all scripts, so that their code stays close together and can
+// be backed by huge pages. Freed pages are reused, e.g. when a filterscript
+// is reloaded, instead of being returned to the system.
+//
+// Pages are readable and writable when they're allocated or freed.
+class CodeArena {
+ public:
+  static void *Allocate(std::size_t size);
+  static void Free(void *address, std::size_t size);
+
+  // Each allocated block can have an owner (the runtime data of the script
+  // its code belongs to), so that faults in the code can be traced back to
+  // the script. FindOwner() returns 0 for addresses outside of owned blocks
+  // and the block's start and size otherwise. It takes no locks, so it can
+  // be called from a trap handler.
+  static void SetOwner(void *address, void *owner);
+  static void *FindOwner(const void *address,
+                         void **block,
+                         std::size_t *block_size);
+};
+
+} // namespace amxjit
+
+#endif // !AMXJIT_CODEARENA_H
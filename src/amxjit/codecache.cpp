@@ -0,0 +1,236 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include "codecache.h"
+#include "platform.h"
+
+namespace amxjit {
+namespace {
+
+const char kMagic[8] = {'A', 'M', 'X', 'J', 'I', 'T', 'C', '1'};
+
+void WriteValue(std::ostream &stream, uint32_t value) {
+  stream.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void WriteValue(std::ostream &stream, uint64_t value) {
+  stream.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void WriteFixups(std::ostream &stream,
+                 const std::vector<std::pair<uint32_t, uint32_t> > &fixups) {
+  WriteValue(stream, static_cast<uint32_t>(fixups.size()));
+  for (std::vector<std::pair<uint32_t, uint32_t> >::const_iterator it =
+         fixups.begin();
+       it != fixups.end(); it++) {
+    WriteValue(stream, it->first);
+    WriteValue(stream, it->second);
+  }
+}
+
+bool ReadValue(std::istream &stream, uint32_t &value) {
+  return stream.read(reinterpret_cast<char*>(&value), sizeof(value)).good();
+}
+
+bool ReadValue(std::istream &stream, uint64_t &value) {
+  return stream.read(reinterpret_cast<char*>(&value), sizeof(value)).good();
+}
+
+// Returns the number of bytes left in the stream. The counts read from a
+// file are checked against this before anything is allocated for them so
+// that a truncated or damaged file can't make the plugin run out of memory.
+uint64_t GetRemainingSize(std::istream &stream, std::streamoff file_size) {
+  std::streamoff position = stream.tellg();
+  if (position < 0 || position > file_size) {
+    return 0;
+  }
+  return static_cast<uint64_t>(file_size - position);
+}
+
+bool ReadFixups(std::istream &stream,
+                std::streamoff file_size,
+                std::vector<std::pair<uint32_t, uint32_t> > &fixups) {
+  uint32_t count;
+  if (!ReadValue(stream, count)
+      || static_cast<uint64_t>(count) * 8
+           > GetRemainingSize(stream, file_size)) {
+    return false;
+  }
+  fixups.reserve(count);
+  for (uint32_t i = 0; i < count; i++) {
+    std::pair<uint32_t, uint32_t> fixup;
+    if (!ReadValue(stream, fixup.first) || !ReadValue(stream, fixup.second)) {
+      return false;
+    }
+    fixups.push_back(fixup);
+  }
+  return true;
+}
+
+} // anonymous namespace
+
+Hasher::Hasher():
+  hash_(14695981039346656037ULL)
+{
+}
+
+void Hasher::Update(const void *data, std::size_t size) {
+  const unsigned char *bytes = static_cast<const unsigned char*>(data);
+  for (std::size_t i = 0; i < size; i++) {
+    hash_ ^= bytes[i];
+    hash_ *= 1099511628211ULL;
+  }
+}
+
+void Hasher::Update(uint32_t value) {
+  Update(&value, sizeof(value));
+}
+
+void Hasher::Update(const char *string) {
+  // Include the terminating zero so that adjacent strings can't run into
+  // each other.
+  Update(string, std::strlen(string) + 1);
+}
+
+CodeCache::CodeCache(const std::string &directory):
+  directory_(directory)
+{
+}
+
+bool CodeCache::Load(uint64_t key, CodeImage &image) const {
+  std::ifstream file(GetPath(key).c_str(), std::ios::in | std::ios::binary);
+  if (!file.is_open()) {
+    return false;
+  }
+
+  std::streamoff file_size = file.seekg(0, std::ios::end).tellg();
+  if (file_size < 0 || !file.seekg(0, std::ios::beg).good()) {
+    return false;
+  }
+
+  char magic[sizeof(kMagic)];
+  if (!file.read(magic, sizeof(magic)).good()
+      || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0) {
+    return false;
+  }
+
+  uint32_t code_size;
+  if (!ReadValue(file, image.key)
+      || image.key != key
+      || !ReadValue(file, image.base)
+      || !ReadValue(file, code_size)) {
+    return false;
+  }
+
+  uint32_t num_internal_fixups;
+  if (!ReadValue(file, num_internal_fixups)
+      || static_cast<uint64_t>(num_internal_fixups) * 4
+           > GetRemainingSize(file, file_size)) {
+    return false;
+  }
+  image.internal_fixups.resize(num_internal_fixups);
+  for (uint32_t i = 0; i < num_internal_fixups; i++) {
+    if (!ReadValue(file, image.internal_fixups[i])) {
+      return false;
+    }
+  }
+  if (!ReadFixups(file, file_size, image.runtime_fixups)
+      || !ReadFixups(file, file_size, image.native_fixups)
+      || code_size > GetRemainingSize(file, file_size)) {
+    return false;
+  }
+
+  image.code.resize(code_size);
+  if (code_size == 0
+      || !file.read(reinterpret_cast<char*>(&image.code[0]),
+                    code_size).good()) {
+    return false;
+  }
+  return true;
+}
+
+bool CodeCache::Store(const CodeImage &image) const {
+  if (image.code.empty()) {
+    return false;
+  }
+
+  MakeDirectory(directory_.c_str());
+
+  // Write to a temporary file first so that a server that is started at
+  // the same time never sees an incomplete file. The name includes the
+  // process ID, and the image's address to tell apart threads of the same
+  // process, so that two writers never share a temporary file.
+  std::string path = GetPath(image.key);
+  char suffix[64];
+  std::sprintf(suffix, ".%lu.%p.tmp", GetProcessId(),
+               static_cast<const void*>(&image));
+  std::string temp_path = path + suffix;
+  {
+    std::ofstream file(temp_path.c_str(),
+                       std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+      return false;
+    }
+
+    file.write(kMagic, sizeof(kMagic));
+    WriteValue(file, image.key);
+    WriteValue(file, image.base);
+    WriteValue(file, static_cast<uint32_t>(image.code.size()));
+    WriteValue(file, static_cast<uint32_t>(image.internal_fixups.size()));
+    for (std::vector<uint32_t>::const_iterator it =
+           image.internal_fixups.begin();
+         it != image.internal_fixups.end(); it++) {
+      WriteValue(file, *it);
+    }
+    WriteFixups(file, image.runtime_fixups);
+    WriteFixups(file, image.native_fixups);
+    file.write(reinterpret_cast<const char*>(&image.code[0]),
+               image.code.size());
+    if (!file.good()) {
+      file.close();
+      std::remove(temp_path.c_str());
+      return false;
+    }
+  }
+
+  std::remove(path.c_str());
+  if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+    std::remove(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::string CodeCache::GetPath(uint64_t key) const {
+  char name[32];
+  std::sprintf(name, "%08x%08x.bin",
+               static_cast<unsigned int>(key >> 32),
+               static_cast<unsigned int>(key & 0xFFFFFFFF));
+  return directory_ + "/" + name;
+}
+
+} // namespace amxjit
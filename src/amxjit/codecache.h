@@ -0,0 +1,95 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef AMXJIT_CODECACHE_H
+#define AMXJIT_CODECACHE_H
+
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+#include "cstdint.h"
+#include "macros.h"
+
+namespace amxjit {
+
+// Computes a 64-bit FNV-1a hash of a sequence of bytes.
+class Hasher {
+ public:
+  Hasher();
+
+  void Update(const void *data, std::size_t size);
+  void Update(uint32_t value);
+  void Update(const char *string);
+
+  uint64_t digest() const { return hash_; }
+
+ private:
+  uint64_t hash_;
+};
+
+// CodeImage is compiled code in a form that can be loaded at a different
+// address and into a different process.
+struct CodeImage {
+  CodeImage(): key(), base() {}
+
+  uint64_t key;
+
+  // Address at which the code was located when the image was made.
+  uint32_t base;
+  std::vector<unsigned char> code;
+
+  // Offsets of absolute pointers into the code itself.
+  std::vector<uint32_t> internal_fixups;
+
+  // Offsets of relative calls to runtime functions outside of the code,
+  // along with the function index.
+  std::vector<std::pair<uint32_t, uint32_t> > runtime_fixups;
+
+  // Offsets of absolute addresses of native functions, along with the
+  // native index.
+  std::vector<std::pair<uint32_t, uint32_t> > native_fixups;
+};
+
+// CodeCache stores code images in files named after their keys.
+class CodeCache {
+ public:
+  explicit CodeCache(const std::string &directory);
+
+  bool Load(uint64_t key, CodeImage &image) const;
+  bool Store(const CodeImage &image) const;
+
+ private:
+  std::string GetPath(uint64_t key) const;
+
+ private:
+  std::string directory_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(CodeCache);
+};
+
+} // namespace amxjit
+
+#endif // !AMXJIT_CODECACHE_H
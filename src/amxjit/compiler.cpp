@@ -57,8 +57,84 @@ void Compiler::SetDebugFlags(unsigned int flags) {
   impl_->SetDebugFlags(flags);
 }
 
+void Compiler::SetSpecializationBudget(unsigned int budget) {
+  impl_->SetSpecializationBudget(budget);
+}
+
+void Compiler::SetEvalStepLimit(unsigned int limit) {
+  impl_->SetEvalStepLimit(limit);
+}
+
+void Compiler::SetReadOnlyDataEnabled(bool flag) {
+  impl_->SetReadOnlyDataEnabled(flag);
+}
+
+void Compiler::SetDeadCodeEliminationEnabled(bool flag) {
+  impl_->SetDeadCodeEliminationEnabled(flag);
+}
+
+void Compiler::SetFunctionReorderingEnabled(bool flag) {
+  impl_->SetFunctionReorderingEnabled(flag);
+}
+
+void Compiler::SetBranchRelaxationEnabled(bool flag) {
+  impl_->SetBranchRelaxationEnabled(flag);
+}
+
+void Compiler::SetLazyCompilationEnabled(bool flag) {
+  impl_->SetLazyCompilationEnabled(flag);
+}
+
+void Compiler::SetThreadCount(unsigned int count) {
+  impl_->SetThreadCount(count);
+}
+
+void Compiler::SetCacheDirectory(const char *directory) {
+  impl_->SetCacheDirectory(directory);
+}
+
+void Compiler::SetCacheTag(const char *tag) {
+  impl_->SetCacheTag(tag);
+}
+
+void Compiler::SetImageDirectory(const char *directory) {
+  impl_->SetImageDirectory(directory);
+}
+
+void Compiler::SetTieredCompilationEnabled(bool flag) {
+  impl_->SetTieredCompilationEnabled(flag);
+}
+
+void Compiler::SetTierUpThreshold(unsigned int threshold) {
+  impl_->SetTierUpThreshold(threshold);
+}
+
+void Compiler::SetTierUpLogger(Logger *logger) {
+  impl_->SetTierUpLogger(logger);
+}
+
+void Compiler::SetResumeEnabled(bool flag) {
+  impl_->SetResumeEnabled(flag);
+}
+
+void Compiler::SetInlineNativesEnabled(bool flag) {
+  impl_->SetInlineNativesEnabled(flag);
+}
+
+void Compiler::SetDataSnapshot(const unsigned char *data) {
+  impl_->SetDataSnapshot(data);
+}
+
 CodeBuffer *Compiler::Compile(AMXRef amx) {
   return impl_->Compile(amx);
 }
 
+bool Compiler::CompileImage(AMXRef amx, const char *directory) {
+  return impl_->CompileImage(amx, directory);
+}
+
+bool Compiler::InstallTrapHandler() {
+  return CompilerImpl::InstallTrapHandler();
+}
+
 } // namespace amxjit
@@ -25,6 +25,9 @@
 #ifndef AMXJIT_COMPILER_H
 #define AMXJIT_COMPILER_H
 
+#include <cstddef>
+#include <utility>
+#include <vector>
 #include "amxref.h"
 #include "macros.h"
 
@@ -34,7 +37,7 @@ class CompilerImpl;
 class Instruction;
 class Logger;
 
-typedef int (AMXAPI *CodeEntryPoint)(cell index, cell *retval);
+typedef int (AMXAPI *CodeEntryPoint)(AMX *amx, cell index, cell *retval);
 
 enum DebugFlags {
   DEBUG_LOGGING = 1,
@@ -49,14 +52,40 @@ class CompileErrorHandler {
 
 class CodeBuffer {
  public:
-  CodeBuffer(void *code);
+  CodeBuffer(void *code, std::size_t size);
   virtual ~CodeBuffer();
 
+  // Size of the generated code, including the runtime data that precedes
+  // it.
+  std::size_t size() const { return size_; }
+
+  // Code may be shared by AMX instances of the same script, so the
+  // instance is passed to the entry point on each call.
   CodeEntryPoint GetEntryPoint() const;
+
+  // Releases the code. Shared code is freed when its last user releases it.
   void Delete();
 
+  // Prepares a call stopped by the interpreter with AMX_ERR_SLEEP to be
+  // continued in compiled code with AMX_EXEC_CONT: return addresses on the
+  // AMX stack are replaced with their counterparts in the compiled code.
+  // Returns false and leaves the stack intact if this is not possible.
+  bool TranslateFrames(AMXRef amx) const;
+
+  // Makes calls to natives go to their current addresses. Should be called
+  // when natives are registered or replaced after compilation. Code shared
+  // with other instances is copied first; the returned buffer replaces this
+  // one, which is released if it's not the same.
+  CodeBuffer *RebindNatives(AMXRef amx);
+
  private:
+  friend class CompilerImpl;
+
   void *code_;
+  std::size_t size_;
+
+  // Addresses of natives embedded in the code, along with native indexes.
+  std::vector<std::pair<unsigned char*, cell> > native_sites_;
 
  private:
   AMXJIT_DISALLOW_COPY_AND_ASSIGN(CodeBuffer);
@@ -72,9 +101,59 @@ class Compiler {
   void SetSysreqDEnabled(bool flag);
   void SetSleepEnabled(bool flag);
   void SetDebugFlags(unsigned int flags);
+  void SetSpecializationBudget(unsigned int budget);
+  void SetEvalStepLimit(unsigned int limit);
+  void SetReadOnlyDataEnabled(bool flag);
+  void SetDeadCodeEliminationEnabled(bool flag);
+  void SetFunctionReorderingEnabled(bool flag);
+  void SetBranchRelaxationEnabled(bool flag);
+  void SetLazyCompilationEnabled(bool flag);
+  void SetThreadCount(unsigned int count);
+
+  // Compiled code is saved to and loaded from this directory if set. The
+  // tag is included in the cache key (e.g. the plugin version).
+  void SetCacheDirectory(const char *directory);
+  void SetCacheTag(const char *tag);
+
+  // Code made ahead of time with CompileImage() is loaded from this
+  // directory if there is an image for the script.
+  void SetImageDirectory(const char *directory);
+
+  // In tiered mode the script is first compiled without optimizations and
+  // with a counter in each function. Functions whose counter reaches the
+  // threshold are recompiled with optimizations on a background thread.
+  // Tier-ups are reported to the tier-up logger if set; it must outlive
+  // the code.
+  void SetTieredCompilationEnabled(bool flag);
+  void SetTierUpThreshold(unsigned int threshold);
+  void SetTierUpLogger(Logger *logger);
+
+  // Makes it possible to continue calls started in the interpreter (see
+  // CodeBuffer::TranslateFrames()). Sleep support implies this.
+  void SetResumeEnabled(bool flag);
+
+  // Calls to natives whose addresses are known at compile time switch
+  // stacks and call the native right at the call site instead of going
+  // through a shared helper. Requires SYSREQ.D and is ignored with sleep.
+  void SetInlineNativesEnabled(bool flag);
+
+  // Makes the compiler read global data from a copy instead of the AMX,
+  // for when the script runs while it's being compiled. The copy must stay
+  // valid until Compile() returns.
+  void SetDataSnapshot(const unsigned char *data);
 
   CodeBuffer *Compile(AMXRef amx);
 
+  // Compiles a script and saves the code to a file in the given directory,
+  // to be loaded later with SetImageDirectory().
+  bool CompileImage(AMXRef amx, const char *directory);
+
+  // Makes division by zero and invalid memory accesses in compiled code
+  // halt the script with AMX_ERR_DIVIDE and AMX_ERR_MEMACCESS instead of
+  // crashing the process. Other faults go to the previous handler. Should
+  // be called only once.
+  static bool InstallTrapHandler();
+
  private:
   CompilerImpl *impl_;
 
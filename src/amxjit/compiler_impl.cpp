@@ -25,16 +25,25 @@
 #include <algorithm>
 #include <cassert>
 #include <cstddef>
+#include <cstdio>
 #include <cstring>
 #include <string>
+#include <vector>
+#include "codearena.h"
+#include "codecache.h"
 #include "compiler.h"
 #include "compiler_impl.h"
 #include "cstdint.h"
 #include "disasm.h"
+#include "evaluator.h"
 #include "logger.h"
 #include "platform.h"
+#include "program.h"
+#include "specializer.h"
+#include "writeanalysis.h"
 
 using asmjit::Label;
+using asmjit::X86GpReg;
 using asmjit::x86::byte_ptr;
 using asmjit::x86::word_ptr;
 using asmjit::x86::dword_ptr;
@@ -71,8 +80,28 @@ struct RuntimeInfoBlock {
   cell reset_hea;
   intptr_t instr_table;
   intptr_t instr_table_size;
+  intptr_t lazy_code;
+  intptr_t exec_return;
+  intptr_t data_size;
+  intptr_t public_table;
+  intptr_t public_table_size;
+  intptr_t code_buffer;
+  intptr_t native_caches;
+  intptr_t native_caches_size;
+  intptr_t halt_helper;
+  intptr_t code_start;
+  cell hea;
 };
 
+// Each SYSREQ.PRI instruction has a small cache of native indexes and
+// addresses. The first entry is checked inline, the rest by the helper.
+struct NativeCacheEntry {
+  cell index;
+  cell address;
+};
+
+const int kNativeCacheSize = 4;
+
 asmjit::JitRuntime jit_runtime;
 
 cell AMXJIT_CDECL GetPublicAddress(AMX *amx, int index) {
@@ -94,18 +123,12 @@ class InstrTableEntry {
     return e1.address < e2.address;
   }
 
-  static bool CompareByJITPtr(
-    const InstrTableEntry &e1, const InstrTableEntry &e2)
-  {
-    return e1.ptr < e2.ptr;
-  }
-
  public:
   cell address;
   uintptr_t ptr;
 };
 
-uintptr_t AMXJIT_CDECL GetJITInstrPtr(cell address, RuntimeInfoBlock *rib) {
+InstrTableEntry *FindInstrTableEntry(RuntimeInfoBlock *rib, cell address) {
   assert(rib->instr_table != 0);
   assert(rib->instr_table_size > 0);
 
@@ -121,7 +144,15 @@ uintptr_t AMXJIT_CDECL GetJITInstrPtr(cell address, RuntimeInfoBlock *rib) {
     target,
     InstrTableEntry::CompareByAMXAddress);
   if (result != last && result->address == address) {
-    return result->ptr;
+    return result;
+  }
+  return 0;
+}
+
+uintptr_t AMXJIT_CDECL GetJITInstrPtr(cell address, RuntimeInfoBlock *rib) {
+  InstrTableEntry *entry = FindInstrTableEntry(rib, address);
+  if (entry != 0) {
+    return entry->ptr;
   }
   return 0;
 }
@@ -130,23 +161,288 @@ cell AMXJIT_CDECL GetANXAddressByJITInstrPtr(uintptr_t ptr, RuntimeInfoBlock *ri
   assert(rib->instr_table != 0);
   assert(rib->instr_table_size > 0);
 
+  // The table is sorted by AMX address. Code is not necessarily laid out
+  // in the same order (see function reordering and lazy compilation), so
+  // this has to be a linear search. It's only used for sleep.
   InstrTableEntry *instr_table =
     reinterpret_cast<InstrTableEntry*>(rib->instr_table);
-  InstrTableEntry target(0, ptr);
-
-  InstrTableEntry *first = instr_table;
-  InstrTableEntry *last = instr_table + rib->instr_table_size;
-  InstrTableEntry *result = std::lower_bound(
-    first,
-    last,
-    target,
-    InstrTableEntry::CompareByJITPtr);
-  if (result != last && result->ptr == ptr) {
-    return result->address;
+  for (intptr_t i = 0; i < rib->instr_table_size; i++) {
+    if (instr_table[i].ptr == ptr) {
+      return instr_table[i].address;
+    }
   }
   return 0;
 }
 
+uintptr_t AMXJIT_CDECL LazyCompile(cell address, RuntimeInfoBlock *rib) {
+  LazyCodeBuffer *code = reinterpret_cast<LazyCodeBuffer*>(rib->lazy_code);
+  return CompilerImpl::CompileLazyFunction(code, address);
+}
+
+uintptr_t AMXJIT_CDECL LateBindNative(cell index,
+                                      unsigned char *call_end,
+                                      uintptr_t sysreq_d_helper,
+                                      AMX *amx,
+                                      RuntimeInfoBlock *rib) {
+  CodeBuffer *code = reinterpret_cast<CodeBuffer*>(rib->code_buffer);
+  return CompilerImpl::BindNative(code, amx, index, call_end,
+                                  sysreq_d_helper);
+}
+
+// Puts the native in front of the cache, dropping the least recently added
+// entry.
+cell AMXJIT_CDECL CacheNative(AMX *amx,
+                              cell index,
+                              NativeCacheEntry *entries) {
+  cell address = AMXRef(amx).GetNativeAddress(index);
+  if (address != 0) {
+    std::memmove(entries + 1,
+                 entries,
+                 (kNativeCacheSize - 1) * sizeof(NativeCacheEntry));
+    entries[0].index = index;
+    entries[0].address = address;
+  }
+  return address;
+}
+
+// Stack used by the trap handler below the address it's given as its stack
+// pointer, with some to spare.
+const uintptr_t kTrapHandlerStackSize = 1024;
+
+// Turns a fault in compiled code into an AMX error, as if the code called
+// HaltHelper right at the faulting instruction: division by zero becomes
+// AMX_ERR_DIVIDE, just like in the interpreter, and access to memory that
+// isn't mapped becomes AMX_ERR_MEMACCESS. This only covers accesses that
+// fault: an out-of-bounds LOAD.I or STOR.I that lands in mapped memory is
+// not caught, unlike in the interpreter. Faults outside of instruction
+// code, e.g. in the helpers or natives, are left alone.
+//
+// This runs in a signal handler, so it must not take locks or allocate.
+bool HandleTrap(Trap trap, TrapContext &context) {
+  void *block;
+  std::size_t block_size;
+  void *owner = CodeArena::FindOwner(reinterpret_cast<void*>(context.eip),
+                                     &block,
+                                     &block_size);
+  if (owner == 0) {
+    return false;
+  }
+
+  RuntimeInfoBlock *rib = reinterpret_cast<RuntimeInfoBlock*>(owner);
+  uintptr_t base = reinterpret_cast<uintptr_t>(owner);
+  if (block == owner
+      && context.eip < base + static_cast<uintptr_t>(rib->code_start)) {
+    return false;
+  }
+
+  // HaltHelper saves the stack pointer as STK, so it must point into the
+  // AMX stack (and have room for the return address). The code keeps HEA
+  // in the runtime info block; amx->hea is out of date while it runs.
+  AMX *amx = reinterpret_cast<AMX*>(rib->amx);
+  uintptr_t data = reinterpret_cast<uintptr_t>(AMXRef(amx).data());
+  if (context.esp <= data + rib->hea
+      || context.esp > data + amx->stp) {
+    return false;
+  }
+
+  // Without a trap stack of its own (always on Windows) the thread gets
+  // the exception frame pushed right below ESP, onto the AMX stack. If it
+  // reached the heap, the script's memory is damaged and there is no point
+  // in going on.
+  if (context.handler_esp > data
+      && context.handler_esp <= data + amx->stp
+      && context.handler_esp - kTrapHandlerStackSize
+         < data + static_cast<uintptr_t>(rib->hea)) {
+    return false;
+  }
+
+  // The instruction table points to the start of each instruction, so the
+  // faulting one is the closest entry at or before EIP in the same block.
+  // Its code ends where the code of the next instruction begins, which is
+  // checked because code without entries follows the last instruction of
+  // a function (specialized copies, error paths, other functions if they
+  // are reordered). A fault there leaves CIP as it is.
+  InstrTableEntry *instr_table =
+    reinterpret_cast<InstrTableEntry*>(rib->instr_table);
+  uintptr_t block_start = reinterpret_cast<uintptr_t>(block);
+  uintptr_t block_end = block_start + block_size;
+  intptr_t instr = -1;
+  for (intptr_t i = 0; i < rib->instr_table_size; i++) {
+    uintptr_t ptr = instr_table[i].ptr;
+    if (ptr >= block_start
+        && ptr <= context.eip
+        && (instr < 0 || ptr > instr_table[instr].ptr)) {
+      instr = i;
+    }
+  }
+  if (instr >= 0) {
+    intptr_t next = -1;
+    for (intptr_t i = 0; i < rib->instr_table_size; i++) {
+      uintptr_t ptr = instr_table[i].ptr;
+      if (ptr > instr_table[instr].ptr
+          && ptr < block_end
+          && (next < 0 || ptr < instr_table[next].ptr)) {
+        next = i;
+      }
+    }
+    if (next == instr + 1) {
+      amx->cip = instr_table[instr].address;
+    }
+  }
+
+  context.esp -= 4;
+  *reinterpret_cast<uintptr_t*>(context.esp) = context.eip;
+  context.edi = trap == TRAP_DIVIDE ? AMX_ERR_DIVIDE : AMX_ERR_MEMACCESS;
+  context.eip = base + static_cast<uintptr_t>(rib->halt_helper);
+  return true;
+}
+
+uintptr_t AMXJIT_CDECL RequestTierUp(cell function,
+                                     cell target,
+                                     RuntimeInfoBlock *rib) {
+  TieredCodeBuffer *code = reinterpret_cast<TieredCodeBuffer*>(rib->lazy_code);
+  return CompilerImpl::TierUp(code, function, target);
+}
+
+// Counters of functions that have been recompiled (or failed to compile)
+// are set to this value so that they practically never run out again.
+const uint32_t kTierUpDisabled = 0x7fffffff;
+
+// Step limit for compile-time evaluation in the optimizing tier if it's
+// not set explicitly.
+const unsigned int kTierUpEvalSteps = 10000;
+
+bool IsBackwardJump(const Instruction &instr, cell code_base) {
+  switch (instr.opcode().GetId()) {
+    case OP_JUMP_PRI:
+    case OP_JREL:
+      return false;
+    default:
+      return instr.opcode().IsJump()
+             && instr.operand() - code_base < instr.address();
+  }
+}
+
+// Bump this when the layout of generated code changes.
+const uint32_t kCacheFormatVersion = 8;
+
+// Functions called from generated code. Calls to them are relocated when
+// loading code from the cache.
+const uintptr_t runtime_functions[] = {
+  reinterpret_cast<uintptr_t>(&GetPublicAddress),
+  reinterpret_cast<uintptr_t>(&GetJITInstrPtr),
+  reinterpret_cast<uintptr_t>(&GetANXAddressByJITInstrPtr),
+  reinterpret_cast<uintptr_t>(&LazyCompile),
+  reinterpret_cast<uintptr_t>(&LateBindNative),
+  reinterpret_cast<uintptr_t>(&CacheNative)
+};
+
+const std::size_t kNumRuntimeFunctions =
+  sizeof(runtime_functions) / sizeof(runtime_functions[0]);
+
+std::size_t AlignSize(std::size_t size, std::size_t alignment) {
+  return (size + alignment - 1) & ~(alignment - 1);
+}
+
+// Sets the target of a CALL or JMP rel32 instruction that ends at the given
+// address.
+void PatchRel32(unsigned char *instr_end, uintptr_t target) {
+  *reinterpret_cast<int32_t*>(instr_end - 4) =
+    static_cast<int32_t>(target - reinterpret_cast<uintptr_t>(instr_end));
+}
+
+// Turns a lazy compilation stub into a jump to the compiled function.
+void PatchStub(uintptr_t stub, uintptr_t target) {
+  unsigned char *code = reinterpret_cast<unsigned char*>(stub);
+  code[0] = 0xE9; // jmp rel32
+  PatchRel32(code + 5, target);
+}
+
+// Makes the pages of a range of finished code writable for as long as it's
+// in scope, so that it can be patched.
+class CodeWriteScope {
+ public:
+  CodeWriteScope(void *address, std::size_t size) {
+    std::size_t page_size = GetPageSize();
+    uintptr_t start = reinterpret_cast<uintptr_t>(address);
+    uintptr_t end = AlignSize(start + size, page_size);
+    start &= ~(page_size - 1);
+    start_ = reinterpret_cast<void*>(start);
+    size_ = end - start;
+    ProtectPages(start_, size_, false);
+  }
+
+  ~CodeWriteScope() {
+    ProtectPages(start_, size_, true);
+  }
+
+ private:
+  void *start_;
+  std::size_t size_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(CodeWriteScope);
+};
+
+// Maps the code that follows the runtime data of a buffer read-only and
+// executable. The data stays writable.
+void ProtectCode(void *code, std::size_t data_size, std::size_t size) {
+  if (data_size < size) {
+    ProtectPages(static_cast<unsigned char*>(code) + data_size,
+                 size - data_size,
+                 true);
+  }
+}
+
+// A group of functions compiled on a separate thread.
+struct Partition {
+  explicit Partition(LazyCodeBuffer *code):
+    code(code),
+    error(false),
+    thread(Compile, this)
+  {
+  }
+
+  static void Compile(void *arg) {
+    Partition *partition = static_cast<Partition*>(arg);
+    partition->error = !partition->compiler.CompileFunctions(
+      partition->code, partition->functions, partition->instr);
+  }
+
+  LazyCodeBuffer *code;
+  std::vector<const Function*> functions;
+  CompilerImpl compiler;
+  Instruction instr;
+  bool error;
+  Thread thread;
+};
+
+// Code that can be used by all AMX instances of a script, by cache key.
+// Scripts may be compiled on background threads, hence the mutex. The
+// state of a running call is kept in the code's runtime info block and is
+// saved by nested calls, so the instances must run on the same thread. The
+// image is copied for an instance whose natives change.
+struct SharedCode {
+  CodeBuffer *code;
+  const unsigned char *code_blob;
+  CodeImage image;
+  std::vector<cell> native_addresses;
+  int references;
+};
+
+// Late-bound natives are resolved by whichever instance calls them first,
+// so instances may share code only if they see the same natives.
+std::vector<cell> GetNativeAddresses(AMXRef amx) {
+  std::vector<cell> addresses;
+  for (int i = 0; i < amx.num_natives(); i++) {
+    addresses.push_back(amx.GetNativeAddress(i));
+  }
+  return addresses;
+}
+
+std::map<uint64_t, SharedCode> shared_code;
+Mutex shared_code_mutex;
+
 class AsmJitLoggerAdapter: public asmjit::Logger {
  public:
   AsmJitLoggerAdapter(amxjit::Logger *logger):
@@ -168,24 +464,217 @@ class AsmJitLoggerAdapter: public asmjit::Logger {
 
 } // anonymous namespace
 
-CodeBuffer::CodeBuffer(void *code):
-  code_(code)
+CodeBuffer::CodeBuffer(void *code, std::size_t size):
+  code_(code),
+  size_(size)
 {
   assert(code_ != 0);
 }
 
 CodeBuffer::~CodeBuffer() {
-  jit_runtime.release(code_);
+  CodeArena::Free(code_, size_);
 }
 
 CodeEntryPoint CodeBuffer::GetEntryPoint() const {
   return (CodeEntryPoint)*reinterpret_cast<void**>(code_);
 }
 
+bool CodeBuffer::TranslateFrames(AMXRef amx) const {
+  RuntimeInfoBlock *rib = reinterpret_cast<RuntimeInfoBlock*>(code_);
+  if (rib->exec_return == 0) {
+    return false;
+  }
+
+  // In lazy mode the code at CIP may not be compiled yet.
+  if (GetJITInstrPtr(amx->cip, rib) == 0) {
+    return false;
+  }
+
+  // Each frame holds the caller's FRM followed by the return address. The
+  // interpreter uses 0 as the return address of the outermost function.
+  std::vector<std::pair<cell*, cell> > return_addresses;
+  cell frm = amx->frm;
+  for (;;) {
+    if (frm < amx->stk
+        || frm + 2 * static_cast<cell>(sizeof(cell)) > amx->stp) {
+      return false;
+    }
+    cell *frame = reinterpret_cast<cell*>(amx.data() + frm);
+    if (frame[1] == 0) {
+      return_addresses.push_back(
+        std::make_pair(&frame[1], static_cast<cell>(rib->exec_return)));
+      break;
+    }
+    uintptr_t ptr = GetJITInstrPtr(frame[1], rib);
+    if (ptr == 0) {
+      return false;
+    }
+    return_addresses.push_back(
+      std::make_pair(&frame[1], static_cast<cell>(ptr)));
+    frm = frame[0];
+  }
+
+  for (std::vector<std::pair<cell*, cell> >::const_iterator it =
+         return_addresses.begin();
+       it != return_addresses.end(); it++) {
+    *it->first = it->second;
+  }
+  return true;
+}
+
+CodeBuffer *CodeBuffer::RebindNatives(AMXRef amx) {
+  // Other instances may share this code and still use the old natives, so
+  // the instance gets a copy of its own rather than patching theirs.
+  // If the copy can't be made, the instance keeps calling the old natives.
+  CodeBuffer *code = CompilerImpl::UnshareCode(this, amx);
+  if (code == 0) {
+    return this;
+  }
+  if (code != this) {
+    Delete();
+    return code;
+  }
+
+  for (std::vector<std::pair<unsigned char*, cell> >::const_iterator it =
+         native_sites_.begin();
+       it != native_sites_.end(); it++) {
+    cell address = amx.GetNativeAddress(it->second);
+    cell old_address;
+    std::memcpy(&old_address, it->first, sizeof(cell));
+    if (address != 0 && address != old_address) {
+      CodeWriteScope write_scope(it->first, sizeof(cell));
+      std::memcpy(it->first, &address, sizeof(cell));
+    }
+  }
+
+  // Calls by index fill the caches again as needed.
+  RuntimeInfoBlock *rib = reinterpret_cast<RuntimeInfoBlock*>(code_);
+  NativeCacheEntry *entries =
+    reinterpret_cast<NativeCacheEntry*>(rib->native_caches);
+  for (intptr_t i = 0; i < rib->native_caches_size * kNativeCacheSize; i++) {
+    entries[i].index = -1;
+    entries[i].address = 0;
+  }
+  return this;
+}
+
 void CodeBuffer::Delete() {
+  {
+    ScopedLock lock(shared_code_mutex);
+    for (std::map<uint64_t, SharedCode>::iterator it = shared_code.begin();
+         it != shared_code.end(); it++) {
+      if (it->second.code == this) {
+        if (--it->second.references > 0) {
+          return;
+        }
+        shared_code.erase(it);
+        break;
+      }
+    }
+  }
   delete this;
 }
 
+LazyCodeBuffer::LazyCodeBuffer(void *code, std::size_t size, AMXRef amx):
+  CodeBuffer(code, size),
+  amx_(amx),
+  runtime_info_(code),
+  program_(),
+  write_analysis_(),
+  enable_sysreq_d_(false),
+  enable_sleep_(false),
+  enable_inline_natives_(false),
+  debug_flags_(0),
+  halt_helper_(),
+  jump_helper_(),
+  jump_lookup_(),
+  sysreq_c_helper_(),
+  sysreq_d_helper_(),
+  sysreq_bind_helper_(),
+  native_cache_helper_()
+{
+}
+
+LazyCodeBuffer::~LazyCodeBuffer() {
+  for (std::vector<std::pair<void*, std::size_t> >::const_iterator it =
+         functions_code_.begin();
+       it != functions_code_.end(); it++) {
+    CodeArena::Free(it->first, it->second);
+  }
+  delete write_analysis_;
+  delete program_;
+}
+
+// Compiles a function of a tiered script on a separate thread.
+struct TierUpJob {
+  TierUpJob(TieredCodeBuffer *code, cell address):
+    code(code),
+    address(address),
+    function_code(),
+    time(0),
+    done(false),
+    thread(Compile, this)
+  {
+  }
+
+  ~TierUpJob() {
+    thread.Join();
+    if (function_code != 0) {
+      CodeArena::Free(function_code, compiler.code_size());
+    }
+  }
+
+  void Start() {
+    if (!thread.Start()) {
+      Compile(this);
+    }
+  }
+
+  bool IsDone() {
+    ScopedLock lock(mutex);
+    return done;
+  }
+
+  static void Compile(void *arg) {
+    TierUpJob *job = static_cast<TierUpJob*>(arg);
+    long start_time = GetTimeMilliseconds();
+    void *function_code =
+      job->compiler.CompileOptimizedFunction(job->code, job->address);
+    ScopedLock lock(job->mutex);
+    job->function_code = function_code;
+    job->time = GetTimeMilliseconds() - start_time;
+    job->done = true;
+  }
+
+  TieredCodeBuffer *code;
+  cell address;
+  CompilerImpl compiler;
+  void *function_code;
+  long time;
+  bool done;
+  Mutex mutex;
+  Thread thread;
+};
+
+TieredCodeBuffer::TieredCodeBuffer(void *code,
+                                   std::size_t size,
+                                   AMXRef amx):
+  LazyCodeBuffer(code, size, amx),
+  counters_(),
+  threshold_(0),
+  logger_(),
+  enable_read_only_data_(false),
+  eval_step_limit_(0),
+  analyzed_(false),
+  job_(),
+  total_time_(0)
+{
+}
+
+TieredCodeBuffer::~TieredCodeBuffer() {
+  delete job_;
+}
+
 CompilerImpl::CompilerImpl():
   asmjit_logger_(),
   asm_(&jit_runtime),
@@ -200,6 +689,8 @@ CompilerImpl::CompilerImpl():
   reset_esp_label_(asm_.newLabel()),
   reset_stk_label_(asm_.newLabel()),
   reset_hea_label_(asm_.newLabel()),
+  hea_label_(asm_.newLabel()),
+  public_table_label_(asm_.newLabel()),
   exec_label_(asm_.newLabel()),
   exec_helper_label_(asm_.newLabel()),
   exec_exit_label_(asm_.newLabel()),
@@ -210,21 +701,175 @@ CompilerImpl::CompilerImpl():
   reverse_jump_lookup_label_(asm_.newLabel()),
   sysreq_c_helper_label_(asm_.newLabel()),
   sysreq_d_helper_label_(asm_.newLabel()),
+  sysreq_bind_helper_label_(asm_.newLabel()),
+  lazy_compile_helper_label_(asm_.newLabel()),
+  tier_up_helper_label_(asm_.newLabel()),
+  tier_up_counters_label_(asm_.newLabel()),
+  native_caches_label_(asm_.newLabel()),
+  native_cache_helper_label_(asm_.newLabel()),
+  program_(),
+  write_analysis_(),
+  specializer_(),
+  specialization_(),
+  measure_jumps_(false),
+  lazy_code_(),
+  function_(),
+  link_functions_(false),
+  tier_up_function_(-1),
   logger_(),
   error_handler_(),
   enable_sysreq_d_(false),
-  debug_flags_(0)
+  enable_sleep_(false),
+  enable_read_only_data_(false),
+  enable_dead_code_elimination_(false),
+  enable_function_reordering_(false),
+  enable_branch_relaxation_(false),
+  enable_lazy_compilation_(false),
+  thread_count_(1),
+  image_stored_(false),
+  share_code_(false),
+  share_key_(0),
+  enable_tiered_compilation_(false),
+  enable_resume_(false),
+  enable_inline_natives_(false),
+  data_snapshot_(),
+  tier_up_threshold_(1000),
+  tier_up_logger_(),
+  debug_flags_(0),
+  specialization_budget_(0),
+  eval_step_limit_(0)
 {
 }
 
 CodeBuffer *CompilerImpl::Compile(AMXRef amx) {
   amx_ = amx;
 
+  // Instances of the same script (e.g. a filterscript loaded twice) share
+  // the code if it's compiled into a single buffer. The code doesn't refer
+  // to the AMX directly, it's passed to the entry point.
+  share_code_ = !enable_lazy_compilation_
+                && !enable_tiered_compilation_
+                && thread_count_ <= 1
+                && !measure_jumps_;
+
+  // Code compiled in lazy or parallel mode is spread across several
+  // buffers, and debug logging embeds pointers to strings, so it can't be
+  // cached.
+  bool use_cache = (!cache_directory_.empty()
+                    || !image_output_directory_.empty())
+                   && !enable_lazy_compilation_
+                   && !enable_tiered_compilation_
+                   && thread_count_ <= 1
+                   && logger_ == 0
+                   && (debug_flags_ & DEBUG_LOGGING) == 0;
+
+  // Hashing the whole script is not free, so it's only done when the hash
+  // is going to be used.
+  uint64_t script_hash = 0;
+  if (share_code_ || use_cache || !image_directory_.empty()) {
+    script_hash = GetScriptHash();
+  }
+
+  if (share_code_) {
+    share_key_ = GetCacheKey(script_hash);
+    CodeBuffer *code = FindSharedCode(share_key_);
+    if (code != 0) {
+      amx_.Reset();
+      return code;
+    }
+  }
+
+  // Images made ahead of time don't depend on the current options.
+  if (!image_directory_.empty()) {
+    CodeImage prebuilt_image;
+    if (CodeCache(image_directory_).Load(GetImageKey(script_hash),
+                                         prebuilt_image)) {
+      CodeBuffer *code = LoadCodeImage(prebuilt_image);
+      if (code != 0) {
+        amx_.Reset();
+        return code;
+      }
+    }
+  }
+
+  CodeImage image;
+  if (use_cache && !cache_directory_.empty()) {
+    CodeImage cached_image;
+    if (CodeCache(cache_directory_).Load(GetCacheKey(script_hash),
+                                         cached_image)) {
+      CodeBuffer *code = LoadCodeImage(cached_image);
+      if (code != 0) {
+        amx_.Reset();
+        return code;
+      }
+    }
+  }
+
+  // In lazy mode the analysis results are needed after compilation, so
+  // they are handed over to the code buffer.
+  Program *program = new Program(amx, data_snapshot_);
+  WriteAnalysis *write_analysis = new WriteAnalysis(*program);
+  Specializer specializer(*program);
+
+  // Parallel compilation reuses the lazy mode code layout: every function
+  // gets a stub, and then all functions are compiled at once.
+  bool parallel = thread_count_ > 1 && !enable_lazy_compilation_;
+
+  // In tiered mode the baseline code is compiled without analysis, which
+  // is done later for the optimizing tier. Optimized functions don't have
+  // entries in the instruction table, so sleep is not supported.
+  bool tiered = enable_tiered_compilation_
+                && !enable_lazy_compilation_
+                && !parallel
+                && !enable_sleep_;
+
+  if (!tiered
+      && (specialization_budget_ > 0
+       || eval_step_limit_ > 0
+       || enable_read_only_data_
+       || enable_dead_code_elimination_
+       || enable_function_reordering_
+       || enable_branch_relaxation_
+       || enable_lazy_compilation_
+       || parallel)
+      && program->Analyze()) {
+    program_ = program;
+    if (enable_read_only_data_ && write_analysis->Run()) {
+      write_analysis_ = write_analysis;
+    }
+    if (eval_step_limit_ > 0) {
+      FoldPureCalls();
+    }
+    // Specialized copies of functions don't have entries in the instruction
+    // table, so sleep would not be able to resume execution inside them.
+    if (specialization_budget_ > 0
+        && !enable_sleep_
+        && !enable_lazy_compilation_
+        && !parallel) {
+      specializer.set_budget(specialization_budget_);
+      specializer.Run();
+      specializer_ = &specializer;
+    }
+  }
+
+  bool lazy = (enable_lazy_compilation_ || parallel) && program_ != 0;
+
+  if (enable_branch_relaxation_ && program_ != 0 && !lazy) {
+    FindShortJumps(amx);
+  }
+
   EmitRuntimeInfo();
   EmitInstrTable();
+  EmitPublicTable();
+  EmitNativeCaches();
+  if (tiered) {
+    FindLoopHeaders();
+    EmitTierUpCounters();
+  }
+  EmitDataEnd();
   EmitExec();
   EmitExecHelper();
-  if (enable_sleep_) {
+  if (enable_sleep_ || enable_resume_) {
     EmitExecContHelper();
   }
   EmitHaltHelper();
@@ -233,6 +878,18 @@ CodeBuffer *CompilerImpl::Compile(AMXRef amx) {
   EmitJumpHelper();
   EmitSysreqCHelper();
   EmitSysreqDHelper();
+  EmitSysreqBindHelper();
+  EmitNativeCacheHelper();
+  if (lazy) {
+    EmitLazyCompileHelper();
+  }
+  if (tiered) {
+    EmitTierUpHelper();
+  }
+
+  // Faults before this point are not in AMX instructions (see HandleTrap).
+  reinterpret_cast<RuntimeInfoBlock*>(asm_.getBuffer())->code_start =
+    asm_.getCodeSize();
 
   if (logger_ != 0) {
     asmjit_logger_ = new AsmJitLoggerAdapter(logger_);
@@ -242,945 +899,2406 @@ CodeBuffer *CompilerImpl::Compile(AMXRef amx) {
     asm_.setLogger(asmjit_logger_);
   }
 
-  Disassembler disasm(amx);
+  // Normally the code is compiled in one piece, in bytecode order. With
+  // function reordering enabled each function is compiled separately.
+  std::vector<std::pair<cell, cell> > code_ranges;
+  if (lazy) {
+    // Functions are compiled when they are called for the first time.
+    EmitLazyStubs();
+  } else if (enable_function_reordering_ && program_ != 0) {
+    std::vector<const Function*> layout;
+    program_->GetLayout(layout);
+    for (std::vector<const Function*>::const_iterator it = layout.begin();
+         it != layout.end(); it++) {
+      code_ranges.push_back(
+        std::make_pair((*it)->address(), (*it)->end_address()));
+    }
+  } else {
+    code_ranges.push_back(
+      std::make_pair(0, static_cast<cell>(amx_.code_size())));
+  }
+
   Instruction instr;
   bool error = false;
 
-  while (!error && disasm.Decode(instr, error)) {
-    cell cip = instr.address();
+  for (std::vector<std::pair<cell, cell> >::const_iterator it =
+         code_ranges.begin();
+       !error && it != code_ranges.end(); it++) {
+    cell end_address = it->second;
 
-    // Align functions on 16-byte boundary.
-    if (instr.opcode().GetId() == OP_PROC) {
-      asm_.align(asmjit::kAlignCode, 16);
-    }
+    for (cell cip = it->first; cip < end_address; cip += instr.size()) {
+      if (!DecodeInstruction(amx_, cip, instr)) {
+        error = true;
+        break;
+      }
 
-    asm_.bind(GetLabel(cip));
-    instr_map_[cip] = asm_.getCodeSize();
+      if (IsDeadCode(cip)) {
+        continue;
+      }
 
-    if (asmjit_logger_ != 0) {
-      asmjit_logger_->logFormat(asmjit::kLoggerStyleComment,
-                                "%s; +%08x: %08x: %s\n",
-                                asmjit_logger_->getIndentation(),
-                                asm_.getCodeSize(),
-                                instr.address(),
-                                instr.ToString().c_str());
-    }
+      // Align functions on 16-byte boundary.
+      if (instr.opcode().GetId() == OP_PROC) {
+        asm_.align(asmjit::kAlignCode, 16);
+      }
 
-    // eax = PRI
-    // ecx = ALT
-    // ebp = FRM
-    // esp = STK
-    // ebx = data (amx->data or amx->base + amxhdr->dat)
+      asm_.bind(GetLabel(cip));
+      instr_map_[cip] = asm_.getCodeSize();
 
-    switch (instr.opcode().GetId()) {
-      case OP_LOAD_PRI:
-        // PRI = [address]
-        asm_.mov(eax, dword_ptr(ebx, instr.operand()));
-        break;
-      case OP_LOAD_ALT:
-        // ALT = [address]
-        asm_.mov(ecx, dword_ptr(ebx, instr.operand()));
-        break;
-      case OP_LOAD_S_PRI:
-        // PRI = [FRM + offset]
-        asm_.mov(eax, dword_ptr(ebp, instr.operand()));
-        break;
-      case OP_LOAD_S_ALT:
-        // ALT = [FRM + offset]
-        asm_.mov(ecx, dword_ptr(ebp, instr.operand()));
-        break;
-      case OP_LREF_PRI:
-        // PRI = [ [address] ]
-        asm_.mov(edx, dword_ptr(ebx, instr.operand()));
-        asm_.mov(eax, dword_ptr(ebx, edx));
-        break;
-      case OP_LREF_ALT:
-        // ALT = [ [address] ]
-        asm_.mov(edx, dword_ptr(ebx, + instr.operand()));
-        asm_.mov(ecx, dword_ptr(ebx, edx));
-        break;
-      case OP_LREF_S_PRI:
-        // PRI = [ [FRM + offset] ]
-        asm_.mov(edx, dword_ptr(ebp, instr.operand()));
-        asm_.mov(eax, dword_ptr(ebx, edx));
-        break;
-      case OP_LREF_S_ALT:
-        // PRI = [ [FRM + offset] ]
-        asm_.mov(edx, dword_ptr(ebp, instr.operand()));
-        asm_.mov(ecx, dword_ptr(ebx, edx));
+      if (tiered) {
+        if (instr.opcode().GetId() == OP_PROC) {
+          tier_up_function_ = cip;
+          EmitTierUpCounter(cip, cip);
+        } else if (tier_up_function_ >= 0
+                   && loop_headers_.find(cip) != loop_headers_.end()) {
+          EmitTierUpCounter(tier_up_function_, cip);
+        }
+      }
+
+      LogInstruction(instr);
+      if (!EmitInstruction(instr)) {
+        error = true;
         break;
-      case OP_LOAD_I:
-        // PRI = [PRI] (full cell)
-        asm_.mov(eax, dword_ptr(ebx, eax));
+      }
+    }
+
+    // Functions that don't end with a RETN or a jump fall through to the
+    // next one, which may be placed elsewhere now.
+    if (!error
+        && end_address < static_cast<cell>(amx_.code_size())
+        && !instr.opcode().IsTerminator()
+        && !IsDeadCode(instr.address())) {
+      asm_.jmp(GetLabel(end_address));
+    }
+  }
+
+  if (!error && specializer_ != 0) {
+    const std::vector<Specialization*> &specializations =
+      specializer_->specializations();
+    for (std::vector<Specialization*>::const_iterator it =
+           specializations.begin();
+         it != specializations.end(); it++) {
+      if (!EmitSpecialization(*it)) {
+        error = true;
         break;
-      case OP_LODB_I:
-        // PRI = "number" bytes from [PRI] (read 1/2/4 bytes)
-        switch (instr.operand()) {
-          case 1:
-            asm_.movzx(eax, byte_ptr(ebx, eax));
-            break;
-          case 2:
-            asm_.movzx(eax, word_ptr(ebx, eax));
-            break;
-          case 4:
-            asm_.mov(eax, dword_ptr(ebx, eax));
-            break;
+      }
+    }
+  }
+
+  if (!error) {
+    EmitErrorPaths();
+  }
+
+  if (error && error_handler_ != 0) {
+    error_handler_->Execute(instr);
+  }
+
+  CodeBuffer *code_buffer = 0;
+
+  LazyCodeBuffer *lazy_code = 0;
+
+  void *code_blob = 0;
+  if (!error) {
+    code_blob = MakeCode();
+    error = code_blob == 0;
+  }
+
+  if (!error) {
+
+    // Shared code keeps an image of itself, to be copied for an instance
+    // whose natives change later.
+    if ((use_cache || share_code_) && !lazy) {
+      bool relocatable = FindFixups(code_blob, image);
+      use_cache = use_cache && relocatable;
+      share_code_ = share_code_ && relocatable;
+    }
+
+    RuntimeInfoBlock *rib = reinterpret_cast<RuntimeInfoBlock*>(code_blob);
+    rib->amx = reinterpret_cast<intptr_t>(amx_.raw());
+    rib->exec += reinterpret_cast<intptr_t>(code_blob);
+    rib->instr_table += reinterpret_cast<intptr_t>(code_blob);
+    rib->public_table += reinterpret_cast<intptr_t>(code_blob);
+    rib->native_caches += reinterpret_cast<intptr_t>(code_blob);
+    if (rib->exec_return != 0) {
+      rib->exec_return += reinterpret_cast<intptr_t>(code_blob);
+    }
+    ProtectCode(code_blob, rib->data_size, asm_.getCodeSize());
+    CodeArena::SetOwner(code_blob, code_blob);
+
+    InstrTableEntry *ite =
+      reinterpret_cast<InstrTableEntry*>(rib->instr_table);
+
+    uintptr_t base = reinterpret_cast<uintptr_t>(code_blob);
+
+    uintptr_t *public_table = reinterpret_cast<uintptr_t*>(rib->public_table);
+    for (intptr_t i = 0; i < rib->public_table_size; i++) {
+      cell address = amx_.GetPublicAddress(static_cast<cell>(i - 1));
+      std::map<cell, std::ptrdiff_t>::const_iterator it =
+        instr_map_.find(address);
+      public_table[i] =
+        address != 0 && it != instr_map_.end() ? base + it->second : 0;
+    }
+
+    if (lazy) {
+      lazy_code = new LazyCodeBuffer(code_blob, asm_.getCodeSize(), amx_);
+      InitLazyCode(lazy_code, base);
+      for (std::map<cell, std::ptrdiff_t>::const_iterator it =
+             instr_map_.begin();
+           it != instr_map_.end(); it++) {
+        lazy_code->stubs_[it->first] = base + it->second;
+      }
+
+      // Every instruction gets an entry, but only the first instruction of
+      // each function has code (its stub) until the function is compiled.
+      Disassembler disasm(amx_);
+      while (disasm.Decode(instr)) {
+        if (IsDeadCode(instr.address())) {
+          continue;
         }
-        break;
-      case OP_CONST_PRI:
-        // PRI = value
-        if (instr.operand() == 0) {
-          asm_.xor_(eax, eax);
-        } else {
-          asm_.mov(eax, instr.operand());
+        std::map<cell, std::ptrdiff_t>::const_iterator it =
+          instr_map_.find(instr.address());
+        ite->address = instr.address();
+        ite->ptr = it != instr_map_.end() ? base + it->second : 0;
+        ite++;
+      }
+
+      rib->lazy_code = reinterpret_cast<intptr_t>(lazy_code);
+      rib->code_buffer = reinterpret_cast<intptr_t>(lazy_code);
+      code_buffer = lazy_code;
+    } else {
+      for (std::map<cell, std::ptrdiff_t>::const_iterator it =
+             instr_map_.begin();
+           it != instr_map_.end(); it++) {
+        ite->address = it->first;
+        ite->ptr = base + it->second;
+        ite++;
+      }
+
+      if (tiered) {
+        TieredCodeBuffer *tiered_code =
+          new TieredCodeBuffer(code_blob, asm_.getCodeSize(), amx_);
+        InitLazyCode(tiered_code, base);
+
+        // The baseline code of a function is its "stub": it's patched to
+        // jump to the optimized code.
+        for (std::map<cell, int>::const_iterator it =
+               tier_up_counters_.begin();
+             it != tier_up_counters_.end(); it++) {
+          tiered_code->stubs_[it->first] = base + instr_map_[it->first];
         }
-        break;
-      case OP_CONST_ALT:
-        // ALT = value
-        if (instr.operand() == 0) {
-          asm_.xor_(ecx, ecx);
-        } else {
-          asm_.mov(ecx, instr.operand());
+        tiered_code->counters_ = reinterpret_cast<uint32_t*>(
+          base + asm_.getLabelOffset(tier_up_counters_label_));
+        tiered_code->counter_index_ = tier_up_counters_;
+        tiered_code->loop_headers_ = loop_headers_;
+        tiered_code->threshold_ = std::max(tier_up_threshold_, 1u);
+        tiered_code->logger_ = tier_up_logger_;
+        tiered_code->enable_read_only_data_ = enable_read_only_data_;
+        tiered_code->eval_step_limit_ =
+          eval_step_limit_ > 0 ? eval_step_limit_ : kTierUpEvalSteps;
+
+        rib->lazy_code = reinterpret_cast<intptr_t>(tiered_code);
+        code_buffer = tiered_code;
+      } else {
+        if (use_cache || share_code_) {
+          FinishCodeImage(code_blob, image);
         }
-        break;
-      case OP_ADDR_PRI:
-        // PRI = FRM + offset
-        asm_.lea(eax, dword_ptr(ebp, instr.operand()));
-        asm_.sub(eax, ebx);
-        break;
-      case OP_ADDR_ALT:
-        // ALT = FRM + offset
-        asm_.lea(ecx, dword_ptr(ebp, instr.operand()));
-        asm_.sub(ecx, ebx);
-        break;
-      case OP_STOR_PRI:
-        // [address] = PRI
-        asm_.mov(dword_ptr(ebx, instr.operand()), eax);
-        break;
-      case OP_STOR_ALT:
-        // [address] = ALT
-        asm_.mov(dword_ptr(ebx, instr.operand()), ecx);
-        break;
-      case OP_STOR_S_PRI:
-        // [FRM + offset] = ALT
-        asm_.mov(dword_ptr(ebp, instr.operand()), eax);
-        break;
-      case OP_STOR_S_ALT:
-        // [FRM + offset] = ALT
-        asm_.mov(dword_ptr(ebp, instr.operand()), ecx);
-        break;
-      case OP_SREF_PRI:
-        // [ [address] ] = PRI
-        asm_.mov(edx, dword_ptr(ebx, instr.operand()));
-        asm_.mov(dword_ptr(ebx, edx), eax);
-        break;
-      case OP_SREF_ALT:
-        // [ [address] ] = ALT
-        asm_.mov(edx, dword_ptr(ebx, instr.operand()));
-        asm_.mov(dword_ptr(ebx, edx), ecx);
-        break;
-      case OP_SREF_S_PRI:
-        // [ [FRM + offset] ] = PRI
-        asm_.mov(edx, dword_ptr(ebp, instr.operand()));
-        asm_.mov(dword_ptr(ebx, edx), eax);
-        break;
-      case OP_SREF_S_ALT:
-        // [ [FRM + offset] ] = ALT
-        asm_.mov(edx, dword_ptr(ebp, instr.operand()));
-        asm_.mov(dword_ptr(ebx, edx), ecx);
-        break;
-      case OP_STOR_I:
-        // [ALT] = PRI (full cell)
-        asm_.mov(dword_ptr(ebx, ecx), eax);
-        break;
-      case OP_STRB_I:
-        // "number" bytes at [ALT] = PRI (write 1/2/4 bytes)
-        switch (instr.operand()) {
-          case 1:
-            asm_.mov(byte_ptr(ebx, ecx), al);
-            break;
-          case 2:
-            asm_.mov(word_ptr(ebx, ecx), ax);
-            break;
-          case 4:
-            asm_.mov(dword_ptr(ebx, ecx), eax);
-            break;
+        code_buffer = ShareCode(
+          new CodeBuffer(code_blob, asm_.getCodeSize()),
+          code_blob,
+          image);
+      }
+      rib->code_buffer = reinterpret_cast<intptr_t>(code_buffer);
+      AddNativeSites(code_buffer, base, native_fixups_);
+
+      if (use_cache) {
+        if (!cache_directory_.empty()) {
+          image.key = GetCacheKey(script_hash);
+          CodeCache(cache_directory_).Store(image);
         }
-        break;
-      case OP_LIDX:
-        // PRI = [ ALT + (PRI x cell size) ]
-        asm_.lea(edx, dword_ptr(ebx, ecx));
-        asm_.mov(eax, dword_ptr(edx, eax, 2));
-        break;
-      case OP_LIDX_B:
-        // PRI = [ ALT + (PRI << shift) ]
-        asm_.lea(edx, dword_ptr(ebx, ecx));
-        asm_.mov(eax, dword_ptr(edx, eax, instr.operand()));
-        break;
-      case OP_IDXADDR:
-        // PRI = ALT + (PRI x cell size) (calculate indexed address)
-        asm_.lea(eax, dword_ptr(ecx, eax, 2));
-        break;
-      case OP_IDXADDR_B:
-        // PRI = ALT + (PRI << shift) (calculate indexed address)
-        asm_.lea(eax, dword_ptr(ecx, eax, instr.operand()));
-        break;
-      case OP_ALIGN_PRI:
-        // Little Endian: PRI ^= cell size - number
-        #if BYTE_ORDER == LITTLE_ENDIAN
-          if (static_cast<std::size_t>(instr.operand()) < sizeof(cell)) {
-            asm_.xor_(eax, sizeof(cell) - instr.operand());
+        if (!image_output_directory_.empty()) {
+          image.key = GetImageKey(script_hash);
+          image_stored_ = CodeCache(image_output_directory_).Store(image);
+        }
+      }
+    }
+  }
+
+  if (lazy_code != 0) {
+    lazy_code->program_ = program;
+    if (write_analysis_ == 0) {
+      delete write_analysis;
+    }
+    if (parallel && !CompileInParallel(lazy_code)) {
+      lazy_code->Delete();
+      code_buffer = 0;
+    }
+  } else {
+    delete write_analysis;
+    delete program;
+  }
+
+  amx_.Reset();
+  program_ = 0;
+  write_analysis_ = 0;
+  specializer_ = 0;
+  folded_calls_.clear();
+  native_fixups_.clear();
+  tier_up_counters_.clear();
+  native_caches_.clear();
+  loop_headers_.clear();
+  tier_up_function_ = -1;
+
+  if (asmjit_logger_ != 0) {
+    asm_.setLogger(0);
+    delete asmjit_logger_;
+  }
+
+  return code_buffer;
+}
+
+bool CompilerImpl::EmitInstruction(const Instruction &instr) {
+  // eax = PRI
+  // ecx = ALT
+  // ebp = FRM
+  // esp = STK
+  // ebx = data (amx->data or amx->base + amxhdr->dat)
+
+  switch (instr.opcode().GetId()) {
+    case OP_LOAD_PRI: {
+      // PRI = [address]
+      cell value;
+      if (GetReadOnlyValue(instr.operand(), value)) {
+        EmitLoadConstant(eax, value);
+      } else {
+        asm_.mov(eax, dword_ptr(ebx, instr.operand()));
+      }
+      break;
+    }
+    case OP_LOAD_ALT: {
+      // ALT = [address]
+      cell value;
+      if (GetReadOnlyValue(instr.operand(), value)) {
+        EmitLoadConstant(ecx, value);
+      } else {
+        asm_.mov(ecx, dword_ptr(ebx, instr.operand()));
+      }
+      break;
+    }
+    case OP_LOAD_S_PRI:
+      // PRI = [FRM + offset]
+      asm_.mov(eax, dword_ptr(ebp, instr.operand()));
+      break;
+    case OP_LOAD_S_ALT:
+      // ALT = [FRM + offset]
+      asm_.mov(ecx, dword_ptr(ebp, instr.operand()));
+      break;
+    case OP_LREF_PRI:
+      // PRI = [ [address] ]
+      asm_.mov(edx, dword_ptr(ebx, instr.operand()));
+      asm_.mov(eax, dword_ptr(ebx, edx));
+      break;
+    case OP_LREF_ALT:
+      // ALT = [ [address] ]
+      asm_.mov(edx, dword_ptr(ebx, + instr.operand()));
+      asm_.mov(ecx, dword_ptr(ebx, edx));
+      break;
+    case OP_LREF_S_PRI:
+      // PRI = [ [FRM + offset] ]
+      asm_.mov(edx, dword_ptr(ebp, instr.operand()));
+      asm_.mov(eax, dword_ptr(ebx, edx));
+      break;
+    case OP_LREF_S_ALT:
+      // PRI = [ [FRM + offset] ]
+      asm_.mov(edx, dword_ptr(ebp, instr.operand()));
+      asm_.mov(ecx, dword_ptr(ebx, edx));
+      break;
+    case OP_LOAD_I:
+      // PRI = [PRI] (full cell)
+      asm_.mov(eax, dword_ptr(ebx, eax));
+      break;
+    case OP_LODB_I:
+      // PRI = "number" bytes from [PRI] (read 1/2/4 bytes)
+      switch (instr.operand()) {
+        case 1:
+          asm_.movzx(eax, byte_ptr(ebx, eax));
+          break;
+        case 2:
+          asm_.movzx(eax, word_ptr(ebx, eax));
+          break;
+        case 4:
+          asm_.mov(eax, dword_ptr(ebx, eax));
+          break;
+      }
+      break;
+    case OP_CONST_PRI:
+      // PRI = value
+      if (instr.operand() == 0) {
+        asm_.xor_(eax, eax);
+      } else {
+        asm_.mov(eax, instr.operand());
+      }
+      break;
+    case OP_CONST_ALT:
+      // ALT = value
+      if (instr.operand() == 0) {
+        asm_.xor_(ecx, ecx);
+      } else {
+        asm_.mov(ecx, instr.operand());
+      }
+      break;
+    case OP_ADDR_PRI:
+      // PRI = FRM + offset
+      asm_.lea(eax, dword_ptr(ebp, instr.operand()));
+      asm_.sub(eax, ebx);
+      break;
+    case OP_ADDR_ALT:
+      // ALT = FRM + offset
+      asm_.lea(ecx, dword_ptr(ebp, instr.operand()));
+      asm_.sub(ecx, ebx);
+      break;
+    case OP_STOR_PRI:
+      // [address] = PRI
+      asm_.mov(dword_ptr(ebx, instr.operand()), eax);
+      break;
+    case OP_STOR_ALT:
+      // [address] = ALT
+      asm_.mov(dword_ptr(ebx, instr.operand()), ecx);
+      break;
+    case OP_STOR_S_PRI:
+      // [FRM + offset] = ALT
+      asm_.mov(dword_ptr(ebp, instr.operand()), eax);
+      break;
+    case OP_STOR_S_ALT:
+      // [FRM + offset] = ALT
+      asm_.mov(dword_ptr(ebp, instr.operand()), ecx);
+      break;
+    case OP_SREF_PRI:
+      // [ [address] ] = PRI
+      asm_.mov(edx, dword_ptr(ebx, instr.operand()));
+      asm_.mov(dword_ptr(ebx, edx), eax);
+      break;
+    case OP_SREF_ALT:
+      // [ [address] ] = ALT
+      asm_.mov(edx, dword_ptr(ebx, instr.operand()));
+      asm_.mov(dword_ptr(ebx, edx), ecx);
+      break;
+    case OP_SREF_S_PRI:
+      // [ [FRM + offset] ] = PRI
+      asm_.mov(edx, dword_ptr(ebp, instr.operand()));
+      asm_.mov(dword_ptr(ebx, edx), eax);
+      break;
+    case OP_SREF_S_ALT:
+      // [ [FRM + offset] ] = ALT
+      asm_.mov(edx, dword_ptr(ebp, instr.operand()));
+      asm_.mov(dword_ptr(ebx, edx), ecx);
+      break;
+    case OP_STOR_I:
+      // [ALT] = PRI (full cell)
+      asm_.mov(dword_ptr(ebx, ecx), eax);
+      break;
+    case OP_STRB_I:
+      // "number" bytes at [ALT] = PRI (write 1/2/4 bytes)
+      switch (instr.operand()) {
+        case 1:
+          asm_.mov(byte_ptr(ebx, ecx), al);
+          break;
+        case 2:
+          asm_.mov(word_ptr(ebx, ecx), ax);
+          break;
+        case 4:
+          asm_.mov(dword_ptr(ebx, ecx), eax);
+          break;
+      }
+      break;
+    case OP_LIDX:
+      // PRI = [ ALT + (PRI x cell size) ]
+      asm_.lea(edx, dword_ptr(ebx, ecx));
+      asm_.mov(eax, dword_ptr(edx, eax, 2));
+      break;
+    case OP_LIDX_B:
+      // PRI = [ ALT + (PRI << shift) ]
+      asm_.lea(edx, dword_ptr(ebx, ecx));
+      asm_.mov(eax, dword_ptr(edx, eax, instr.operand()));
+      break;
+    case OP_IDXADDR:
+      // PRI = ALT + (PRI x cell size) (calculate indexed address)
+      asm_.lea(eax, dword_ptr(ecx, eax, 2));
+      break;
+    case OP_IDXADDR_B:
+      // PRI = ALT + (PRI << shift) (calculate indexed address)
+      asm_.lea(eax, dword_ptr(ecx, eax, instr.operand()));
+      break;
+    case OP_ALIGN_PRI:
+      // Little Endian: PRI ^= cell size - number
+      #if BYTE_ORDER == LITTLE_ENDIAN
+        if (static_cast<std::size_t>(instr.operand()) < sizeof(cell)) {
+          asm_.xor_(eax, sizeof(cell) - instr.operand());
+        }
+      #endif
+      break;
+    case OP_ALIGN_ALT:
+      // Little Endian: ALT ^= cell size - number
+      #if BYTE_ORDER == LITTLE_ENDIAN
+        if (static_cast<std::size_t>(instr.operand()) < sizeof(cell)) {
+          asm_.xor_(ecx, sizeof(cell) - instr.operand());
+        }
+      #endif
+      break;
+    case OP_LCTRL:
+      // PRI is set to the current value of any of the special registers.
+      // The index parameter must be:
+      // 3=STP, 4=STK, 5=FRM, 6=CIP (of the next instruction)
+      switch (instr.operand()) {
+        case 0:
+        case 1:
+        case 3:
+          asm_.mov(eax, dword_ptr(amx_ptr_label_));
+          switch (instr.operand()) {
+            case 0:
+              asm_.mov(eax, dword_ptr(eax, offsetof(AMX, base)));
+              asm_.mov(eax, dword_ptr(eax, offsetof(AMX_HEADER, cod)));
+              break;
+            case 1:
+              asm_.mov(eax, dword_ptr(eax, offsetof(AMX, base)));
+              asm_.mov(eax, dword_ptr(eax, offsetof(AMX_HEADER, dat)));
+              break;
+            case 3:
+              asm_.mov(eax, dword_ptr(eax, offsetof(AMX, stp)));
+              break;
           }
-        #endif
-        break;
-      case OP_ALIGN_ALT:
-        // Little Endian: ALT ^= cell size - number
-        #if BYTE_ORDER == LITTLE_ENDIAN
-          if (static_cast<std::size_t>(instr.operand()) < sizeof(cell)) {
-            asm_.xor_(ecx, sizeof(cell) - instr.operand());
+          break;
+        case 2:
+          asm_.mov(eax, GetRuntimeInfoField(hea_label_,
+                                            offsetof(RuntimeInfoBlock, hea)));
+          break;
+        case 4:
+          asm_.mov(eax, esp);
+          asm_.sub(eax, ebx);
+          break;
+        case 5:
+          asm_.mov(eax, ebp);
+          asm_.sub(eax, ebx);
+          break;
+        case 6:
+          asm_.mov(eax, instr.address() + instr.size());
+          break;
+        case 7:
+          asm_.mov(eax, 1);
+          break;
+        case 8:
+          asm_.call(jump_lookup_label_);
+          break;
+      }
+      break;
+    case OP_SCTRL:
+      // set the indexed special registers to the value in PRI.
+      // The index parameter must be:
+      // 6=CIP
+      switch (instr.operand()) {
+        case 2:
+          asm_.mov(GetRuntimeInfoField(hea_label_,
+                                       offsetof(RuntimeInfoBlock, hea)),
+                   eax);
+          break;
+        case 4:
+          asm_.lea(esp, dword_ptr(ebx, eax));
+          break;
+        case 5:
+          asm_.lea(ebp, dword_ptr(ebx, eax));
+          break;
+        case 6:
+          EmitIndirectJump();
+          break;
+        case 8:
+          asm_.jmp(eax);
+          break;
+      }
+      break;
+    case OP_MOVE_PRI:
+      // PRI = ALT
+      asm_.mov(eax, ecx);
+      break;
+    case OP_MOVE_ALT:
+      // ALT = PRI
+      asm_.mov(ecx, eax);
+      break;
+    case OP_XCHG:
+      // Exchange PRI and ALT
+      asm_.xchg(eax, ecx);
+      break;
+    case OP_PUSH_PRI:
+      // [STK] = PRI, STK = STK - cell size
+      asm_.push(eax);
+      break;
+    case OP_PUSH_ALT:
+      // [STK] = ALT, STK = STK - cell size
+      asm_.push(ecx);
+      break;
+    case OP_PUSH_C:
+      // [STK] = value, STK = STK - cell size
+      asm_.push(instr.operand());
+      break;
+    case OP_PUSH: {
+      // [STK] = [address], STK = STK - cell size
+      cell value;
+      if (GetReadOnlyValue(instr.operand(), value)) {
+        asm_.push(value);
+      } else {
+        asm_.push(dword_ptr(ebx, instr.operand()));
+      }
+      break;
+    }
+    case OP_PUSH_S:
+      // [STK] = [FRM + offset], STK = STK - cell size
+      asm_.push(dword_ptr(ebp, instr.operand()));
+      break;
+    case OP_POP_PRI:
+      // STK = STK + cell size, PRI = [STK]
+      asm_.pop(eax);
+      break;
+    case OP_POP_ALT:
+      // STK = STK + cell size, ALT = [STK]
+      asm_.pop(ecx);
+      break;
+    case OP_STACK:
+      // ALT = STK, STK = STK + value
+      asm_.mov(ecx, esp);
+      asm_.sub(ecx, ebx);
+      if (instr.operand() >= 0) {
+        asm_.add(esp, instr.operand());
+      } else {
+        asm_.sub(esp, -instr.operand());
+      }
+      break;
+    case OP_HEAP: {
+      // ALT = HEA, HEA = HEA + value
+      //
+      // HEA lives in the runtime info block while the code runs and is
+      // copied to amx->hea only when something else can see it (see
+      // EmitStoreHeap()).
+      asmjit::X86Mem hea =
+        GetRuntimeInfoField(hea_label_, offsetof(RuntimeInfoBlock, hea));
+      asm_.mov(ecx, hea);
+      if (instr.operand() >= 0) {
+        asm_.add(hea, instr.operand());
+      } else {
+        asm_.sub(hea, -instr.operand());
+      }
+      break;
+    }
+    case OP_PROC:
+      // [STK] = FRM, STK = STK - cell size, FRM = STK
+      asm_.push(ebp);
+      asm_.mov(ebp, esp);
+      asm_.sub(dword_ptr(esp), ebx);
+      break;
+    case OP_RET:
+      // STK = STK + cell size, FRM = [STK],
+      // CIP = [STK], STK = STK + cell size
+      asm_.pop(ebp);
+      asm_.add(ebp, ebx);
+      asm_.ret();
+      break;
+    case OP_RETN:
+      // STK = STK + cell size, FRM = [STK],
+      // CIP = [STK], STK = STK + cell size
+      // The RETN instruction removes a specified number of bytes
+      // from the stack. The value to adjust STK with must be
+      // pushed prior to the call.
+      //
+      // STK is not written back to amx->stk here: nothing can see it until
+      // the next native call, halt, sleep or the return from amx_Exec(),
+      // and all of them store it.
+      asm_.pop(ebp);
+      asm_.add(ebp, ebx);
+      asm_.pop(edx);
+      asm_.add(esp, dword_ptr(esp));
+      asm_.add(esp, 4);
+      asm_.push(edx);
+      asm_.ret();
+      break;
+    case OP_JUMP_PRI:
+      // CIP = PRI (indirect jump)
+      EmitIndirectJump();
+      break;
+    case OP_CALL:
+    case OP_JUMP:
+    case OP_JZER:
+    case OP_JNZ:
+    case OP_JEQ:
+    case OP_JNEQ:
+    case OP_JLESS:
+    case OP_JLEQ:
+    case OP_JGRTR:
+    case OP_JGEQ:
+    case OP_JSLESS:
+    case OP_JSLEQ:
+    case OP_JSGRTR:
+    case OP_JSGEQ: {
+      cell dest = instr.operand() - reinterpret_cast<cell>(amx_.code());
+      switch (instr.opcode().GetId()) {
+        case OP_CALL:
+          // [STK] = CIP + 5, STK = STK - cell size
+          // CIP = CIP + offset
+          // The CALL instruction jumps to an address after storing the
+          // address of the next sequential instruction on the stack.
+          // The address jumped to is relative to the current CIP,
+          // but the address on the stack is an absolute address.
+          if (EmitFoldedCall(instr)) {
+            break;
           }
-        #endif
-        break;
-      case OP_LCTRL:
-        // PRI is set to the current value of any of the special registers.
-        // The index parameter must be:
-        // 3=STP, 4=STK, 5=FRM, 6=CIP (of the next instruction)
-        switch (instr.operand()) {
-          case 0:
-          case 1:
-          case 2:
-          case 3:
-            asm_.mov(eax, dword_ptr(amx_ptr_label_));
-            switch (instr.operand()) {
-              case 0:
-                asm_.mov(eax, dword_ptr(eax, offsetof(AMX, base)));
-                asm_.mov(eax, dword_ptr(eax, offsetof(AMX_HEADER, cod)));
-                break;
-              case 1:
-                asm_.mov(eax, dword_ptr(eax, offsetof(AMX, base)));
-                asm_.mov(eax, dword_ptr(eax, offsetof(AMX_HEADER, dat)));
-                break;
-              case 2:
-                asm_.mov(eax, dword_ptr(eax, offsetof(AMX, hea)));
-                break;
-              case 3:
-                asm_.mov(eax, dword_ptr(eax, offsetof(AMX, stp)));
-                break;
+          if (specializer_ != 0) {
+            const Specialization *specialization =
+              specializer_->GetSpecialization(instr.address());
+            if (specialization != 0) {
+              asm_.call(GetSpecializationLabel(specialization));
+              break;
             }
+          }
+          if (function_ != 0 && !function_->Contains(dest)) {
+            EmitLazyCall(dest);
             break;
-          case 4:
-            asm_.mov(eax, esp);
-            asm_.sub(eax, ebx);
-            break;
-          case 5:
-            asm_.mov(eax, ebp);
-            asm_.sub(eax, ebx);
-            break;
-          case 6:
-            asm_.mov(eax, instr.address() + instr.size());
-            break;
-          case 7:
-            asm_.mov(eax, 1);
-            break;
-          case 8:
-            asm_.call(jump_lookup_label_);
-            break;
-        }
-        break;
-      case OP_SCTRL:
-        // set the indexed special registers to the value in PRI.
-        // The index parameter must be:
-        // 6=CIP
-        switch (instr.operand()) {
-          case 2:
-            asm_.mov(edx, dword_ptr(amx_ptr_label_));
-            asm_.mov(dword_ptr(edx, offsetof(AMX, hea)), eax);
-            break;
-          case 4:
-            asm_.lea(esp, dword_ptr(ebx, eax));
-            break;
-          case 5:
-            asm_.lea(ebp, dword_ptr(ebx, eax));
-            break;
-          case 6:
-            asm_.call(jump_helper_label_);
-            break;
-          case 8:
-            asm_.jmp(eax);
-            break;
-        }
-        break;
-      case OP_MOVE_PRI:
-        // PRI = ALT
-        asm_.mov(eax, ecx);
-        break;
-      case OP_MOVE_ALT:
-        // ALT = PRI
-        asm_.mov(ecx, eax);
-        break;
-      case OP_XCHG:
-        // Exchange PRI and ALT
-        asm_.xchg(eax, ecx);
-        break;
-      case OP_PUSH_PRI:
-        // [STK] = PRI, STK = STK - cell size
-        asm_.push(eax);
-        break;
-      case OP_PUSH_ALT:
-        // [STK] = ALT, STK = STK - cell size
+          }
+          asm_.call(GetLabel(dest));
+          break;
+        case OP_JUMP:
+          // CIP = CIP + offset (jump to the address relative from
+          // the current position)
+          SetJumpForm(instr);
+          asm_.jmp(GetJumpLabel(dest));
+          break;
+        case OP_JZER:
+          // if PRI == 0 then CIP = CIP + offset
+          asm_.test(eax, eax);
+          SetJumpForm(instr);
+          asm_.jz(GetJumpLabel(dest));
+          break;
+        case OP_JNZ:
+          // if PRI != 0 then CIP = CIP + offset
+          asm_.test(eax, eax);
+          SetJumpForm(instr);
+          asm_.jnz(GetJumpLabel(dest));
+          break;
+        case OP_JEQ:
+          // if PRI == ALT then CIP = CIP + offset
+          asm_.cmp(eax, ecx);
+          SetJumpForm(instr);
+          asm_.je(GetJumpLabel(dest));
+          break;
+        case OP_JNEQ:
+          // if PRI != ALT then CIP = CIP + offset
+          asm_.cmp(eax, ecx);
+          SetJumpForm(instr);
+          asm_.jne(GetJumpLabel(dest));
+          break;
+        case OP_JLESS:
+          // if PRI < ALT then CIP = CIP + offset (unsigned)
+          asm_.cmp(eax, ecx);
+          SetJumpForm(instr);
+          asm_.jb(GetJumpLabel(dest));
+          break;
+        case OP_JLEQ:
+          // if PRI <= ALT then CIP = CIP + offset (unsigned)
+          asm_.cmp(eax, ecx);
+          SetJumpForm(instr);
+          asm_.jbe(GetJumpLabel(dest));
+          break;
+        case OP_JGRTR:
+          // if PRI > ALT then CIP = CIP + offset (unsigned)
+          asm_.cmp(eax, ecx);
+          SetJumpForm(instr);
+          asm_.ja(GetJumpLabel(dest));
+          break;
+        case OP_JGEQ:
+          // if PRI >= ALT then CIP = CIP + offset (unsigned)
+          asm_.cmp(eax, ecx);
+          SetJumpForm(instr);
+          asm_.jae(GetJumpLabel(dest));
+          break;
+        case OP_JSLESS:
+          // if PRI < ALT then CIP = CIP + offset (signed)
+          asm_.cmp(eax, ecx);
+          SetJumpForm(instr);
+          asm_.jl(GetJumpLabel(dest));
+          break;
+        case OP_JSLEQ:
+          // if PRI <= ALT then CIP = CIP + offset (signed)
+          asm_.cmp(eax, ecx);
+          SetJumpForm(instr);
+          asm_.jle(GetJumpLabel(dest));
+          break;
+        case OP_JSGRTR:
+          // if PRI > ALT then CIP = CIP + offset (signed)
+          asm_.cmp(eax, ecx);
+          SetJumpForm(instr);
+          asm_.jg(GetJumpLabel(dest));
+          break;
+        case OP_JSGEQ:
+          // if PRI >= ALT then CIP = CIP + offset (signed)
+          asm_.cmp(eax, ecx);
+          SetJumpForm(instr);
+          asm_.jge(GetJumpLabel(dest));
+          break;
+      }
+      break;
+    }
+    case OP_SHL:
+      // PRI = PRI << ALT
+      asm_.shl(eax, cl);
+      break;
+    case OP_SHR:
+      // PRI = PRI >> ALT (without sign extension)
+      asm_.shr(eax, cl);
+      break;
+    case OP_SSHR:
+      // PRI = PRI >> ALT with sign extension
+      asm_.sar(eax, cl);
+      break;
+    case OP_SHL_C_PRI:
+      // PRI = PRI << value
+      asm_.shl(eax, static_cast<unsigned char>(instr.operand()));
+      break;
+    case OP_SHL_C_ALT:
+      // ALT = ALT << value
+      asm_.shl(ecx, static_cast<unsigned char>(instr.operand()));
+      break;
+    case OP_SHR_C_PRI:
+      // PRI = PRI >> value (without sign extension)
+      asm_.shr(eax, static_cast<unsigned char>(instr.operand()));
+      break;
+    case OP_SHR_C_ALT:
+      // ALT = ALT >> value (without sign extension)
+      asm_.shr(ecx, static_cast<unsigned char>(instr.operand()));
+      break;
+    case OP_SMUL:
+      // PRI = PRI * ALT (signed multiply)
+      asm_.imul(ecx);
+      break;
+    case OP_SDIV:
+      // PRI = PRI / ALT (signed divide), ALT = PRI mod ALT
+      asm_.cdq();
+      asm_.idiv(ecx);
+      asm_.mov(esi, eax);
+      asm_.lea(eax, dword_ptr(edx, ecx));
+      asm_.cdq();
+      asm_.idiv(ecx);
+      asm_.mov(ecx, edx);
+      asm_.mov(eax, esi);
+      break;
+    case OP_SDIV_ALT:
+      // PRI = ALT / PRI (signed divide), ALT = ALT mod PRI
+      asm_.xchg(eax, ecx);
+      asm_.cdq();
+      asm_.idiv(ecx);
+      asm_.mov(esi, eax);
+      asm_.lea(eax, dword_ptr(edx, ecx));
+      asm_.cdq();
+      asm_.idiv(ecx);
+      asm_.mov(ecx, edx);
+      asm_.mov(eax, esi);
+      break;
+    case OP_UMUL:
+      // PRI = PRI * ALT (unsigned multiply)
+      asm_.mul(ecx);
+      break;
+    case OP_UDIV:
+      // PRI = PRI / ALT (unsigned divide), ALT = PRI mod ALT
+      asm_.xor_(edx, edx);
+      asm_.div(ecx);
+      asm_.mov(ecx, edx);
+      break;
+    case OP_UDIV_ALT:
+      // PRI = ALT / PRI (unsigned divide), ALT = ALT mod PRI
+      asm_.xchg(eax, ecx);
+      asm_.xor_(edx, edx);
+      asm_.div(ecx);
+      asm_.mov(ecx, edx);
+      break;
+    case OP_ADD:
+      // PRI = PRI + ALT
+      asm_.add(eax, ecx);
+      break;
+    case OP_SUB:
+      // PRI = PRI - ALT
+      asm_.sub(eax, ecx);
+      break;
+    case OP_SUB_ALT:
+      // PRI = ALT - PRI
+      // or:
+      // PRI = -(PRI - ALT)
+      asm_.sub(eax, ecx);
+      asm_.neg(eax);
+      break;
+    case OP_AND:
+      // PRI = PRI & ALT
+      asm_.and_(eax, ecx);
+      break;
+    case OP_OR:
+      // PRI = PRI | ALT
+      asm_.or_(eax, ecx);
+      break;
+    case OP_XOR:
+      // PRI = PRI ^ ALT
+      asm_.xor_(eax, ecx);
+      break;
+    case OP_NOT:
+      // PRI = !PRI
+      asm_.test(eax, eax);
+      asm_.setz(al);
+      asm_.movzx(eax, al);
+      break;
+    case OP_NEG:
+      // PRI = -PRI
+      asm_.neg(eax);
+      break;
+    case OP_INVERT:
+      // PRI = ~PRI
+      asm_.not_(eax);
+      break;
+    case OP_ADD_C:
+      // PRI = PRI + value
+      if (instr.operand() >= 0) {
+        asm_.add(eax, instr.operand());
+      } else {
+        asm_.sub(eax, -instr.operand());
+      }
+      break;
+    case OP_SMUL_C:
+      // PRI = PRI * value
+      asm_.imul(eax, instr.operand());
+      break;
+    case OP_ZERO_PRI:
+      // PRI = 0
+      asm_.xor_(eax, eax);
+      break;
+    case OP_ZERO_ALT:
+      // ALT = 0
+      asm_.xor_(ecx, ecx);
+      break;
+    case OP_ZERO:
+      // [address] = 0
+      asm_.mov(dword_ptr(ebx, instr.operand()), 0);
+      break;
+    case OP_ZERO_S:
+      // [FRM + offset] = 0
+      asm_.mov(dword_ptr(ebp, instr.operand()), 0);
+      break;
+    case OP_SIGN_PRI:
+      // sign extent the byte in PRI to a cell
+      asm_.movsx(eax, al);
+      break;
+    case OP_SIGN_ALT:
+      // sign extent the byte in ALT to a cell
+      asm_.movsx(ecx, cl);
+      break;
+    case OP_EQ:
+      // PRI = PRI == ALT ? 1 :
+      asm_.cmp(eax, ecx);
+      asm_.sete(al);
+      asm_.movzx(eax, al);
+      break;
+    case OP_NEQ:
+      // PRI = PRI != ALT ? 1 :
+      asm_.cmp(eax, ecx);
+      asm_.setne(al);
+      asm_.movzx(eax, al);
+      break;
+    case OP_LESS:
+      // PRI = PRI < ALT ? 1 :
+      asm_.cmp(eax, ecx);
+      asm_.setb(al);
+      asm_.movzx(eax, al);
+      break;
+    case OP_LEQ:
+      // PRI = PRI <= ALT ? 1 :
+      asm_.cmp(eax, ecx);
+      asm_.setbe(al);
+      asm_.movzx(eax, al);
+      break;
+    case OP_GRTR:
+      // PRI = PRI > ALT ? 1 :
+      asm_.cmp(eax, ecx);
+      asm_.seta(al);
+      asm_.movzx(eax, al);
+      break;
+    case OP_GEQ:
+      // PRI = PRI >= ALT ? 1 :
+      asm_.cmp(eax, ecx);
+      asm_.setae(al);
+      asm_.movzx(eax, al);
+      break;
+    case OP_SLESS:
+      // PRI = PRI < ALT ? 1 :
+      asm_.cmp(eax, ecx);
+      asm_.setl(al);
+      asm_.movzx(eax, al);
+      break;
+    case OP_SLEQ:
+      // PRI = PRI <= ALT ? 1 :
+      asm_.cmp(eax, ecx);
+      asm_.setle(al);
+      asm_.movzx(eax, al);
+      break;
+    case OP_SGRTR:
+      // PRI = PRI > ALT ? 1 :
+      asm_.cmp(eax, ecx);
+      asm_.setg(al);
+      asm_.movzx(eax, al);
+      break;
+    case OP_SGEQ:
+      // PRI = PRI >= ALT ? 1 :
+      asm_.cmp(eax, ecx);
+      asm_.setge(al);
+      asm_.movzx(eax, al);
+      break;
+    case OP_EQ_C_PRI:
+      // PRI = PRI == value ? 1 :
+      asm_.cmp(eax, instr.operand());
+      asm_.sete(al);
+      asm_.movzx(eax, al);
+      break;
+    case OP_EQ_C_ALT:
+      // PRI = ALT == value ? 1 :
+      asm_.cmp(ecx, instr.operand());
+      asm_.sete(al);
+      asm_.movzx(eax, al);
+      break;
+    case OP_INC_PRI:
+      // PRI = PRI + 1
+      asm_.inc(eax);
+      break;
+    case OP_INC_ALT:
+      // ALT = ALT + 1
+      asm_.inc(ecx);
+      break;
+    case OP_INC:
+      // [address] = [address] + 1
+      asm_.inc(dword_ptr(ebx, instr.operand()));
+      break;
+    case OP_INC_S:
+      // [FRM + offset] = [FRM + offset] + 1
+      asm_.inc(dword_ptr(ebp, instr.operand()));
+      break;
+    case OP_INC_I:
+      // [PRI] = [PRI] + 1
+      asm_.inc(dword_ptr(ebx, eax));
+      break;
+    case OP_DEC_PRI:
+      // PRI = PRI - 1
+      asm_.dec(eax);
+      break;
+    case OP_DEC_ALT:
+      // ALT = ALT - 1
+      asm_.dec(ecx);
+      break;
+    case OP_DEC:
+      // [address] = [address] - 1
+      asm_.dec(dword_ptr(ebx, instr.operand()));
+      break;
+    case OP_DEC_S:
+      // [FRM + offset] = [FRM + offset] - 1
+      asm_.dec(dword_ptr(ebp, instr.operand()));
+      break;
+    case OP_DEC_I:
+      // [PRI] = [PRI] - 1
+      asm_.dec(dword_ptr(ebx, eax));
+      break;
+    case OP_MOVS: {
+      // Copy memory from [PRI] to [ALT]. The parameter
+      // specifies the number of bytes. The blocks should not
+      // overlap.
+      cell num_bytes = instr.operand();
+      asm_.lea(esi, dword_ptr(ebx, eax));
+      asm_.lea(edi, dword_ptr(ebx, ecx));
+      asm_.push(ecx);
+      if (num_bytes % 4 == 0) {
+        asm_.mov(ecx, num_bytes / 4);
+        asm_.rep_movsd();
+      } else if (num_bytes % 2 == 0) {
+        asm_.mov(ecx, num_bytes / 2);
+        asm_.rep_movsw();
+      } else {
+        asm_.mov(ecx, num_bytes);
+        asm_.rep_movsb();
+      }
+      asm_.pop(ecx);
+      break;
+    }
+    case OP_CMPS: {
+      // Compare memory blocks at [PRI] and [ALT]. The parameter
+      // specifies the number of bytes. The blocks should not
+      // overlap.
+      cell num_bytes = instr.operand();
+      Label above_label = asm_.newLabel();
+      Label below_label = asm_.newLabel();
+      Label equal_label = asm_.newLabel();
+      Label continue_label = asm_.newLabel();
+        asm_.lea(edi, dword_ptr(ebx, eax));
+        asm_.lea(esi, dword_ptr(ebx, ecx));
         asm_.push(ecx);
-        break;
-      case OP_PUSH_C:
-        // [STK] = value, STK = STK - cell size
-        asm_.push(instr.operand());
-        break;
-      case OP_PUSH:
-        // [STK] = [address], STK = STK - cell size
-        asm_.push(dword_ptr(ebx, instr.operand()));
-        break;
-      case OP_PUSH_S:
-        // [STK] = [FRM + offset], STK = STK - cell size
-        asm_.push(dword_ptr(ebp, instr.operand()));
-        break;
-      case OP_POP_PRI:
-        // STK = STK + cell size, PRI = [STK]
-        asm_.pop(eax);
-        break;
-      case OP_POP_ALT:
-        // STK = STK + cell size, ALT = [STK]
+        asm_.mov(ecx, num_bytes);
+        asm_.repe_cmpsb();
         asm_.pop(ecx);
-        break;
-      case OP_STACK:
-        // ALT = STK, STK = STK + value
-        asm_.mov(ecx, esp);
-        asm_.sub(ecx, ebx);
-        if (instr.operand() >= 0) {
-          asm_.add(esp, instr.operand());
-        } else {
-          asm_.sub(esp, -instr.operand());
+        asm_.short_().ja(above_label);
+        asm_.short_().jb(below_label);
+        asm_.short_().jz(equal_label);
+      asm_.bind(above_label);
+        asm_.mov(eax, 1);
+        asm_.short_().jmp(continue_label);
+      asm_.bind(below_label);
+        asm_.mov(eax, -1);
+        asm_.short_().jmp(continue_label);
+      asm_.bind(equal_label);
+        asm_.xor_(eax, eax);
+      asm_.bind(continue_label);
+      break;
+    }
+    case OP_FILL: {
+      // Fill memory at [ALT] with value in [PRI]. The parameter
+      // specifies the number of bytes, which must be a multiple
+      // of the cell size.
+      cell num_bytes = instr.operand();
+      asm_.lea(edi, dword_ptr(ebx, ecx));
+      asm_.push(ecx);
+      asm_.mov(ecx, num_bytes / sizeof(cell));
+      asm_.rep_stosd();
+      asm_.pop(ecx);
+      break;
+    }
+    case OP_HALT:
+      // Abort execution (exit value in PRI), parameters other than 0
+      // have a special meaning.
+      asm_.mov(edi, instr.operand());
+      asm_.call(halt_helper_label_);
+      break;
+    case OP_BOUNDS: {
+      // Abort execution if PRI > value or if PRI < 0.
+      const Label &error_label =
+        GetErrorLabel(AMX_ERR_BOUNDS, instr.address());
+      if (instr.operand() >= 0) {
+        // Negative values of PRI become greater than the bound when
+        // compared as unsigned, so a single branch covers both cases.
+        asm_.cmp(eax, instr.operand());
+        asm_.ja(error_label);
+      } else {
+        asm_.cmp(eax, instr.operand());
+        asm_.jg(error_label);
+        asm_.test(eax, eax);
+        asm_.jl(error_label);
+      }
+      break;
+    }
+    case OP_SYSREQ_PRI:
+      // Call system service, service number in PRI.
+      if (native_caches_.find(instr.address()) != native_caches_.end()) {
+        EmitCachedNativeCall(instr.address());
+      } else {
+        asm_.push(eax);
+        asm_.call(sysreq_c_helper_label_);
+      }
+      break;
+    case OP_SYSREQ_C: {
+      // Call system service.
+      const char *name = amx_.GetNativeName(instr.operand());
+      if (name == 0) {
+        return false;
+      } else {
+        bool handled = EmitIntrinsic(name);
+        if (!handled && enable_sysreq_d_) {
+          // Optimization: if we already know the address we can call this
+          // native function directly.
+          cell address = amx_.GetNativeAddress(instr.operand());
+          if (address != 0 && enable_inline_natives_ && !enable_sleep_) {
+            EmitNativeCall(address, instr.operand());
+            handled = true;
+          } else if (address != 0) {
+            asm_.push(address);
+            native_fixups_.push_back(
+              std::make_pair(static_cast<uint32_t>(asm_.getCodeSize() - 4),
+                             static_cast<uint32_t>(instr.operand())));
+            asm_.call(sysreq_d_helper_label_);
+            handled = true;
+          } else {
+            // Sometimes the address can be 0: for example, when a function
+            // is registered _after_ JIT compilation (could be a plugin).
+            // The call binds itself on first execution: BindNative() puts
+            // the address in place of the index, which is why the PUSH is
+            // encoded with a 32-bit immediate.
+            asm_.db(0x68); // push imm32
+            asm_.dd(instr.operand());
+            asm_.call(sysreq_bind_helper_label_);
+            handled = true;
+          }
         }
-        break;
-      case OP_HEAP:
-        // ALT = HEA, HEA = HEA + value
-        asm_.mov(edx, dword_ptr(amx_ptr_label_));
-        asm_.mov(ecx, dword_ptr(edx, offsetof(AMX, hea)));
-        if (instr.operand() >= 0) {
-          asm_.add(dword_ptr(edx, offsetof(AMX, hea)), instr.operand());
-        } else {
-          asm_.sub(dword_ptr(edx, offsetof(AMX, hea)), -instr.operand());
+        if (!handled) {
+          asm_.push(instr.operand());
+          asm_.call(sysreq_c_helper_label_);
         }
-        break;
-      case OP_PROC:
-        // [STK] = FRM, STK = STK - cell size, FRM = STK
-        asm_.push(ebp);
-        asm_.mov(ebp, esp);
-        asm_.sub(dword_ptr(esp), ebx);
-        break;
-      case OP_RET:
-        // STK = STK + cell size, FRM = [STK],
-        // CIP = [STK], STK = STK + cell size
-        asm_.pop(ebp);
-        asm_.add(ebp, ebx);
-        asm_.ret();
-        break;
-      case OP_RETN:
-        // STK = STK + cell size, FRM = [STK],
-        // CIP = [STK], STK = STK + cell size
-        // The RETN instruction removes a specified number of bytes
-        // from the stack. The value to adjust STK with must be
-        // pushed prior to the call.
-        asm_.pop(ebp);
-        asm_.add(ebp, ebx);
-        asm_.pop(edx);
-        asm_.add(esp, dword_ptr(esp));
-        asm_.add(esp, 4);
-        asm_.mov(esi, dword_ptr(amx_ptr_label_));
-        asm_.mov(edi, esp);
-        asm_.sub(edi, ebx);
-        asm_.mov(dword_ptr(esi, offsetof(AMX, stk)), edi);
-        asm_.push(edx);
-        asm_.ret();
-        break;
-      case OP_JUMP_PRI:
-        // CIP = PRI (indirect jump)
-        asm_.call(jump_helper_label_);
-        break;
-      case OP_CALL:
-      case OP_JUMP:
-      case OP_JZER:
-      case OP_JNZ:
-      case OP_JEQ:
-      case OP_JNEQ:
-      case OP_JLESS:
-      case OP_JLEQ:
-      case OP_JGRTR:
-      case OP_JGEQ:
-      case OP_JSLESS:
-      case OP_JSLEQ:
-      case OP_JSGRTR:
-      case OP_JSGEQ: {
-        cell dest = instr.operand() - reinterpret_cast<cell>(amx.code());
-        switch (instr.opcode().GetId()) {
-          case OP_CALL:
-            // [STK] = CIP + 5, STK = STK - cell size
-            // CIP = CIP + offset
-            // The CALL instruction jumps to an address after storing the
-            // address of the next sequential instruction on the stack.
-            // The address jumped to is relative to the current CIP,
-            // but the address on the stack is an absolute address.
-            asm_.call(GetLabel(dest));
-            break;
-          case OP_JUMP:
-            // CIP = CIP + offset (jump to the address relative from
-            // the current position)
-            asm_.jmp(GetLabel(dest));
-            break;
-          case OP_JZER:
-            // if PRI == 0 then CIP = CIP + offset
-            asm_.test(eax, eax);
-            asm_.jz(GetLabel(dest));
-            break;
-          case OP_JNZ:
-            // if PRI != 0 then CIP = CIP + offset
-            asm_.test(eax, eax);
-            asm_.jnz(GetLabel(dest));
-            break;
-          case OP_JEQ:
-            // if PRI == ALT then CIP = CIP + offset
-            asm_.cmp(eax, ecx);
-            asm_.je(GetLabel(dest));
-            break;
-          case OP_JNEQ:
-            // if PRI != ALT then CIP = CIP + offset
-            asm_.cmp(eax, ecx);
-            asm_.jne(GetLabel(dest));
-            break;
-          case OP_JLESS:
-            // if PRI < ALT then CIP = CIP + offset (unsigned)
-            asm_.cmp(eax, ecx);
-            asm_.jb(GetLabel(dest));
-            break;
-          case OP_JLEQ:
-            // if PRI <= ALT then CIP = CIP + offset (unsigned)
-            asm_.cmp(eax, ecx);
-            asm_.jbe(GetLabel(dest));
-            break;
-          case OP_JGRTR:
-            // if PRI > ALT then CIP = CIP + offset (unsigned)
-            asm_.cmp(eax, ecx);
-            asm_.ja(GetLabel(dest));
-            break;
-          case OP_JGEQ:
-            // if PRI >= ALT then CIP = CIP + offset (unsigned)
-            asm_.cmp(eax, ecx);
-            asm_.jae(GetLabel(dest));
-            break;
-          case OP_JSLESS:
-            // if PRI < ALT then CIP = CIP + offset (signed)
-            asm_.cmp(eax, ecx);
-            asm_.jl(GetLabel(dest));
-            break;
-          case OP_JSLEQ:
-            // if PRI <= ALT then CIP = CIP + offset (signed)
-            asm_.cmp(eax, ecx);
-            asm_.jle(GetLabel(dest));
-            break;
-          case OP_JSGRTR:
-            // if PRI > ALT then CIP = CIP + offset (signed)
-            asm_.cmp(eax, ecx);
-            asm_.jg(GetLabel(dest));
-            break;
-          case OP_JSGEQ:
-            // if PRI >= ALT then CIP = CIP + offset (signed)
-            asm_.cmp(eax, ecx);
-            asm_.jge(GetLabel(dest));
-            break;
-        }
-        break;
       }
-      case OP_SHL:
-        // PRI = PRI << ALT
-        asm_.shl(eax, cl);
-        break;
-      case OP_SHR:
-        // PRI = PRI >> ALT (without sign extension)
-        asm_.shr(eax, cl);
-        break;
-      case OP_SSHR:
-        // PRI = PRI >> ALT with sign extension
-        asm_.sar(eax, cl);
-        break;
-      case OP_SHL_C_PRI:
-        // PRI = PRI << value
-        asm_.shl(eax, static_cast<unsigned char>(instr.operand()));
-        break;
-      case OP_SHL_C_ALT:
-        // ALT = ALT << value
-        asm_.shl(ecx, static_cast<unsigned char>(instr.operand()));
-        break;
-      case OP_SHR_C_PRI:
-        // PRI = PRI >> value (without sign extension)
-        asm_.shr(eax, static_cast<unsigned char>(instr.operand()));
-        break;
-      case OP_SHR_C_ALT:
-        // ALT = ALT >> value (without sign extension)
-        asm_.shr(ecx, static_cast<unsigned char>(instr.operand()));
-        break;
-      case OP_SMUL:
-        // PRI = PRI * ALT (signed multiply)
-        asm_.imul(ecx);
-        break;
-      case OP_SDIV:
-        // PRI = PRI / ALT (signed divide), ALT = PRI mod ALT
-        asm_.cdq();
-        asm_.idiv(ecx);
-        asm_.mov(esi, eax);
-        asm_.lea(eax, dword_ptr(edx, ecx));
-        asm_.cdq();
-        asm_.idiv(ecx);
-        asm_.mov(ecx, edx);
-        asm_.mov(eax, esi);
-        break;
-      case OP_SDIV_ALT:
-        // PRI = ALT / PRI (signed divide), ALT = ALT mod PRI
-        asm_.xchg(eax, ecx);
-        asm_.cdq();
-        asm_.idiv(ecx);
-        asm_.mov(esi, eax);
-        asm_.lea(eax, dword_ptr(edx, ecx));
-        asm_.cdq();
-        asm_.idiv(ecx);
-        asm_.mov(ecx, edx);
-        asm_.mov(eax, esi);
-        break;
-      case OP_UMUL:
-        // PRI = PRI * ALT (unsigned multiply)
-        asm_.mul(ecx);
-        break;
-      case OP_UDIV:
-        // PRI = PRI / ALT (unsigned divide), ALT = PRI mod ALT
-        asm_.xor_(edx, edx);
-        asm_.div(ecx);
-        asm_.mov(ecx, edx);
-        break;
-      case OP_UDIV_ALT:
-        // PRI = ALT / PRI (unsigned divide), ALT = ALT mod PRI
-        asm_.xchg(eax, ecx);
-        asm_.xor_(edx, edx);
-        asm_.div(ecx);
-        asm_.mov(ecx, edx);
-        break;
-      case OP_ADD:
-        // PRI = PRI + ALT
-        asm_.add(eax, ecx);
-        break;
-      case OP_SUB:
-        // PRI = PRI - ALT
-        asm_.sub(eax, ecx);
-        break;
-      case OP_SUB_ALT:
-        // PRI = ALT - PRI
-        // or:
-        // PRI = -(PRI - ALT)
-        asm_.sub(eax, ecx);
-        asm_.neg(eax);
-        break;
-      case OP_AND:
-        // PRI = PRI & ALT
-        asm_.and_(eax, ecx);
-        break;
-      case OP_OR:
-        // PRI = PRI | ALT
-        asm_.or_(eax, ecx);
-        break;
-      case OP_XOR:
-        // PRI = PRI ^ ALT
-        asm_.xor_(eax, ecx);
-        break;
-      case OP_NOT:
-        // PRI = !PRI
-        asm_.test(eax, eax);
-        asm_.setz(al);
-        asm_.movzx(eax, al);
-        break;
-      case OP_NEG:
-        // PRI = -PRI
-        asm_.neg(eax);
-        break;
-      case OP_INVERT:
-        // PRI = ~PRI
-        asm_.not_(eax);
-        break;
-      case OP_ADD_C:
-        // PRI = PRI + value
-        if (instr.operand() >= 0) {
-          asm_.add(eax, instr.operand());
-        } else {
-          asm_.sub(eax, -instr.operand());
+      break;
+    }
+    case OP_SYSREQ_D: {
+      // Call system service.
+      const char *name = amx_.GetNativeName(amx_.FindNative(instr.operand()));
+      if (name == 0) {
+        return false;
+      } else {
+        if (!EmitIntrinsic(name)) {
+          if (enable_inline_natives_ && !enable_sleep_) {
+            EmitNativeCall(instr.operand(), -1);
+          } else {
+            asm_.push(instr.operand());
+            asm_.call(sysreq_d_helper_label_);
+          }
         }
-        break;
-      case OP_SMUL_C:
-        // PRI = PRI * value
-        asm_.imul(eax, instr.operand());
-        break;
-      case OP_ZERO_PRI:
-        // PRI = 0
-        asm_.xor_(eax, eax);
-        break;
-      case OP_ZERO_ALT:
-        // ALT = 0
-        asm_.xor_(ecx, ecx);
-        break;
-      case OP_ZERO:
-        // [address] = 0
-        asm_.mov(dword_ptr(ebx, instr.operand()), 0);
-        break;
-      case OP_ZERO_S:
-        // [FRM + offset] = 0
-        asm_.mov(dword_ptr(ebp, instr.operand()), 0);
-        break;
-      case OP_SIGN_PRI:
-        // sign extent the byte in PRI to a cell
-        asm_.movsx(eax, al);
-        break;
-      case OP_SIGN_ALT:
-        // sign extent the byte in ALT to a cell
-        asm_.movsx(ecx, cl);
-        break;
-      case OP_EQ:
-        // PRI = PRI == ALT ? 1 :
-        asm_.cmp(eax, ecx);
-        asm_.sete(al);
-        asm_.movzx(eax, al);
-        break;
-      case OP_NEQ:
-        // PRI = PRI != ALT ? 1 :
-        asm_.cmp(eax, ecx);
-        asm_.setne(al);
-        asm_.movzx(eax, al);
-        break;
-      case OP_LESS:
-        // PRI = PRI < ALT ? 1 :
-        asm_.cmp(eax, ecx);
-        asm_.setb(al);
-        asm_.movzx(eax, al);
-        break;
-      case OP_LEQ:
-        // PRI = PRI <= ALT ? 1 :
-        asm_.cmp(eax, ecx);
-        asm_.setbe(al);
-        asm_.movzx(eax, al);
-        break;
-      case OP_GRTR:
-        // PRI = PRI > ALT ? 1 :
-        asm_.cmp(eax, ecx);
-        asm_.seta(al);
-        asm_.movzx(eax, al);
-        break;
-      case OP_GEQ:
-        // PRI = PRI >= ALT ? 1 :
-        asm_.cmp(eax, ecx);
-        asm_.setae(al);
-        asm_.movzx(eax, al);
-        break;
-      case OP_SLESS:
-        // PRI = PRI < ALT ? 1 :
-        asm_.cmp(eax, ecx);
-        asm_.setl(al);
-        asm_.movzx(eax, al);
-        break;
-      case OP_SLEQ:
-        // PRI = PRI <= ALT ? 1 :
-        asm_.cmp(eax, ecx);
-        asm_.setle(al);
-        asm_.movzx(eax, al);
-        break;
-      case OP_SGRTR:
-        // PRI = PRI > ALT ? 1 :
-        asm_.cmp(eax, ecx);
-        asm_.setg(al);
-        asm_.movzx(eax, al);
-        break;
-      case OP_SGEQ:
-        // PRI = PRI >= ALT ? 1 :
-        asm_.cmp(eax, ecx);
-        asm_.setge(al);
-        asm_.movzx(eax, al);
-        break;
-      case OP_EQ_C_PRI:
-        // PRI = PRI == value ? 1 :
-        asm_.cmp(eax, instr.operand());
-        asm_.sete(al);
-        asm_.movzx(eax, al);
-        break;
-      case OP_EQ_C_ALT:
-        // PRI = ALT == value ? 1 :
-        asm_.cmp(ecx, instr.operand());
-        asm_.sete(al);
-        asm_.movzx(eax, al);
-        break;
-      case OP_INC_PRI:
-        // PRI = PRI + 1
-        asm_.inc(eax);
-        break;
-      case OP_INC_ALT:
-        // ALT = ALT + 1
-        asm_.inc(ecx);
-        break;
-      case OP_INC:
-        // [address] = [address] + 1
-        asm_.inc(dword_ptr(ebx, instr.operand()));
-        break;
-      case OP_INC_S:
-        // [FRM + offset] = [FRM + offset] + 1
-        asm_.inc(dword_ptr(ebp, instr.operand()));
-        break;
-      case OP_INC_I:
-        // [PRI] = [PRI] + 1
-        asm_.inc(dword_ptr(ebx, eax));
-        break;
-      case OP_DEC_PRI:
-        // PRI = PRI - 1
-        asm_.dec(eax);
-        break;
-      case OP_DEC_ALT:
-        // ALT = ALT - 1
-        asm_.dec(ecx);
-        break;
-      case OP_DEC:
-        // [address] = [address] - 1
-        asm_.dec(dword_ptr(ebx, instr.operand()));
-        break;
-      case OP_DEC_S:
-        // [FRM + offset] = [FRM + offset] - 1
-        asm_.dec(dword_ptr(ebp, instr.operand()));
-        break;
-      case OP_DEC_I:
-        // [PRI] = [PRI] - 1
-        asm_.dec(dword_ptr(ebx, eax));
-        break;
-      case OP_MOVS: {
-        // Copy memory from [PRI] to [ALT]. The parameter
-        // specifies the number of bytes. The blocks should not
-        // overlap.
-        cell num_bytes = instr.operand();
-        asm_.lea(esi, dword_ptr(ebx, eax));
-        asm_.lea(edi, dword_ptr(ebx, ecx));
-        asm_.push(ecx);
-        if (num_bytes % 4 == 0) {
-          asm_.mov(ecx, num_bytes / 4);
-          asm_.rep_movsd();
-        } else if (num_bytes % 2 == 0) {
-          asm_.mov(ecx, num_bytes / 2);
-          asm_.rep_movsw();
-        } else {
-          asm_.mov(ecx, num_bytes);
-          asm_.rep_movsb();
+      }
+      break;
+    }
+    case OP_SWITCH: {
+      // Compare PRI to the values in the case table (whose address
+      // is passed as an offset from CIP) and jump to the associated
+      // address in the matching record.
+      CaseTable case_table(amx_, instr.operand());
+
+      if (case_table.num_cases() > 0) {
+        // Get minimum and maximum values.
+        cell min_value = case_table.FindMinValue();
+        cell max_value = case_table.FindMaxValue();
+
+        // Check if the value in eax is in the allowed range.
+        // If not, jump to the default case (i.e. no match).
+        asm_.cmp(eax, min_value);
+        asm_.jl(GetJumpLabel(case_table.GetDefaultAddress()));
+        asm_.cmp(eax, max_value);
+        asm_.jg(GetJumpLabel(case_table.GetDefaultAddress()));
+
+        // OK now sequentially compare eax with each value.
+        // This is pretty slow so I probably should optimize
+        // this in future...
+        for (int i = 0; i < case_table.num_cases(); i++) {
+          asm_.cmp(eax, case_table.GetCaseValue(i));
+          asm_.je(GetJumpLabel(case_table.GetCaseAddress(i)));
         }
-        asm_.pop(ecx);
-        break;
       }
-      case OP_CMPS: {
-        // Compare memory blocks at [PRI] and [ALT]. The parameter
-        // specifies the number of bytes. The blocks should not
-        // overlap.
-        cell num_bytes = instr.operand();
-        Label above_label = asm_.newLabel();
-        Label below_label = asm_.newLabel();
-        Label equal_label = asm_.newLabel();
-        Label continue_label = asm_.newLabel();
-          asm_.lea(edi, dword_ptr(ebx, eax));
-          asm_.lea(esi, dword_ptr(ebx, ecx));
-          asm_.push(ecx);
-          asm_.mov(ecx, num_bytes);
-          asm_.repe_cmpsb();
-          asm_.pop(ecx);
-          asm_.ja(above_label);
-          asm_.jb(below_label);
-          asm_.jz(equal_label);
-        asm_.bind(above_label);
-          asm_.mov(eax, 1);
-          asm_.jmp(continue_label);
-        asm_.bind(below_label);
-          asm_.mov(eax, -1);
-          asm_.jmp(continue_label);
-        asm_.bind(equal_label);
-          asm_.xor_(eax, eax);
-        asm_.bind(continue_label);
-        break;
+
+      // No match found - go for default case.
+      asm_.jmp(GetJumpLabel(case_table.GetDefaultAddress()));
+      break;
+    }
+    case OP_CASETBL:
+      // A variable number of case records follows this opcode, where
+      // each record takes two cells.
+      break;
+    case OP_SWAP_PRI:
+      // [STK] = PRI and PRI = [STK]
+      asm_.xchg(dword_ptr(esp), eax);
+      break;
+    case OP_SWAP_ALT:
+      // [STK] = ALT and ALT = [STK]
+      asm_.xchg(dword_ptr(esp), ecx);
+      break;
+    case OP_PUSH_ADR:
+      // [STK] = FRM + offset, STK = STK - cell size
+      asm_.lea(edx, dword_ptr(ebp, instr.operand()));
+      asm_.sub(edx, ebx);
+      asm_.push(edx);
+      break;
+    case OP_NOP:
+      // No-operation, for code alignment.
+      break;
+    case OP_BREAK:
+      // Conditional breakpoint.
+      EmitDebugBreakpoint();
+      break;
+    default:
+      return false;
+  }
+  return true;
+}
+
+// Forward jumps to labels that are not bound yet are always emitted in the
+// long form (rel32). To find out which of them could be short, the code is
+// compiled once more with the same options and the distances are measured.
+// Making some jumps short can only bring other jumps closer to their
+// targets, unless there is alignment padding between them, so this is only
+// done for jumps within the same function.
+void CompilerImpl::FindShortJumps(AMXRef amx) {
+  // The measuring pass must lay out the code exactly like the real one, so
+  // it gets all the options that affect the code, and the same data. It
+  // is never shared or cached (no cache directories are set).
+  CompilerImpl compiler;
+  compiler.enable_sysreq_d_ = enable_sysreq_d_;
+  compiler.enable_sleep_ = enable_sleep_;
+  compiler.enable_resume_ = enable_resume_;
+  compiler.enable_inline_natives_ = enable_inline_natives_;
+  compiler.enable_read_only_data_ = enable_read_only_data_;
+  compiler.enable_dead_code_elimination_ = enable_dead_code_elimination_;
+  compiler.enable_function_reordering_ = enable_function_reordering_;
+  compiler.enable_lazy_compilation_ = enable_lazy_compilation_;
+  compiler.enable_tiered_compilation_ = enable_tiered_compilation_;
+  compiler.thread_count_ = thread_count_;
+  compiler.tier_up_threshold_ = tier_up_threshold_;
+  compiler.data_snapshot_ = data_snapshot_;
+  compiler.debug_flags_ = debug_flags_;
+  compiler.specialization_budget_ = specialization_budget_;
+  compiler.eval_step_limit_ = eval_step_limit_;
+  compiler.measure_jumps_ = true;
+
+  CodeBuffer *code = compiler.Compile(amx);
+  if (code == 0) {
+    return;
+  }
+  code->Delete();
+
+  for (std::map<cell, std::pair<std::ptrdiff_t, cell> >::const_iterator it =
+         compiler.jump_offsets_.begin();
+       it != compiler.jump_offsets_.end(); it++) {
+    std::ptrdiff_t jump_offset = it->second.first;
+    cell target = it->second.second;
+    std::map<cell, std::ptrdiff_t>::const_iterator target_it =
+      compiler.instr_map_.find(target);
+    if (target_it == compiler.instr_map_.end()
+        || program_->FindFunction(it->first) != program_->FindFunction(target)) {
+      continue;
+    }
+    // The displacement is relative to the end of the 2-byte short jump.
+    std::ptrdiff_t distance = target_it->second - (jump_offset + 2);
+    if (distance >= 0 && distance <= 127) {
+      short_jumps_.insert(it->first);
+    }
+  }
+}
+
+void CompilerImpl::SetJumpForm(const Instruction &instr) {
+  // Copies of specialized functions may have different layout.
+  if (specialization_ != 0) {
+    return;
+  }
+  if (measure_jumps_) {
+    jump_offsets_[instr.address()] =
+      std::make_pair(asm_.getCodeSize(), program_->GetJumpTarget(instr));
+  } else if (short_jumps_.find(instr.address()) != short_jumps_.end()) {
+    asm_.short_();
+  }
+}
+
+uintptr_t CompilerImpl::CompileLazyFunction(LazyCodeBuffer *code,
+                                            cell address) {
+  std::map<cell, uintptr_t>::const_iterator compiled_it =
+    code->functions_.find(address);
+  if (compiled_it != code->functions_.end()) {
+    return compiled_it->second;
+  }
+
+  const Function *function = code->program_->FindFunction(address);
+  if (function == 0 || function->address() != address) {
+    return 0;
+  }
+
+  CompilerImpl compiler;
+  compiler.InitFunctionCompiler(code);
+
+  void *function_code = compiler.CompileFunction(function);
+  if (function_code == 0) {
+    return 0;
+  }
+  return LinkFunction(code, address, function_code, compiler, true);
+}
+
+uintptr_t CompilerImpl::BindNative(CodeBuffer *code,
+                                   AMXRef amx,
+                                   cell index,
+                                   unsigned char *call_end,
+                                   uintptr_t sysreq_d_helper) {
+  cell address = amx.GetNativeAddress(index);
+  if (address == 0) {
+    return 0;
+  }
+
+  // push imm32 (5 bytes) followed by call rel32 (5 bytes).
+  unsigned char *push_operand = call_end - 9;
+  {
+    CodeWriteScope write_scope(call_end - 10, 10);
+    std::memcpy(push_operand, &address, sizeof(cell));
+    PatchRel32(call_end, sysreq_d_helper);
+  }
+  code->native_sites_.push_back(std::make_pair(push_operand, index));
+  return address;
+}
+
+void CompilerImpl::AddNativeSites(
+    CodeBuffer *code,
+    uintptr_t base,
+    const std::vector<std::pair<uint32_t, uint32_t> > &native_fixups) {
+  for (std::vector<std::pair<uint32_t, uint32_t> >::const_iterator it =
+         native_fixups.begin();
+       it != native_fixups.end(); it++) {
+    code->native_sites_.push_back(
+      std::make_pair(reinterpret_cast<unsigned char*>(base + it->first),
+                     static_cast<cell>(it->second)));
+  }
+}
+
+uintptr_t CompilerImpl::LinkFunction(LazyCodeBuffer *code,
+                                     cell address,
+                                     void *function_code,
+                                     const CompilerImpl &compiler,
+                                     bool update_instr_table) {
+  code->functions_code_.push_back(
+    std::make_pair(function_code, compiler.code_size()));
+  ProtectPages(function_code, compiler.code_size(), true);
+  CodeArena::SetOwner(function_code, code->runtime_info_);
+
+  uintptr_t base = reinterpret_cast<uintptr_t>(function_code);
+  uintptr_t entry = base + compiler.instr_map_.find(address)->second;
+  code->functions_[address] = entry;
+  AddNativeSites(code, base, compiler.native_fixups_);
+
+  if (update_instr_table) {
+    RuntimeInfoBlock *rib =
+      reinterpret_cast<RuntimeInfoBlock*>(code->runtime_info_);
+    for (std::map<cell, std::ptrdiff_t>::const_iterator it =
+           compiler.instr_map_.begin();
+         it != compiler.instr_map_.end(); it++) {
+      InstrTableEntry *entry = FindInstrTableEntry(rib, it->first);
+      if (entry != 0) {
+        entry->ptr = base + it->second;
+      }
+    }
+  }
+
+  // Turn the stub into a jump to the compiled code, so that calls that
+  // can't be patched (e.g. from public function lookups) don't go through
+  // the compilation helper again. In tiered mode the stub is the start of
+  // the baseline code.
+  std::map<cell, uintptr_t>::const_iterator stub_it =
+    code->stubs_.find(address);
+  if (stub_it != code->stubs_.end()) {
+    CodeWriteScope write_scope(reinterpret_cast<void*>(stub_it->second), 5);
+    PatchStub(stub_it->second, entry);
+  }
+
+  // Make existing calls go directly to the compiled code.
+  std::vector<unsigned char*> &pending_calls = code->pending_calls_[address];
+  for (std::vector<unsigned char*>::const_iterator it = pending_calls.begin();
+       it != pending_calls.end(); it++) {
+    CodeWriteScope write_scope(*it - 4, 4);
+    PatchRel32(*it, entry);
+  }
+  code->pending_calls_.erase(address);
+
+  // Calls from this function to functions that are not compiled yet will
+  // have to be patched later.
+  for (std::vector<std::pair<std::ptrdiff_t, cell> >::const_iterator it =
+         compiler.lazy_calls_.begin();
+       it != compiler.lazy_calls_.end(); it++) {
+    if (code->functions_.find(it->second) == code->functions_.end()) {
+      code->pending_calls_[it->second].push_back(
+        reinterpret_cast<unsigned char*>(base + it->first));
+    }
+  }
+
+  return entry;
+}
+
+uintptr_t CompilerImpl::TierUp(TieredCodeBuffer *code,
+                               cell function,
+                               cell target) {
+  InstallOptimizedFunction(code);
+
+  std::map<cell, int>::const_iterator index_it =
+    code->counter_index_.find(function);
+  assert(index_it != code->counter_index_.end());
+  uint32_t &counter = code->counters_[index_it->second];
+
+  // Calls to an optimized function don't reach its baseline code anymore,
+  // but calls that were already running there still do, and they are moved
+  // to the optimized code at the next check.
+  uintptr_t osr_entry = 0;
+  std::map<cell, uintptr_t>::const_iterator function_it =
+    code->functions_.find(function);
+  if (function_it != code->functions_.end()) {
+    counter = std::max(code->threshold_, 1u);
+    if (target == function) {
+      osr_entry = function_it->second;
+    } else {
+      std::map<cell, uintptr_t>::const_iterator entry_it =
+        code->osr_entries_.find(target);
+      if (entry_it != code->osr_entries_.end()) {
+        osr_entry = entry_it->second;
+      }
+    }
+  } else if (code->failed_.find(function) != code->failed_.end()) {
+    counter = kTierUpDisabled;
+  } else {
+    // Come back later to see if the function has been compiled.
+    counter = std::max(code->threshold_, 1u);
+    if (code->queued_.insert(function).second) {
+      code->queue_.push_back(function);
+    }
+  }
+
+  // Functions are compiled one at a time, so the code buffer is never
+  // changed while the compiler is using it.
+  if (code->job_ == 0 && !code->queue_.empty()) {
+    code->job_ = new TierUpJob(code, code->queue_.front());
+    code->queue_.pop_front();
+    code->job_->Start();
+  }
+
+  return osr_entry;
+}
+
+void CompilerImpl::InstallOptimizedFunction(TieredCodeBuffer *code) {
+  TierUpJob *job = code->job_;
+  if (job == 0 || !job->IsDone()) {
+    return;
+  }
+  code->job_ = 0;
+
+  if (job->function_code == 0) {
+    code->failed_.insert(job->address);
+  } else {
+    uintptr_t base = reinterpret_cast<uintptr_t>(job->function_code);
+    LinkFunction(code, job->address, job->function_code, job->compiler,
+                 false);
+    job->function_code = 0;
+
+    for (std::map<cell, std::ptrdiff_t>::const_iterator it =
+           job->compiler.instr_map_.begin();
+         it != job->compiler.instr_map_.end(); it++) {
+      if (code->loop_headers_.find(it->first) != code->loop_headers_.end()) {
+        code->osr_entries_[it->first] = base + it->second;
+      }
+    }
+    code->total_time_ += job->time;
+
+    if (code->logger_ != 0) {
+      const Function *function = code->program_->FindFunction(job->address);
+      char message[256];
+      std::sprintf(message,
+                   "Optimized function at %08x (%d bytes of bytecode, "
+                   "%u bytes of machine code) in %ld ms, "
+                   "%u of %u functions optimized in %ld ms",
+                   static_cast<unsigned int>(job->address),
+                   static_cast<int>(function->end_address()
+                                    - function->address()),
+                   static_cast<unsigned int>(
+                     job->compiler.asm_.getCodeSize()),
+                   job->time,
+                   static_cast<unsigned int>(code->functions_.size()),
+                   static_cast<unsigned int>(code->counter_index_.size()),
+                   code->total_time_);
+      code->logger_->Write(message);
+    }
+  }
+
+  delete job;
+}
+
+void *CompilerImpl::CompileOptimizedFunction(TieredCodeBuffer *code,
+                                             cell address) {
+  if (!code->analyzed_) {
+    code->analyzed_ = true;
+    Program *program = new Program(code->amx_);
+    if (program->Analyze()) {
+      code->program_ = program;
+      WriteAnalysis *write_analysis = new WriteAnalysis(*program);
+      if (code->enable_read_only_data_ && write_analysis->Run()) {
+        code->write_analysis_ = write_analysis;
+      } else {
+        delete write_analysis;
+      }
+      program_ = program;
+      write_analysis_ = code->write_analysis_;
+      eval_step_limit_ = code->eval_step_limit_;
+      FoldPureCalls();
+      code->folded_calls_ = folded_calls_;
+    } else {
+      delete program;
+    }
+  }
+  if (code->program_ == 0) {
+    return 0;
+  }
+
+  const Function *function = code->program_->FindFunction(address);
+  if (function == 0 || function->address() != address) {
+    return 0;
+  }
+
+  InitFunctionCompiler(code);
+  return CompileFunction(function);
+}
+
+void CompilerImpl::InitLazyCode(LazyCodeBuffer *code, uintptr_t base) {
+  code->write_analysis_ = write_analysis_;
+  code->folded_calls_ = folded_calls_;
+  code->enable_sysreq_d_ = enable_sysreq_d_;
+  code->enable_sleep_ = enable_sleep_;
+  code->enable_inline_natives_ = enable_inline_natives_;
+  code->debug_flags_ = debug_flags_;
+  code->halt_helper_ = base + asm_.getLabelOffset(halt_helper_label_);
+  code->jump_helper_ = base + asm_.getLabelOffset(jump_helper_label_);
+  code->jump_lookup_ = base + asm_.getLabelOffset(jump_lookup_label_);
+  code->sysreq_c_helper_ =
+    base + asm_.getLabelOffset(sysreq_c_helper_label_);
+  code->sysreq_d_helper_ =
+    base + asm_.getLabelOffset(sysreq_d_helper_label_);
+  code->sysreq_bind_helper_ =
+    base + asm_.getLabelOffset(sysreq_bind_helper_label_);
+  code->native_cache_helper_ =
+    base + asm_.getLabelOffset(native_cache_helper_label_);
+  code->native_caches_ = native_caches_;
+}
+
+void CompilerImpl::InitFunctionCompiler(LazyCodeBuffer *code) {
+  amx_ = code->amx_;
+  program_ = code->program_;
+  write_analysis_ = code->write_analysis_;
+  folded_calls_ = code->folded_calls_;
+  enable_sysreq_d_ = code->enable_sysreq_d_;
+  enable_sleep_ = code->enable_sleep_;
+  enable_inline_natives_ = code->enable_inline_natives_;
+  debug_flags_ = code->debug_flags_;
+  native_caches_ = code->native_caches_;
+  lazy_code_ = code;
+}
+
+bool CompilerImpl::EmitFunction(const Function *function,
+                                Instruction &instr) {
+  function_ = function;
+
+  for (cell cip = function->address();
+       cip < function->end_address();
+       cip += instr.size()) {
+    if (!DecodeInstruction(amx_, cip, instr)) {
+      return false;
+    }
+
+    asm_.bind(GetLabel(cip));
+    instr_map_[cip] = asm_.getCodeSize();
+
+    if (!EmitInstruction(instr)) {
+      return false;
+    }
+  }
+
+  if (function->end_address() < static_cast<cell>(amx_.code_size())
+      && !instr.opcode().IsTerminator()) {
+    asm_.jmp(GetLabel(function->end_address()));
+  }
+  return true;
+}
+
+void *CompilerImpl::CompileFunction(const Function *function) {
+  Instruction instr;
+  if (!EmitFunction(function, instr)) {
+    return 0;
+  }
+
+  EmitLazyThunks();
+  EmitErrorPaths();
+
+  return MakeCode();
+}
+
+// Copies the code to pages of its own, which stay writable until the code
+// is protected.
+void *CompilerImpl::MakeCode() {
+  // E.g. a short jump whose target turned out to be too far away.
+  if (asm_.getError() != asmjit::kErrorOk) {
+    return 0;
+  }
+  void *code = CodeArena::Allocate(asm_.getCodeSize());
+  if (code != 0) {
+    asm_.relocCode(code);
+  }
+  return code;
+}
+
+bool CompilerImpl::CompileFunctions(
+    LazyCodeBuffer *code,
+    const std::vector<const Function*> &functions,
+    Instruction &instr) {
+  InitFunctionCompiler(code);
+  link_functions_ = true;
+
+  for (std::vector<const Function*>::const_iterator it = functions.begin();
+       it != functions.end(); it++) {
+    asm_.align(asmjit::kAlignCode, 16);
+    if (!EmitFunction(*it, instr)) {
+      return false;
+    }
+  }
+
+  EmitLazyThunks();
+  EmitErrorPaths();
+  return true;
+}
+
+// Functions are split into groups of roughly equal size, one per thread,
+// and each group is compiled with its own assembler. The results are then
+// copied into a single buffer and calls between them are relocated.
+bool CompilerImpl::CompileInParallel(LazyCodeBuffer *code) {
+  std::vector<const Function*> functions;
+  std::size_t total_size = 0;
+  for (std::vector<Function*>::const_iterator it =
+         code->program_->functions().begin();
+       it != code->program_->functions().end(); it++) {
+    if (code->stubs_.find((*it)->address()) != code->stubs_.end()) {
+      functions.push_back(*it);
+      total_size += (*it)->end_address() - (*it)->address();
+    }
+  }
+
+  std::vector<Partition*> partitions;
+  std::size_t partition_size = total_size / thread_count_ + 1;
+  std::size_t size = partition_size;
+  for (std::vector<const Function*>::const_iterator it = functions.begin();
+       it != functions.end(); it++) {
+    if (size >= partition_size) {
+      partitions.push_back(new Partition(code));
+      size = 0;
+    }
+    partitions.back()->functions.push_back(*it);
+    size += (*it)->end_address() - (*it)->address();
+  }
+
+  // The first group is compiled on the current thread.
+  for (std::size_t i = 1; i < partitions.size(); i++) {
+    if (!partitions[i]->thread.Start()) {
+      Partition::Compile(partitions[i]);
+    }
+  }
+  if (!partitions.empty()) {
+    Partition::Compile(partitions[0]);
+  }
+
+  bool error = false;
+  std::vector<CompilerImpl*> compilers;
+  for (std::vector<Partition*>::const_iterator it = partitions.begin();
+       it != partitions.end(); it++) {
+    (*it)->thread.Join();
+    if ((*it)->error && !error) {
+      error = true;
+      if (error_handler_ != 0) {
+        error_handler_->Execute((*it)->instr);
+      }
+    }
+    compilers.push_back(&(*it)->compiler);
+  }
+
+  if (!error) {
+    error = !LinkFunctions(code, compilers);
+  }
+
+  for (std::vector<Partition*>::const_iterator it = partitions.begin();
+       it != partitions.end(); it++) {
+    delete *it;
+  }
+  return !error;
+}
+
+bool CompilerImpl::LinkFunctions(LazyCodeBuffer *code,
+                                 const std::vector<CompilerImpl*> &compilers) {
+  std::size_t total_size = 0;
+  for (std::vector<CompilerImpl*>::const_iterator it = compilers.begin();
+       it != compilers.end(); it++) {
+    total_size += AlignSize((*it)->asm_.getCodeSize(), 16);
+  }
+  if (total_size == 0) {
+    return true;
+  }
+
+  unsigned char *functions_code =
+    static_cast<unsigned char*>(CodeArena::Allocate(total_size));
+  if (functions_code == 0) {
+    return false;
+  }
+  code->functions_code_.push_back(std::make_pair(functions_code, total_size));
+
+  std::vector<uintptr_t> bases;
+  std::map<cell, uintptr_t> instr_ptrs;
+  std::size_t offset = 0;
+  for (std::vector<CompilerImpl*>::const_iterator it = compilers.begin();
+       it != compilers.end(); it++) {
+    uintptr_t base = reinterpret_cast<uintptr_t>(functions_code + offset);
+    (*it)->asm_.relocCode(functions_code + offset);
+    bases.push_back(base);
+    for (std::map<cell, std::ptrdiff_t>::const_iterator instr_it =
+           (*it)->instr_map_.begin();
+         instr_it != (*it)->instr_map_.end(); instr_it++) {
+      instr_ptrs[instr_it->first] = base + instr_it->second;
+    }
+    offset += AlignSize((*it)->asm_.getCodeSize(), 16);
+  }
+
+  RuntimeInfoBlock *rib =
+    reinterpret_cast<RuntimeInfoBlock*>(code->runtime_info_);
+  for (std::map<cell, uintptr_t>::const_iterator it = instr_ptrs.begin();
+       it != instr_ptrs.end(); it++) {
+    InstrTableEntry *entry = FindInstrTableEntry(rib, it->first);
+    if (entry != 0) {
+      entry->ptr = it->second;
+    }
+  }
+
+  // The stubs are all over the main code, so it's made writable once
+  // rather than for each stub.
+  {
+    unsigned char *main_code =
+      static_cast<unsigned char*>(code->runtime_info_);
+    std::size_t data_size = static_cast<std::size_t>(rib->data_size);
+    CodeWriteScope write_scope(main_code + data_size,
+                               code->size() - data_size);
+    for (std::map<cell, uintptr_t>::const_iterator it = code->stubs_.begin();
+         it != code->stubs_.end(); it++) {
+      std::map<cell, uintptr_t>::const_iterator ptr_it =
+        instr_ptrs.find(it->first);
+      if (ptr_it != instr_ptrs.end()) {
+        code->functions_[it->first] = ptr_it->second;
+        PatchStub(it->second, ptr_it->second);
+      }
+    }
+  }
+
+  for (std::size_t i = 0; i < compilers.size(); i++) {
+    AddNativeSites(code, bases[i], compilers[i]->native_fixups_);
+
+    const std::vector<std::pair<std::ptrdiff_t, cell> > &calls =
+      compilers[i]->lazy_calls_;
+    for (std::vector<std::pair<std::ptrdiff_t, cell> >::const_iterator it =
+           calls.begin();
+         it != calls.end(); it++) {
+      std::map<cell, uintptr_t>::const_iterator ptr_it =
+        instr_ptrs.find(it->second);
+      if (ptr_it != instr_ptrs.end()) {
+        PatchRel32(reinterpret_cast<unsigned char*>(bases[i] + it->first),
+                   ptr_it->second);
+      }
+    }
+  }
+
+  ProtectPages(functions_code, total_size, true);
+  CodeArena::SetOwner(functions_code, code->runtime_info_);
+  return true;
+}
+
+bool CompilerImpl::InstallTrapHandler() {
+  return SetTrapHandler(HandleTrap);
+}
+
+bool CompilerImpl::CompileImage(AMXRef amx, const std::string &directory) {
+  image_output_directory_ = directory;
+  image_stored_ = false;
+  CodeBuffer *code = Compile(amx);
+  image_output_directory_.clear();
+  if (code == 0) {
+    return false;
+  }
+  code->Delete();
+  return image_stored_;
+}
+
+// The cache key covers everything that affects the generated code: the
+// compiler options, the CPU and the script itself.
+uint64_t CompilerImpl::GetCacheKey(uint64_t script_hash) const {
+  Hasher hasher;
+  hasher.Update(kCacheFormatVersion);
+  hasher.Update(cache_tag_.c_str());
+  hasher.Update(&script_hash, sizeof(script_hash));
+
+  hasher.Update(enable_sysreq_d_);
+  hasher.Update(enable_sleep_);
+  hasher.Update(enable_resume_);
+  hasher.Update(enable_inline_natives_);
+  hasher.Update(enable_read_only_data_);
+  hasher.Update(enable_dead_code_elimination_);
+  hasher.Update(enable_function_reordering_);
+  hasher.Update(enable_branch_relaxation_);
+  hasher.Update(debug_flags_);
+  hasher.Update(specialization_budget_);
+  hasher.Update(eval_step_limit_);
+
+  const asmjit::CpuInfo *cpu_info = asmjit::CpuInfo::getHost();
+  hasher.Update(cpu_info->getVendorId());
+  hasher.Update(cpu_info->getFamily());
+  hasher.Update(cpu_info->getModel());
+  hasher.Update(cpu_info->getStepping());
+  for (uint32_t i = 0; i < 128; i += 32) {
+    uint32_t features = 0;
+    for (uint32_t j = 0; j < 32; j++) {
+      if (cpu_info->hasFeature(i + j)) {
+        features |= 1u << j;
+      }
+    }
+    hasher.Update(features);
+  }
+
+  return hasher.digest();
+}
+
+// Images made ahead of time have to match the script, the layout of the
+// runtime code and the options that change how the code is entered: code
+// compiled without sleep support can't continue a sleeping call.
+uint64_t CompilerImpl::GetImageKey(uint64_t script_hash) const {
+  Hasher hasher;
+  hasher.Update(kCacheFormatVersion);
+  hasher.Update(cache_tag_.c_str());
+  hasher.Update(&script_hash, sizeof(script_hash));
+  hasher.Update(enable_sleep_);
+  hasher.Update(enable_resume_);
+  return hasher.digest();
+}
+
+// Jump and call targets are stored in the AMX as absolute addresses, so
+// they are hashed relative to the start of the code.
+uint64_t CompilerImpl::GetScriptHash() const {
+  Hasher hasher;
+  hasher.Update(amx_.header(), sizeof(AMX_HEADER));
+  for (int i = 0; i < amx_.num_publics(); i++) {
+    hasher.Update(static_cast<uint32_t>(amx_.GetPublicAddress(i)));
+    hasher.Update(amx_.GetPublicName(i));
+  }
+  for (int i = 0; i < amx_.num_natives(); i++) {
+    hasher.Update(amx_.GetNativeName(i));
+  }
+
+  cell code_start = reinterpret_cast<cell>(amx_.code());
+  Instruction instr;
+  Disassembler disasm(amx_);
+  while (disasm.Decode(instr)) {
+    hasher.Update(static_cast<uint32_t>(instr.opcode().GetId()));
+    const std::vector<cell> &operands = instr.operands();
+    for (std::size_t i = 0; i < operands.size(); i++) {
+      cell operand = operands[i];
+      if (instr.IsCodeAddressOperand(i)) {
+        operand -= code_start;
       }
-      case OP_FILL: {
-        // Fill memory at [ALT] with value in [PRI]. The parameter
-        // specifies the number of bytes, which must be a multiple
-        // of the cell size.
-        cell num_bytes = instr.operand();
-        asm_.lea(edi, dword_ptr(ebx, ecx));
-        asm_.push(ecx);
-        asm_.mov(ecx, num_bytes / sizeof(cell));
-        asm_.rep_stosd();
-        asm_.pop(ecx);
-        break;
+      hasher.Update(static_cast<uint32_t>(operand));
+    }
+  }
+  hasher.Update(data_snapshot_ != 0 ? data_snapshot_ : amx_.data(),
+                amx_.data_size());
+
+  return hasher.digest();
+}
+
+// Finds all places in the code that depend on its location by relocating
+// it once more to a different address and comparing the results. Pointers
+// into the code change by the same amount as the address, calls to outside
+// functions change by the opposite amount.
+bool CompilerImpl::FindFixups(void *code, CodeImage &image) {
+  const uint32_t delta = 0x01010101;
+
+  std::size_t size = asm_.getCodeSize();
+  std::vector<unsigned char> moved_code(size);
+  uintptr_t base = reinterpret_cast<uintptr_t>(code);
+  asm_.relocCode(&moved_code[0], base + delta);
+
+  const unsigned char *original_code = static_cast<unsigned char*>(code);
+  for (std::size_t i = 0; i < size; ) {
+    if (original_code[i] == moved_code[i]) {
+      i++;
+      continue;
+    }
+    if (i + 4 > size) {
+      return false;
+    }
+    uint32_t original_value;
+    uint32_t moved_value;
+    std::memcpy(&original_value, &original_code[i], 4);
+    std::memcpy(&moved_value, &moved_code[i], 4);
+    if (moved_value - original_value == delta) {
+      image.internal_fixups.push_back(static_cast<uint32_t>(i));
+    } else if (original_value - moved_value == delta) {
+      uintptr_t target = base + i + 4 + original_value;
+      std::size_t index = 0;
+      while (index < kNumRuntimeFunctions
+             && runtime_functions[index] != target) {
+        index++;
       }
-      case OP_HALT:
-        // Abort execution (exit value in PRI), parameters other than 0
-        // have a special meaning.
-        asm_.mov(edi, instr.operand());
-        asm_.call(halt_helper_label_);
-        break;
-      case OP_BOUNDS: {
-        // Abort execution if PRI > value or if PRI < 0.
-        Label halt_label = asm_.newLabel();
-        Label exit_label = asm_.newLabel();
-          asm_.cmp(eax, instr.operand());
-          asm_.jg(halt_label);
-          asm_.test(eax, eax);
-          asm_.jl(halt_label);
-          asm_.jmp(exit_label);
-        asm_.bind(halt_label);
-          EmitDebugBreakpoint();
-          asm_.mov(edi, AMX_ERR_BOUNDS);
-          asm_.call(halt_helper_label_);
-        asm_.bind(exit_label);
-        break;
+      if (index == kNumRuntimeFunctions) {
+        return false;
       }
-      case OP_SYSREQ_PRI:
-        // Call system service, service number in PRI.
-        asm_.push(eax);
-        asm_.call(sysreq_c_helper_label_);
-        break;
-      case OP_SYSREQ_C: {
-        // Call system service.
-        const char *name = amx.GetNativeName(instr.operand());
-        if (name == 0) {
-          error = true;
-        } else {
-          bool handled = EmitIntrinsic(name);
-          if (!handled && amx->sysreq_d && enable_sysreq_d_) {
-            // Optimization: if we already know the address we can call this
-            // native function directly.
-            cell address = amx.GetNativeAddress(instr.operand());
-            if (address != 0) {
-              // Sometimes the address can be 0: for example, when a function
-              // is registered _after_ JIT compilation (could be a plugin).
-              asm_.push(address);
-              asm_.call(sysreq_d_helper_label_);
-              handled = true;
-            }
-          }
-          if (!handled) {
-            asm_.push(instr.operand());
-            asm_.call(sysreq_c_helper_label_);
-          }
-        }
-        break;
+      image.runtime_fixups.push_back(
+        std::make_pair(static_cast<uint32_t>(i),
+                       static_cast<uint32_t>(index)));
+    } else {
+      return false;
+    }
+    i += 4;
+  }
+
+  image.base = static_cast<uint32_t>(base);
+  image.native_fixups = native_fixups_;
+  return true;
+}
+
+// Copies the code into the image once the runtime info block and the
+// instruction table have been filled in. The pointers stored there are
+// relocated too.
+void CompilerImpl::FinishCodeImage(void *code, CodeImage &image) {
+  const unsigned char *bytes = static_cast<unsigned char*>(code);
+  image.code.assign(bytes, bytes + asm_.getCodeSize());
+
+  RuntimeInfoBlock *rib = reinterpret_cast<RuntimeInfoBlock*>(&image.code[0]);
+  rib->amx = 0;
+  rib->code_buffer = 0;
+  image.internal_fixups.push_back(offsetof(RuntimeInfoBlock, exec));
+  image.internal_fixups.push_back(offsetof(RuntimeInfoBlock, instr_table));
+  image.internal_fixups.push_back(offsetof(RuntimeInfoBlock, public_table));
+  image.internal_fixups.push_back(offsetof(RuntimeInfoBlock, native_caches));
+  if (rib->exec_return != 0) {
+    image.internal_fixups.push_back(offsetof(RuntimeInfoBlock, exec_return));
+  }
+
+  std::size_t public_table_offset =
+    rib->public_table - reinterpret_cast<intptr_t>(code);
+  const uintptr_t *public_table = reinterpret_cast<const uintptr_t*>(
+    &image.code[public_table_offset]);
+  for (intptr_t i = 0; i < rib->public_table_size; i++) {
+    if (public_table[i] != 0) {
+      image.internal_fixups.push_back(
+        static_cast<uint32_t>(public_table_offset + i * sizeof(uintptr_t)));
+    }
+  }
+
+  std::size_t instr_table_offset =
+    rib->instr_table - reinterpret_cast<intptr_t>(code);
+  for (intptr_t i = 0; i < rib->instr_table_size; i++) {
+    image.internal_fixups.push_back(static_cast<uint32_t>(
+      instr_table_offset
+      + i * sizeof(InstrTableEntry)
+      + offsetof(InstrTableEntry, ptr)));
+  }
+}
+
+CodeBuffer *CompilerImpl::LoadCodeImage(const CodeImage &image) {
+  std::size_t size = image.code.size();
+  if (size < sizeof(RuntimeInfoBlock)) {
+    return 0;
+  }
+
+  // Natives registered when the code was compiled must be registered now
+  // as well.
+  std::vector<cell> native_addresses;
+  for (std::vector<std::pair<uint32_t, uint32_t> >::const_iterator it =
+         image.native_fixups.begin();
+       it != image.native_fixups.end(); it++) {
+    cell address = amx_.GetNativeAddress(it->second);
+    if (address == 0 || it->first + 4 > size) {
+      return 0;
+    }
+    native_addresses.push_back(address);
+  }
+
+  // The data pages must line up with the pages of this machine.
+  RuntimeInfoBlock image_rib;
+  std::memcpy(&image_rib, &image.code[0], sizeof(image_rib));
+  std::size_t data_size = static_cast<std::size_t>(image_rib.data_size);
+  if (data_size > size || data_size % GetPageSize() != 0) {
+    return 0;
+  }
+
+  unsigned char *code = static_cast<unsigned char*>(CodeArena::Allocate(size));
+  if (code == 0) {
+    return 0;
+  }
+  std::memcpy(code, &image.code[0], size);
+
+  uint32_t delta =
+    static_cast<uint32_t>(reinterpret_cast<uintptr_t>(code)) - image.base;
+  for (std::vector<uint32_t>::const_iterator it =
+         image.internal_fixups.begin();
+       it != image.internal_fixups.end(); it++) {
+    if (*it + 4 > size) {
+      CodeArena::Free(code, size);
+      return 0;
+    }
+    uint32_t value;
+    std::memcpy(&value, code + *it, 4);
+    value += delta;
+    std::memcpy(code + *it, &value, 4);
+  }
+  for (std::vector<std::pair<uint32_t, uint32_t> >::const_iterator it =
+         image.runtime_fixups.begin();
+       it != image.runtime_fixups.end(); it++) {
+    if (it->first + 4 > size || it->second >= kNumRuntimeFunctions) {
+      CodeArena::Free(code, size);
+      return 0;
+    }
+    PatchRel32(code + it->first + 4, runtime_functions[it->second]);
+  }
+  for (std::size_t i = 0; i < image.native_fixups.size(); i++) {
+    std::memcpy(code + image.native_fixups[i].first,
+                &native_addresses[i],
+                4);
+  }
+
+  RuntimeInfoBlock *rib = reinterpret_cast<RuntimeInfoBlock*>(code);
+  rib->amx = reinterpret_cast<intptr_t>(amx_.raw());
+  ProtectCode(code, data_size, size);
+  CodeArena::SetOwner(code, code);
+
+  CodeBuffer *code_buffer = ShareCode(new CodeBuffer(code, size), code, image);
+  rib->code_buffer = reinterpret_cast<intptr_t>(code_buffer);
+  AddNativeSites(code_buffer, reinterpret_cast<uintptr_t>(code),
+                 image.native_fixups);
+  return code_buffer;
+}
+
+CodeBuffer *CompilerImpl::FindSharedCode(uint64_t key) const {
+  ScopedLock lock(shared_code_mutex);
+  std::map<uint64_t, SharedCode>::iterator it = shared_code.find(key);
+  if (it == shared_code.end()) {
+    return 0;
+  }
+
+  // Natives may be called directly, so they must be the same functions.
+  const SharedCode &shared = it->second;
+  if (GetNativeAddresses(amx_) != shared.native_addresses) {
+    return 0;
+  }
+  for (std::vector<std::pair<uint32_t, uint32_t> >::const_iterator
+         fixup_it = shared.image.native_fixups.begin();
+       fixup_it != shared.image.native_fixups.end(); fixup_it++) {
+    cell address;
+    std::memcpy(&address, shared.code_blob + fixup_it->first, 4);
+    if (amx_.GetNativeAddress(fixup_it->second) != address) {
+      return 0;
+    }
+  }
+
+  it->second.references++;
+  return it->second.code;
+}
+
+CodeBuffer *CompilerImpl::ShareCode(CodeBuffer *code,
+                                    const void *code_blob,
+                                    const CodeImage &image) const {
+  if (!share_code_) {
+    return code;
+  }
+
+  ScopedLock lock(shared_code_mutex);
+  if (shared_code.find(share_key_) == shared_code.end()) {
+    SharedCode &shared = shared_code[share_key_];
+    shared.code = code;
+    shared.code_blob = static_cast<const unsigned char*>(code_blob);
+    shared.image = image;
+    shared.native_addresses = GetNativeAddresses(amx_);
+    shared.references = 1;
+  }
+  return code;
+}
+
+CodeBuffer *CompilerImpl::UnshareCode(CodeBuffer *code, AMXRef amx) {
+  CodeImage image;
+  {
+    ScopedLock lock(shared_code_mutex);
+    std::map<uint64_t, SharedCode>::iterator it = shared_code.begin();
+    while (it != shared_code.end() && it->second.code != code) {
+      it++;
+    }
+    if (it == shared_code.end()) {
+      return code;
+    }
+
+    // The code can be changed in place if no other instance is using it or
+    // if the natives are still the same.
+    SharedCode &shared = it->second;
+    std::vector<cell> native_addresses = GetNativeAddresses(amx);
+    if (native_addresses == shared.native_addresses) {
+      return code;
+    }
+    if (shared.references == 1) {
+      shared.native_addresses = native_addresses;
+      return code;
+    }
+    image = shared.image;
+  }
+
+  CompilerImpl compiler;
+  compiler.amx_ = amx;
+  return compiler.LoadCodeImage(image);
+}
+
+void CompilerImpl::FoldPureCalls() {
+  typedef std::pair<cell, std::vector<cell> > CallKey;
+  std::map<CallKey, std::pair<bool, cell> > results;
+
+  Evaluator evaluator(*program_);
+  evaluator.set_step_limit(eval_step_limit_);
+  evaluator.set_write_analysis(write_analysis_);
+
+  const std::vector<Function*> &functions = program_->functions();
+  for (std::vector<Function*>::const_iterator func_it = functions.begin();
+       func_it != functions.end(); func_it++) {
+    const std::vector<CallSite> &call_sites = (*func_it)->call_sites();
+    for (std::vector<CallSite>::const_iterator it = call_sites.begin();
+         it != call_sites.end(); it++) {
+      const CallSite &call_site = *it;
+      if (!call_site.has_args_info()) {
+        continue;
       }
-      case OP_SYSREQ_D: {
-        // Call system service.
-        const char *name = amx.GetNativeName(amx.FindNative(instr.operand()));
-        if (name == 0) {
-          error = true;
-        } else {
-          if (!EmitIntrinsic(name)) {
-            asm_.push(instr.operand());
-            asm_.call(sysreq_d_helper_label_);
-          }
-        }
-        break;
+
+      const Function *callee = program_->FindFunction(call_site.callee());
+      if (callee == 0
+          || callee->address() != call_site.callee()
+          || (callee->flags() & FUNCTION_PURE) == 0) {
+        continue;
       }
-      case OP_SWITCH: {
-        // Compare PRI to the values in the case table (whose address
-        // is passed as an offset from CIP) and jump to the associated
-        // address in the matching record.
-        CaseTable case_table(amx, instr.operand());
-
-        if (case_table.num_cases() > 0) {
-          // Get minimum and maximum values.
-          cell min_value = case_table.FindMinValue();
-          cell max_value = case_table.FindMaxValue();
-
-          // Check if the value in eax is in the allowed range.
-          // If not, jump to the default case (i.e. no match).
-          asm_.cmp(eax, min_value);
-          asm_.jl(GetLabel(case_table.GetDefaultAddress()));
-          asm_.cmp(eax, max_value);
-          asm_.jg(GetLabel(case_table.GetDefaultAddress()));
-
-          // OK now sequentially compare eax with each value.
-          // This is pretty slow so I probably should optimize
-          // this in future...
-          for (int i = 0; i < case_table.num_cases(); i++) {
-            asm_.cmp(eax, case_table.GetCaseValue(i));
-            asm_.je(GetLabel(case_table.GetCaseAddress(i)));
-          }
+
+      std::vector<cell> args;
+      for (int i = 0; i < call_site.num_args(); i++) {
+        if (!call_site.arg(i).is_known()) {
+          break;
         }
+        args.push_back(call_site.arg(i).value());
+      }
+      if (static_cast<int>(args.size()) != call_site.num_args()) {
+        continue;
+      }
 
-        // No match found - go for default case.
-        asm_.jmp(GetLabel(case_table.GetDefaultAddress()));
-        break;
+      CallKey key(callee->address(), args);
+      std::map<CallKey, std::pair<bool, cell> >::iterator result_it =
+        results.find(key);
+      if (result_it == results.end()) {
+        cell result = 0;
+        bool ok = evaluator.Call(callee, args, result);
+        result_it = results.insert(
+          std::make_pair(key, std::make_pair(ok, result))).first;
+      }
+      if (result_it->second.first) {
+        folded_calls_[call_site.address()] =
+          std::make_pair(call_site.args_size(), result_it->second.second);
       }
-      case OP_CASETBL:
-        // A variable number of case records follows this opcode, where
-        // each record takes two cells.
-        break;
-      case OP_SWAP_PRI:
-        // [STK] = PRI and PRI = [STK]
-        asm_.xchg(dword_ptr(esp), eax);
-        break;
-      case OP_SWAP_ALT:
-        // [STK] = ALT and ALT = [STK]
-        asm_.xchg(dword_ptr(esp), ecx);
-        break;
-      case OP_PUSH_ADR:
-        // [STK] = FRM + offset, STK = STK - cell size
-        asm_.lea(edx, dword_ptr(ebp, instr.operand()));
-        asm_.sub(edx, ebx);
-        asm_.push(edx);
-        break;
-      case OP_NOP:
-        // No-operation, for code alignment.
-        break;
-      case OP_BREAK:
-        // Conditional breakpoint.
-        EmitDebugBreakpoint();
-        break;
-    default:
-      error = true;
     }
   }
+}
 
-  if (error && error_handler_ != 0) {
-    error_handler_->Execute(instr);
+bool CompilerImpl::EmitFoldedCall(const Instruction &instr) {
+  std::map<cell, std::pair<cell, cell> >::const_iterator it =
+    folded_calls_.find(instr.address());
+  if (it == folded_calls_.end()) {
+    return false;
   }
+  // The return value was computed at compile time: just pop the arguments
+  // (and their size) and load the result into PRI.
+  asm_.add(esp, it->second.first + static_cast<cell>(sizeof(cell)));
+  EmitLoadConstant(eax, it->second.second);
+  return true;
+}
 
-  CodeBuffer *code_buffer = 0;
+bool CompilerImpl::EmitSpecialization(const Specialization *specialization) {
+  const Function *function = specialization->function();
 
-  if (!error) {
-    void *code_blob = asm_.make();
-    code_buffer = new CodeBuffer(code_blob);
+  specialization_ = specialization;
+  specialization_label_map_.clear();
+  registers_.Reset();
 
-    RuntimeInfoBlock *rib = reinterpret_cast<RuntimeInfoBlock*>(code_blob);
-    rib->amx = reinterpret_cast<intptr_t>(amx_.raw());
-    rib->exec += reinterpret_cast<intptr_t>(code_blob);
-    rib->instr_table += reinterpret_cast<intptr_t>(code_blob);
+  asm_.align(asmjit::kAlignCode, 16);
+  asm_.bind(GetSpecializationLabel(specialization));
 
-    InstrTableEntry *ite =
-      reinterpret_cast<InstrTableEntry*>(rib->instr_table);
-    for (std::map<cell, std::ptrdiff_t>::const_iterator it = instr_map_.begin();
-         it != instr_map_.end(); it++) {
-      ite->address = it->first;
-      ite->ptr = reinterpret_cast<uintptr_t>(code_blob) + it->second;
-      ite++;
+  if (asmjit_logger_ != 0) {
+    asmjit_logger_->logFormat(asmjit::kLoggerStyleComment,
+                              "%s; specialization of %08x\n",
+                              asmjit_logger_->getIndentation(),
+                              function->address());
+  }
+
+  Instruction instr;
+  bool error = false;
+
+  for (cell address = function->address();
+       !error && address < function->end_address();
+       address += instr.size()) {
+    if (!DecodeInstruction(amx_, address, instr)) {
+      error = true;
+      break;
+    }
+
+    // Register values are not known at the start of basic blocks.
+    if (program_->IsJumpTarget(address)) {
+      registers_.Reset();
+    }
+
+    asm_.bind(GetJumpLabel(address));
+
+    LogInstruction(instr);
+    if (!EmitFoldedInstruction(instr)) {
+      if (!EmitInstruction(instr)) {
+        error = true;
+      }
+      registers_.Apply(instr);
     }
   }
 
-  amx_.Reset();
+  specialization_ = 0;
+  return !error;
+}
 
-  if (asmjit_logger_ != 0) {
-    asm_.setLogger(0);
-    delete asmjit_logger_;
+bool CompilerImpl::EmitFoldedInstruction(const Instruction &instr) {
+  cell value;
+
+  switch (instr.opcode().GetId()) {
+    case OP_CALL:
+      if (EmitFoldedCall(instr)) {
+        registers_.Reset();
+        registers_.set_pri(KnownValue(folded_calls_[instr.address()].second));
+        return true;
+      }
+      return false;
+    case OP_LOAD_PRI:
+      if (GetReadOnlyValue(instr.operand(), value)) {
+        EmitLoadConstant(eax, value);
+        registers_.set_pri(KnownValue(value));
+        return true;
+      }
+      return false;
+    case OP_LOAD_ALT:
+      if (GetReadOnlyValue(instr.operand(), value)) {
+        EmitLoadConstant(ecx, value);
+        registers_.set_alt(KnownValue(value));
+        return true;
+      }
+      return false;
+    case OP_LOAD_I:
+      if (registers_.pri().is_known()
+          && GetReadOnlyValue(registers_.pri().value(), value)) {
+        EmitLoadConstant(eax, value);
+        registers_.set_pri(KnownValue(value));
+        return true;
+      }
+      return false;
+    case OP_LIDX:
+      if (registers_.pri().is_known()
+          && registers_.alt().is_known()
+          && GetReadOnlyValue(registers_.alt().value()
+                              + registers_.pri().value() * sizeof(cell),
+                              value)) {
+        EmitLoadConstant(eax, value);
+        registers_.set_pri(KnownValue(value));
+        return true;
+      }
+      return false;
+    case OP_LOAD_S_PRI:
+      if (specialization_->GetFrameValue(instr.operand(), value)) {
+        EmitLoadConstant(eax, value);
+        registers_.set_pri(KnownValue(value));
+        return true;
+      }
+      return false;
+    case OP_LOAD_S_ALT:
+      if (specialization_->GetFrameValue(instr.operand(), value)) {
+        EmitLoadConstant(ecx, value);
+        registers_.set_alt(KnownValue(value));
+        return true;
+      }
+      return false;
+    case OP_PUSH_S:
+      if (specialization_->GetFrameValue(instr.operand(), value)) {
+        asm_.push(value);
+        return true;
+      }
+      return false;
+    case OP_BOUNDS:
+      // The check can be omitted if PRI is known to be in range.
+      if (registers_.pri().is_known()
+          && registers_.pri().value() >= 0
+          && registers_.pri().value() <= instr.operand()) {
+        return true;
+      }
+      return false;
+    case OP_JZER:
+    case OP_JNZ:
+    case OP_JEQ:
+    case OP_JNEQ:
+    case OP_JLESS:
+    case OP_JLEQ:
+    case OP_JGRTR:
+    case OP_JGEQ:
+    case OP_JSLESS:
+    case OP_JSLEQ:
+    case OP_JSGRTR:
+    case OP_JSGEQ: {
+      bool taken;
+      if (!registers_.EvaluateJump(instr, taken)) {
+        return false;
+      }
+      if (taken) {
+        cell dest = instr.operand() - reinterpret_cast<cell>(amx_.code());
+        asm_.jmp(GetJumpLabel(dest));
+      }
+      return true;
+    }
+    case OP_SWITCH: {
+      if (!registers_.pri().is_known()) {
+        return false;
+      }
+      CaseTable case_table(amx_, instr.operand());
+      cell dest = case_table.GetDefaultAddress();
+      for (int i = 0; i < case_table.num_cases(); i++) {
+        if (case_table.GetCaseValue(i) == registers_.pri().value()) {
+          dest = case_table.GetCaseAddress(i);
+          break;
+        }
+      }
+      asm_.jmp(GetJumpLabel(dest));
+      return true;
+    }
+    default: {
+      // Replace computations on known values with their results.
+      if (!IsRegisterOnly(instr)) {
+        return false;
+      }
+      RegisterState registers = registers_;
+      int modified = registers.Apply(instr);
+      if (modified == REG_NONE
+          || ((modified & REG_PRI) && !registers.pri().is_known())
+          || ((modified & REG_ALT) && !registers.alt().is_known())) {
+        return false;
+      }
+      if (modified & REG_PRI) {
+        EmitLoadConstant(eax, registers.pri().value());
+      }
+      if (modified & REG_ALT) {
+        EmitLoadConstant(ecx, registers.alt().value());
+      }
+      registers_ = registers;
+      return true;
+    }
   }
+}
 
-  return code_buffer;
+void CompilerImpl::EmitLoadConstant(const X86GpReg &reg, cell value) {
+  if (value == 0) {
+    asm_.xor_(reg, reg);
+  } else {
+    asm_.mov(reg, value);
+  }
+}
+
+bool CompilerImpl::IsDeadCode(cell address) const {
+  return enable_dead_code_elimination_
+      && program_ != 0
+      && !program_->IsReachable(address);
+}
+
+bool CompilerImpl::GetReadOnlyValue(cell address, cell &value) const {
+  return write_analysis_ != 0 && write_analysis_->GetValue(address, value);
+}
+
+void CompilerImpl::LogInstruction(const Instruction &instr) {
+  if (asmjit_logger_ != 0) {
+    asmjit_logger_->logFormat(asmjit::kLoggerStyleComment,
+                              "%s; +%08x: %08x: %s\n",
+                              asmjit_logger_->getIndentation(),
+                              asm_.getCodeSize(),
+                              instr.address(),
+                              instr.ToString().c_str());
+  }
 }
 
 void CompilerImpl::float_() {
@@ -1297,8 +3415,8 @@ void CompilerImpl::floatcmp() {
 
 void CompilerImpl::heapspace() {
   // PRI = STL - HEA
-  asm_.mov(edx, dword_ptr(amx_ptr_label_));
-  asm_.mov(edx, dword_ptr(edx, offsetof(AMX, hea)));
+  asm_.mov(edx, GetRuntimeInfoField(hea_label_,
+                                    offsetof(RuntimeInfoBlock, hea)));
   asm_.mov(eax, esp);
   asm_.sub(eax, ebx);
   asm_.sub(eax, edx);
@@ -1417,6 +3535,18 @@ void CompilerImpl::EmitRuntimeInfo() {
     asm_.dd(0); // rib->reset_hea
     asm_.dd(0); // rib->instr_map
     asm_.dd(0); // rib->instr_map_size
+    asm_.dd(0); // rib->lazy_code
+    asm_.dd(0); // rib->exec_return
+    asm_.dd(0); // rib->data_size
+    asm_.dd(0); // rib->public_table
+    asm_.dd(0); // rib->public_table_size
+    asm_.dd(0); // rib->code_buffer
+    asm_.dd(0); // rib->native_caches
+    asm_.dd(0); // rib->native_caches_size
+    asm_.dd(0); // rib->halt_helper
+    asm_.dd(0); // rib->code_start
+  asm_.bind(hea_label_);
+    asm_.dd(0); // rib->hea
 }
 
 void CompilerImpl::EmitInstrTable() {
@@ -1425,7 +3555,9 @@ void CompilerImpl::EmitInstrTable() {
   Instruction instr;
   Disassembler disasm(amx_);
   while (disasm.Decode(instr)) {
-    num_entries++;
+    if (!IsDeadCode(instr.address())) {
+      num_entries++;
+    }
   }
 
   RuntimeInfoBlock *rib = reinterpret_cast<RuntimeInfoBlock*>(asm_.getBuffer());
@@ -1438,6 +3570,37 @@ void CompilerImpl::EmitInstrTable() {
   }
 }
 
+// Entry points of public functions by index + 1, with main() at index 0.
+// They are filled in once the code is finished, so that Exec() doesn't have
+// to look them up on each call.
+void CompilerImpl::EmitPublicTable() {
+  RuntimeInfoBlock *rib = reinterpret_cast<RuntimeInfoBlock*>(asm_.getBuffer());
+  rib->public_table = asm_.getCodeSize();
+  rib->public_table_size = amx_.num_publics() + 1;
+
+  asm_.bind(public_table_label_);
+  for (intptr_t i = 0; i < rib->public_table_size; i++) {
+    asm_.dd(0);
+  }
+}
+
+// Everything before the code is written while it runs, so it gets pages of
+// its own. The code is mapped read-only once it's finished, and keeping the
+// two apart also saves the CPU from treating stores to the runtime data as
+// self-modifying code.
+void CompilerImpl::EmitDataEnd() {
+  std::size_t page_size = GetPageSize();
+  std::size_t padding = AlignSize(asm_.getCodeSize(), page_size)
+                        - asm_.getCodeSize();
+  if (padding > 0) {
+    std::vector<unsigned char> zeros(padding);
+    asm_.embed(&zeros[0], static_cast<uint32_t>(padding));
+  }
+
+  RuntimeInfoBlock *rib = reinterpret_cast<RuntimeInfoBlock*>(asm_.getBuffer());
+  rib->data_size = asm_.getCodeSize();
+}
+
 // int AMXJIT_CDECL Exec(cell index, cell *retval);
 void CompilerImpl::EmitExec() {
   RuntimeInfoBlock *rib = reinterpret_cast<RuntimeInfoBlock*>(asm_.getBuffer());
@@ -1449,28 +3612,33 @@ void CompilerImpl::EmitExec() {
   Label stack_underflow_label = asm_.newLabel();
   Label native_not_found_label = asm_.newLabel();
   Label public_not_found_label = asm_.newLabel();
+  Label public_lookup_label = asm_.newLabel();
+  Label call_label = asm_.newLabel();
   Label after_call_label_ = asm_.newLabel();
   Label finish_label = asm_.newLabel();
   Label return_label = asm_.newLabel();
   Label continue_from_sleep_label = asm_.newLabel();
 
-  int arg_index = 8;
-  int arg_retval = 12;
-  int var_address = -4;
-  int var_reset_ebp = -8;
-  int var_reset_esp = -12;
-  int var_reset_stk = -16;
-  int var_reset_hea = -20;
+  int arg_amx = 8;
+  int arg_index = 12;
+  int arg_retval = 16;
+  int var_amx = -4;
 
   asm_.bind(exec_label_);
     asm_.push(ebp);
     asm_.mov(ebp, esp);
 
     // Allocate space for the local variables.
-    asm_.sub(esp, 20);
+    asm_.sub(esp, 4);
 
     asm_.push(esi);
-    asm_.mov(esi, dword_ptr(amx_ptr_label_));
+    asm_.mov(esi, dword_ptr(ebp, arg_amx));
+
+    // Switch to the AMX this call is for. The code may be shared between
+    // instances, and the call may be nested in a call to another one.
+    asm_.mov(eax, dword_ptr(amx_ptr_label_));
+    asm_.mov(dword_ptr(ebp, var_amx), eax);
+    asm_.mov(dword_ptr(amx_ptr_label_), esi);
 
     // Set ebx = address of the AMX data section.
     asm_.push(ebx);
@@ -1508,7 +3676,7 @@ void CompilerImpl::EmitExec() {
     // Reset the error code.
     asm_.mov(dword_ptr(esi, offsetof(AMX, error)), AMX_ERR_NONE);
 
-    if (enable_sleep_) {
+    if (enable_sleep_ || enable_resume_) {
       // Handle AMX_EXEC_CONT case.
       asm_.mov(ecx, dword_ptr(ebp, arg_index));
       asm_.mov(edx, AMX_EXEC_CONT);
@@ -1516,39 +3684,19 @@ void CompilerImpl::EmitExec() {
       asm_.je(continue_from_sleep_label);
     }
 
-    // Get the address of the public function.
-    asm_.push(dword_ptr(ebp, arg_index));
-    asm_.mov(eax, dword_ptr(amx_ptr_label_));
-    asm_.push(eax);
-    asm_.call(reinterpret_cast<asmjit::Ptr>(&GetPublicAddress));
-    asm_.add(esp, 8);
-
-    // Check if the function was actually found.
+    // Get the function's start address from the public table. Indexes
+    // that are out of its range go the slow way and fail there.
+    asm_.mov(eax, dword_ptr(ebp, arg_index));
+    asm_.add(eax, 1);
+    asm_.cmp(eax, amx_.num_publics() + 1);
+    asm_.jae(public_lookup_label);
+    asm_.mov(eax, dword_ptr(public_table_label_, eax, 2));
     asm_.test(eax, eax);
-    asm_.jz(public_not_found_label);
-
-    // Get the function's start address.
-    asm_.lea(ecx, dword_ptr(rib_start_label_));
-    asm_.push(ecx);
-    asm_.push(eax);
-    asm_.call(reinterpret_cast<asmjit::Ptr>(&GetJITInstrPtr));
-    asm_.add(esp, 8);
-    asm_.mov(dword_ptr(ebp, var_address), eax);
-
-    // Save the old reset_ebp and reset_esp on the stack.
-    asm_.mov(eax, dword_ptr(reset_ebp_label_));
-    asm_.mov(dword_ptr(ebp, var_reset_ebp), eax);
-    asm_.mov(eax, dword_ptr(reset_esp_label_));
-    asm_.mov(dword_ptr(ebp, var_reset_esp), eax);
-
-    // Now do the same for reset_stk and reset_hea.
-    asm_.mov(eax, dword_ptr(reset_stk_label_));
-    asm_.mov(dword_ptr(ebp, var_reset_stk), eax);
-    asm_.mov(eax, dword_ptr(reset_hea_label_));
-    asm_.mov(dword_ptr(ebp, var_reset_hea), eax);
+    asm_.jz(public_lookup_label);
 
+  asm_.bind(call_label);
     // Call the function.
-    asm_.push(dword_ptr(ebp, var_address));
+    asm_.push(eax);
     asm_.call(exec_helper_label_);
     asm_.add(esp, 4);
 
@@ -1560,23 +3708,13 @@ void CompilerImpl::EmitExec() {
     asm_.mov(dword_ptr(ecx), eax);
 
   asm_.bind(finish_label);
-    // Restore reset_ebp and reset_esp from the stack.
-    asm_.mov(eax, dword_ptr(ebp, var_reset_ebp));
-    asm_.mov(dword_ptr(reset_ebp_label_), eax);
-    asm_.mov(eax, dword_ptr(ebp, var_reset_esp));
-    asm_.mov(dword_ptr(reset_esp_label_), eax);
-
-    // Again, do the same for reset_stk and reset_hea.
-    asm_.mov(eax, dword_ptr(ebp, var_reset_stk));
-    asm_.mov(dword_ptr(reset_stk_label_), eax);
-    asm_.mov(eax, dword_ptr(ebp, var_reset_hea));
-    asm_.mov(dword_ptr(reset_hea_label_), eax);
-
     // Copy amx->error for return and reset it.
     asm_.mov(eax, AMX_ERR_NONE);
     asm_.xchg(eax, dword_ptr(esi, offsetof(AMX, error)));
 
   asm_.bind(return_label);
+    asm_.mov(ecx, dword_ptr(ebp, var_amx));
+    asm_.mov(dword_ptr(amx_ptr_label_), ecx);
     asm_.pop(ebx);
     asm_.pop(esi);
     asm_.mov(esp, ebp);
@@ -1599,11 +3737,31 @@ void CompilerImpl::EmitExec() {
     asm_.mov(eax, AMX_ERR_NOTFOUND);
     asm_.jmp(return_label);
 
+  asm_.bind(public_lookup_label);
+    // Get the address of the public function.
+    asm_.push(dword_ptr(ebp, arg_index));
+    asm_.mov(eax, dword_ptr(amx_ptr_label_));
+    asm_.push(eax);
+    asm_.call(reinterpret_cast<asmjit::Ptr>(&GetPublicAddress));
+    asm_.add(esp, 8);
+
+    // Check if the function was actually found.
+    asm_.test(eax, eax);
+    asm_.jz(public_not_found_label);
+
+    // Get the function's start address.
+    asm_.lea(ecx, dword_ptr(rib_start_label_));
+    asm_.push(ecx);
+    asm_.push(eax);
+    asm_.call(reinterpret_cast<asmjit::Ptr>(&GetJITInstrPtr));
+    asm_.add(esp, 8);
+    asm_.jmp(call_label);
+
   asm_.bind(public_not_found_label);
     asm_.mov(eax, AMX_ERR_INDEX);
     asm_.jmp(return_label);
 
-    if (enable_sleep_) {
+    if (enable_sleep_ || enable_resume_) {
     asm_.bind(continue_from_sleep_label);
       asm_.call(exec_cont_helper_label_);
       asm_.jmp(after_call_label_);
@@ -1613,6 +3771,9 @@ void CompilerImpl::EmitExec() {
 // cell AMXJIT_CDECL ExecHelper(void *address);
 void CompilerImpl::EmitExecHelper() {
   Label call_return_label = asm_.newLabel();
+  Label save_done_label = asm_.newLabel();
+  Label restore_label = asm_.newLabel();
+  Label restore_done_label = asm_.newLabel();
 
   asm_.bind(exec_helper_label_);
     EmitDebugPrint("ExecHelper()");
@@ -1627,11 +3788,23 @@ void CompilerImpl::EmitExecHelper() {
     asm_.push(esi);
     asm_.push(edi);
 
-    // Save current stack pointers on the stack.
+    // If this is a nested call (made by a native called from this code),
+    // save the stack pointers and reset values of the outer call, which are
+    // overwritten below. There is no outer call if amx_esp is 0, so there
+    // is nothing to save. The flag tells the exit path which case it is.
+    asm_.mov(edx, dword_ptr(amx_esp_label_));
+    asm_.test(edx, edx);
+    asm_.jz(save_done_label);
     asm_.push(dword_ptr(ebp_label_));
     asm_.push(dword_ptr(esp_label_));
     asm_.push(dword_ptr(amx_ebp_label_));
-    asm_.push(dword_ptr(amx_esp_label_));
+    asm_.push(edx);
+    asm_.push(dword_ptr(reset_ebp_label_));
+    asm_.push(dword_ptr(reset_esp_label_));
+    asm_.push(dword_ptr(reset_stk_label_));
+    asm_.push(dword_ptr(reset_hea_label_));
+  asm_.bind(save_done_label);
+    asm_.push(edx);
 
     // Push parameters size to the AMX stack and reset the parameter count.
     //
@@ -1644,6 +3817,7 @@ void CompilerImpl::EmitExecHelper() {
     asm_.mov(ecx, dword_ptr(amx_ptr_label_));
     asm_.mov(edx, dword_ptr(ecx, offsetof(AMX, hea)));
     asm_.mov(dword_ptr(reset_hea_label_), edx);
+    asm_.mov(dword_ptr(hea_label_), edx);
     asm_.mov(esi, dword_ptr(ecx, offsetof(AMX, paramcount)));
     asm_.imul(esi, esi, sizeof(cell));
     asm_.mov(edx, dword_ptr(ecx, offsetof(AMX, stk)));
@@ -1677,8 +3851,16 @@ void CompilerImpl::EmitExecHelper() {
     asm_.call(eax);
 
   asm_.bind(call_return_label);
+    // Calls continued with AMX_EXEC_CONT return here, even if they were
+    // started by the interpreter.
+    if (enable_sleep_ || enable_resume_) {
+      RuntimeInfoBlock *rib =
+        reinterpret_cast<RuntimeInfoBlock*>(asm_.getBuffer());
+      rib->exec_return = asm_.getLabelOffset(call_return_label);
+    }
     asm_.mov(esi, dword_ptr(amx_ptr_label_));
     asm_.mov(edi, dword_ptr(esi, offsetof(AMX, error)));
+    EmitStoreHeap(esi, edx);
 
     if (enable_sleep_) {
       asm_.cmp(edi, AMX_ERR_SLEEP);
@@ -1695,7 +3877,6 @@ void CompilerImpl::EmitExecHelper() {
     asm_.mov(edx, esp);
     asm_.sub(edx, ebx);
     asm_.mov(dword_ptr(esi, offsetof(AMX, stk)), edx);
-    // HEA is already in sync.
 
   asm_.bind(exec_exit_label_);
     // Switch back to the native stack.
@@ -1704,10 +3885,23 @@ void CompilerImpl::EmitExecHelper() {
     asm_.mov(dword_ptr(amx_esp_label_), esp);
     asm_.mov(esp, dword_ptr(esp_label_));
 
+    // Mark the code as not running unless this was a nested call, in
+    // which case the outer call's state is restored.
+    asm_.pop(edx);
+    asm_.test(edx, edx);
+    asm_.jnz(restore_label);
+    asm_.mov(dword_ptr(amx_esp_label_), 0);
+    asm_.jmp(restore_done_label);
+  asm_.bind(restore_label);
+    asm_.pop(dword_ptr(reset_hea_label_));
+    asm_.pop(dword_ptr(reset_stk_label_));
+    asm_.pop(dword_ptr(reset_esp_label_));
+    asm_.pop(dword_ptr(reset_ebp_label_));
     asm_.pop(dword_ptr(amx_esp_label_));
     asm_.pop(dword_ptr(amx_ebp_label_));
     asm_.pop(dword_ptr(esp_label_));
     asm_.pop(dword_ptr(ebp_label_));
+  asm_.bind(restore_done_label);
 
     EmitDebugPrint("ExecHelper: returned from entry point");
 
@@ -1729,6 +3923,9 @@ void CompilerImpl::EmitExecContHelper() {
   // reset_hea = amx->reset_hea;
   // cip = (cell *)(code + (int)amx->cip);
 
+  Label save_done_label = asm_.newLabel();
+  Label invalid_address_label = asm_.newLabel();
+
   asm_.bind(exec_cont_helper_label_);
     EmitDebugPrint("ExecContHelper()");
 
@@ -1738,11 +3935,23 @@ void CompilerImpl::EmitExecContHelper() {
     asm_.push(esi);
     asm_.push(edi);
 
-    // Save current stack pointers on the stack.
+    // If this is a nested call (made by a native called from this code),
+    // save the stack pointers and reset values of the outer call, which are
+    // overwritten below. There is no outer call if amx_esp is 0, so there
+    // is nothing to save. The flag tells the exit path which case it is.
+    asm_.mov(edx, dword_ptr(amx_esp_label_));
+    asm_.test(edx, edx);
+    asm_.jz(save_done_label);
     asm_.push(dword_ptr(ebp_label_));
     asm_.push(dword_ptr(esp_label_));
     asm_.push(dword_ptr(amx_ebp_label_));
-    asm_.push(dword_ptr(amx_esp_label_));
+    asm_.push(edx);
+    asm_.push(dword_ptr(reset_ebp_label_));
+    asm_.push(dword_ptr(reset_esp_label_));
+    asm_.push(dword_ptr(reset_stk_label_));
+    asm_.push(dword_ptr(reset_hea_label_));
+  asm_.bind(save_done_label);
+    asm_.push(edx);
 
     // Switch to the AMX stack.
     asm_.mov(ecx, dword_ptr(amx_ptr_label_));
@@ -1771,12 +3980,284 @@ void CompilerImpl::EmitExecContHelper() {
     asm_.mov(dword_ptr(reset_stk_label_), eax);
     asm_.mov(eax, dword_ptr(esi, offsetof(AMX, reset_hea)));
     asm_.mov(dword_ptr(reset_hea_label_), eax);
+    asm_.mov(eax, dword_ptr(esi, offsetof(AMX, hea)));
+    asm_.mov(dword_ptr(hea_label_), eax);
     asm_.mov(eax, dword_ptr(esi, offsetof(AMX, cip)));
     asm_.call(jump_lookup_label_);
     asm_.mov(edx, eax); // address
     asm_.mov(eax, dword_ptr(esi, offsetof(AMX, pri)));
     asm_.mov(ecx, dword_ptr(esi, offsetof(AMX, alt)));
+    asm_.test(edx, edx);
+    asm_.jz(invalid_address_label);
     asm_.jmp(edx);
+
+  // There is no code to continue at (e.g. CIP is not an instruction, or
+  // the function hasn't been compiled yet in lazy mode).
+  asm_.bind(invalid_address_label);
+    asm_.mov(edi, AMX_ERR_INVINSTR);
+    asm_.call(halt_helper_label_);
+}
+
+// Does what SysreqDHelper does right at the call site. The native stack
+// layout is the same, but there is no return address to pop and the native
+// is called directly. The index is that of the native, for relocation of
+// the address in cached code, or -1.
+void CompilerImpl::EmitNativeCall(cell address, cell index) {
+  Label no_error_label = asm_.newLabel();
+
+  asm_.mov(edx, dword_ptr(amx_ptr_label_));
+  asm_.mov(esi, esp); // params
+
+  // Switch to the native stack.
+  asm_.mov(edi, ebp);
+  asm_.sub(edi, ebx);
+  asm_.mov(dword_ptr(edx, offsetof(AMX, frm)), edi); // amx->frm = ebp - data
+  asm_.mov(edi, esp);
+  asm_.sub(edi, ebx);
+  asm_.mov(dword_ptr(edx, offsetof(AMX, stk)), edi); // amx->stk = esp - data
+  EmitStoreHeap(edx, edi);
+  asm_.mov(edi, ebp);
+  asm_.mov(ebp, GetRuntimeInfoField(ebp_label_,
+                                    offsetof(RuntimeInfoBlock, ebp)));
+  asm_.mov(esp, GetRuntimeInfoField(esp_label_,
+                                    offsetof(RuntimeInfoBlock, esp)));
+  asm_.push(esi);
+  asm_.push(edi);
+
+  asm_.push(ecx); // ALT
+
+  // Call the native function.
+  asm_.push(esi); // params
+  asm_.push(edx); // amx
+  asm_.mov(eax, address);
+  if (index >= 0) {
+    native_fixups_.push_back(
+      std::make_pair(static_cast<uint32_t>(asm_.getCodeSize() - 4),
+                     static_cast<uint32_t>(index)));
+  }
+  asm_.call(eax);
+  asm_.add(esp, 8);
+
+  asm_.pop(ecx); // ALT
+
+  // Switch back to the AMX stack.
+  asm_.pop(edx);
+  asm_.mov(ebp, edx);
+  asm_.pop(edx);
+  asm_.mov(esp, edx);
+
+  asm_.mov(edx, dword_ptr(amx_ptr_label_));
+  EmitLoadHeap(edx, edi);
+  asm_.mov(edi, dword_ptr(edx, offsetof(AMX, error)));
+  asm_.test(edi, edi);
+  asm_.short_().jz(no_error_label);
+  asm_.call(halt_helper_label_);
+  asm_.bind(no_error_label);
+}
+
+// void SysreqBindHelper(cell index [on stack]);
+void CompilerImpl::EmitSysreqBindHelper() {
+  Label unbound_label = asm_.newLabel();
+
+  asm_.bind(sysreq_bind_helper_label_);
+    asm_.mov(edx, dword_ptr(esp, 4)); // index
+    asm_.mov(esi, dword_ptr(esp)); // return address (end of the call)
+
+    // Switch to the native stack.
+    asm_.mov(dword_ptr(amx_ebp_label_), ebp);
+    asm_.mov(dword_ptr(amx_esp_label_), esp);
+    asm_.mov(ebp, dword_ptr(ebp_label_));
+    asm_.mov(esp, dword_ptr(esp_label_));
+    asm_.push(dword_ptr(amx_esp_label_));
+    asm_.push(dword_ptr(amx_ebp_label_));
+
+    // Preserve PRI and ALT.
+    asm_.push(eax);
+    asm_.push(ecx);
+
+    // The code may be shared by several instances of the script, so the
+    // native is looked up in the one that is running.
+    asm_.lea(ecx, dword_ptr(rib_start_label_));
+    asm_.push(ecx);
+    asm_.push(dword_ptr(amx_ptr_label_));
+    asm_.lea(ecx, dword_ptr(sysreq_d_helper_label_));
+    asm_.push(ecx);
+    asm_.push(esi);
+    asm_.push(edx);
+    asm_.call(reinterpret_cast<asmjit::Ptr>(&LateBindNative));
+    asm_.add(esp, 20);
+    asm_.mov(edi, eax);
+
+    asm_.pop(ecx);
+    asm_.pop(eax);
+
+    // Switch back to the AMX stack.
+    asm_.pop(edx);
+    asm_.mov(ebp, edx);
+    asm_.pop(edx);
+    asm_.mov(esp, edx);
+
+    // Either way the stack looks the same as for a call to the helper:
+    // return address, then the index or the address of the native.
+    asm_.test(edi, edi);
+    asm_.jz(unbound_label);
+    asm_.mov(dword_ptr(esp, 4), edi);
+    asm_.jmp(sysreq_d_helper_label_);
+
+  asm_.bind(unbound_label);
+    asm_.jmp(sysreq_c_helper_label_);
+}
+
+// Native calls by index can't be bound at compile time. Calls through
+// sysreq.d bypass amx->callback, so the caches are used only when that's
+// allowed.
+void CompilerImpl::EmitNativeCaches() {
+  if (enable_sysreq_d_ && !enable_sleep_) {
+    Instruction instr;
+    Disassembler disasm(amx_);
+    while (disasm.Decode(instr)) {
+      if (instr.opcode().GetId() == OP_SYSREQ_PRI) {
+        int index = static_cast<int>(native_caches_.size());
+        native_caches_.insert(std::make_pair(instr.address(), index));
+      }
+    }
+  }
+
+  RuntimeInfoBlock *rib = reinterpret_cast<RuntimeInfoBlock*>(asm_.getBuffer());
+  rib->native_caches = asm_.getCodeSize();
+  rib->native_caches_size = native_caches_.size();
+
+  asm_.bind(native_caches_label_);
+  for (std::size_t i = 0; i < native_caches_.size() * kNativeCacheSize; i++) {
+    asm_.dd(-1); // index
+    asm_.dd(0); // address
+  }
+}
+
+asmjit::X86Mem CompilerImpl::GetNativeCacheEntry(cell address,
+                                                 std::size_t offset) const {
+  std::map<cell, int>::const_iterator it = native_caches_.find(address);
+  assert(it != native_caches_.end());
+  std::size_t entry_offset =
+    it->second * kNativeCacheSize * sizeof(NativeCacheEntry) + offset;
+  if (lazy_code_ != 0) {
+    RuntimeInfoBlock *rib =
+      reinterpret_cast<RuntimeInfoBlock*>(lazy_code_->runtime_info_);
+    return dword_ptr_abs(
+      static_cast<asmjit::Ptr>(rib->native_caches + entry_offset));
+  }
+  return dword_ptr(native_caches_label_, static_cast<int>(entry_offset));
+}
+
+// The index is in PRI. A cache hit goes straight to SysreqDHelper.
+void CompilerImpl::EmitCachedNativeCall(cell address) {
+  Label miss_label = asm_.newLabel();
+  Label exit_label = asm_.newLabel();
+
+  asm_.cmp(eax, GetNativeCacheEntry(address,
+                                    offsetof(NativeCacheEntry, index)));
+  asm_.jne(miss_label);
+  asm_.mov(edx, GetNativeCacheEntry(address,
+                                    offsetof(NativeCacheEntry, address)));
+  // Unused entries have no address, and their index could be in PRI too.
+  asm_.test(edx, edx);
+  asm_.jz(miss_label);
+  asm_.push(edx);
+  asm_.call(sysreq_d_helper_label_);
+  asm_.jmp(exit_label);
+
+  asm_.bind(miss_label);
+  asm_.lea(edx, GetNativeCacheEntry(address, 0));
+  asm_.push(eax);
+  asm_.call(native_cache_helper_label_);
+
+  asm_.bind(exit_label);
+}
+
+// void NativeCacheHelper(cell index [eax, on stack],
+//                        NativeCacheEntry *entries [edx]);
+void CompilerImpl::EmitNativeCacheHelper() {
+  Label unbound_label = asm_.newLabel();
+
+  asm_.bind(native_cache_helper_label_);
+    for (int i = 1; i < kNativeCacheSize; i++) {
+      Label next_label = asm_.newLabel();
+      asm_.cmp(eax, dword_ptr(edx, i * sizeof(NativeCacheEntry)
+                                   + offsetof(NativeCacheEntry, index)));
+      asm_.jne(next_label);
+      asm_.mov(esi, dword_ptr(edx, i * sizeof(NativeCacheEntry)
+                                   + offsetof(NativeCacheEntry, address)));
+      asm_.test(esi, esi);
+      asm_.jz(next_label);
+      asm_.mov(dword_ptr(esp, 4), esi);
+      asm_.jmp(sysreq_d_helper_label_);
+      asm_.bind(next_label);
+    }
+
+    // Switch to the native stack.
+    asm_.mov(dword_ptr(amx_ebp_label_), ebp);
+    asm_.mov(dword_ptr(amx_esp_label_), esp);
+    asm_.mov(ebp, dword_ptr(ebp_label_));
+    asm_.mov(esp, dword_ptr(esp_label_));
+    asm_.push(dword_ptr(amx_esp_label_));
+    asm_.push(dword_ptr(amx_ebp_label_));
+
+    asm_.push(ecx); // ALT
+
+    asm_.push(edx);
+    asm_.push(eax);
+    asm_.push(dword_ptr(amx_ptr_label_));
+    asm_.call(reinterpret_cast<asmjit::Ptr>(&CacheNative));
+    asm_.add(esp, 12);
+    asm_.mov(esi, eax);
+
+    asm_.pop(ecx); // ALT
+
+    // Switch back to the AMX stack.
+    asm_.pop(edx);
+    asm_.mov(ebp, edx);
+    asm_.pop(edx);
+    asm_.mov(esp, edx);
+
+    // Unknown natives are reported by SysreqCHelper, the index is still on
+    // the stack.
+    asm_.test(esi, esi);
+    asm_.jz(unbound_label);
+    asm_.mov(dword_ptr(esp, 4), esi);
+    asm_.jmp(sysreq_d_helper_label_);
+
+  asm_.bind(unbound_label);
+    asm_.jmp(sysreq_c_helper_label_);
+}
+
+// Functions compiled apart from the main code (in lazy and tiered mode)
+// refer to the runtime info block by its address.
+asmjit::X86Mem CompilerImpl::GetRuntimeInfoField(const Label &label,
+                                                 std::size_t offset) const {
+  if (lazy_code_ != 0) {
+    uintptr_t rib = reinterpret_cast<uintptr_t>(lazy_code_->runtime_info_);
+    return dword_ptr_abs(static_cast<asmjit::Ptr>(rib + offset));
+  }
+  return dword_ptr(label);
+}
+
+// While the code runs, HEA is kept in the runtime info block rather than
+// in the AMX, so that HEAP doesn't have to load the AMX pointer first. It's
+// copied to amx->hea before anything outside the code can look at it (a
+// native call, halt, sleep or return from amx_Exec) and back after a native
+// call, which may allocate heap memory.
+void CompilerImpl::EmitStoreHeap(const asmjit::X86GpReg &amx,
+                                 const asmjit::X86GpReg &temp) {
+  asm_.mov(temp, GetRuntimeInfoField(hea_label_,
+                                     offsetof(RuntimeInfoBlock, hea)));
+  asm_.mov(dword_ptr(amx, offsetof(AMX, hea)), temp);
+}
+
+void CompilerImpl::EmitLoadHeap(const asmjit::X86GpReg &amx,
+                                const asmjit::X86GpReg &temp) {
+  asm_.mov(temp, dword_ptr(amx, offsetof(AMX, hea)));
+  asm_.mov(GetRuntimeInfoField(hea_label_, offsetof(RuntimeInfoBlock, hea)),
+           temp);
 }
 
 // void HaltHelper(int error [edi]);
@@ -1784,6 +4265,9 @@ void CompilerImpl::EmitHaltHelper() {
   Label sleep_label = asm_.newLabel();
   Label exit_label = asm_.newLabel();
 
+  RuntimeInfoBlock *rib = reinterpret_cast<RuntimeInfoBlock*>(asm_.getBuffer());
+  rib->halt_helper = asm_.getCodeSize();
+
   asm_.bind(halt_helper_label_);
     EmitDebugPrint("HaltHelper()");
 
@@ -1803,7 +4287,7 @@ void CompilerImpl::EmitHaltHelper() {
     asm_.mov(edx, esp);
     asm_.sub(edx, ebx);
     asm_.mov(dword_ptr(esi, offsetof(AMX, stk)), edx);
-    // HEA is already in sync.
+    EmitStoreHeap(esi, edx);
 
     if (enable_sleep_) {
       // Handle error == AMX_ERR_SLEEP case.
@@ -1833,25 +4317,29 @@ void CompilerImpl::EmitHaltHelper() {
     }
 }
 
-// void JumpHelper(void *address [eax]);
+// void *JumpHelper(void *address [eax]) [edx];
+//
+// The jump itself is done by the caller: the helper always returns, so that
+// its CALL and RET stay paired and don't throw off return prediction.
 void CompilerImpl::EmitJumpHelper() {
-  Label invalid_address_label = asm_.newLabel();
-
   asm_.bind(jump_helper_label_);
     asm_.push(eax);
     asm_.call(jump_lookup_label_);
     asm_.mov(edx, eax); // address
     asm_.pop(eax);
+    asm_.ret();
+}
 
-    asm_.test(edx, edx);
-    asm_.jz(invalid_address_label);
+void CompilerImpl::EmitIndirectJump() {
+  Label invalid_address_label = asm_.newLabel();
 
-    asm_.lea(esp, dword_ptr(esp, 4));
-    asm_.jmp(edx);
+  asm_.call(jump_helper_label_);
+  asm_.test(edx, edx);
+  asm_.jz(invalid_address_label);
+  asm_.jmp(edx);
 
   // Continue execution as if there was no jump at all (this is what AMX does).
   asm_.bind(invalid_address_label);
-    asm_.ret();
 }
 
 // void JumpLookup(void *address [eax]);
@@ -1901,16 +4389,10 @@ void CompilerImpl::EmitSysreqCHelper() {
 
     asm_.mov(edx, dword_ptr(amx_ptr_label_));
 
-    if (enable_sleep_) {
-      // Copy CIP to amx->cip (needed for "sleep" to work).
-      asm_.mov(eax, dword_ptr(esp));  // return address
-      asm_.call(reverse_jump_lookup_label_);
-      asm_.mov(dword_ptr(edx, offsetof(AMX, cip)), eax);
-    }
-
-    asm_.pop(esi); // return address
-    asm_.pop(eax); // index
-    asm_.lea(edi, dword_ptr(esp)); // params
+    // The return address and the index stay on the stack until the final
+    // RET, which then returns to where the CALL came from.
+    asm_.mov(eax, dword_ptr(esp, 4)); // index
+    asm_.lea(edi, dword_ptr(esp, 8)); // params
 
     // Switch to the native stack.
     asm_.mov(dword_ptr(amx_ebp_label_), ebp);
@@ -1918,8 +4400,10 @@ void CompilerImpl::EmitSysreqCHelper() {
     asm_.mov(dword_ptr(edx, offsetof(AMX, frm)), ebp); // amx->frm = ebp - data
     asm_.mov(ebp, dword_ptr(ebp_label_));
     asm_.mov(dword_ptr(amx_esp_label_), esp);
-    asm_.sub(esp, ebx);
-    asm_.mov(dword_ptr(edx, offsetof(AMX, stk)), esp); // amx->stk = esp - data
+    asm_.mov(esi, edi);
+    asm_.sub(esi, ebx);
+    asm_.mov(dword_ptr(edx, offsetof(AMX, stk)), esi); // params - data
+    EmitStoreHeap(edx, esi);
     asm_.mov(esp, dword_ptr(esp_label_));
     asm_.push(dword_ptr(amx_esp_label_));
     asm_.push(dword_ptr(amx_ebp_label_));
@@ -1949,6 +4433,10 @@ void CompilerImpl::EmitSysreqCHelper() {
     asm_.pop(edx);
     asm_.mov(esp, edx);
 
+    // The native may have allocated or released heap memory.
+    asm_.mov(edx, dword_ptr(amx_ptr_label_));
+    EmitLoadHeap(edx, esi);
+
     // Check return value for errors and leave.
     if (enable_sleep_) {
       asm_.cmp(edi, AMX_ERR_SLEEP);
@@ -1956,10 +4444,10 @@ void CompilerImpl::EmitSysreqCHelper() {
     }
     asm_.cmp(edi, AMX_ERR_NONE);
     asm_.jne(error_label);
-    asm_.push(esi); // return address
-    asm_.ret();
+    asm_.ret(4);
 
   asm_.bind(error_label);
+    asm_.add(esp, 8);
     asm_.call(halt_helper_label_);
 
     if (enable_sleep_) {
@@ -1979,6 +4467,13 @@ void CompilerImpl::EmitSysreqCHelper() {
       asm_.mov(edx, dword_ptr(amx_ptr_label_));
       asm_.mov(dword_ptr(edx, offsetof(AMX, pri)), eax);
       asm_.mov(dword_ptr(edx, offsetof(AMX, alt)), ecx);
+
+      // CIP is looked up only now, so that native calls that don't sleep
+      // don't pay for it.
+      asm_.mov(eax, dword_ptr(esp)); // return address
+      asm_.call(reverse_jump_lookup_label_);
+      asm_.mov(dword_ptr(edx, offsetof(AMX, cip)), eax);
+
       asm_.mov(ecx, dword_ptr(reset_stk_label_));
       asm_.mov(dword_ptr(edx, offsetof(AMX, reset_stk)), ecx);
       asm_.mov(ecx, dword_ptr(reset_hea_label_));
@@ -1998,16 +4493,10 @@ void CompilerImpl::EmitSysreqDHelper() {
 
     asm_.mov(edx, dword_ptr(amx_ptr_label_));
 
-    if (enable_sleep_) {
-      // Save CIP to amx->cip (needed for sleep to work).
-      asm_.mov(eax, dword_ptr(esp));  // return address
-      asm_.call(reverse_jump_lookup_label_);
-      asm_.mov(dword_ptr(edx, offsetof(AMX, cip)), eax);
-    }
-
-    asm_.pop(esi); // return address
-    asm_.pop(eax); // address
-    asm_.lea(edi, dword_ptr(esp)); // params
+    // The return address and the address stay on the stack until the final
+    // RET, which then returns to where the CALL came from.
+    asm_.mov(eax, dword_ptr(esp, 4)); // address
+    asm_.lea(edi, dword_ptr(esp, 8)); // params
 
     // Switch to the native stack.
     asm_.mov(dword_ptr(amx_ebp_label_), ebp);
@@ -2015,8 +4504,10 @@ void CompilerImpl::EmitSysreqDHelper() {
     asm_.mov(dword_ptr(edx, offsetof(AMX, frm)), ebp); // amx->frm = ebp - data
     asm_.mov(ebp, dword_ptr(ebp_label_));
     asm_.mov(dword_ptr(amx_esp_label_), esp);
-    asm_.sub(esp, ebx);
-    asm_.mov(dword_ptr(edx, offsetof(AMX, stk)), esp); // amx->stk = esp - data
+    asm_.mov(esi, edi);
+    asm_.sub(esi, ebx);
+    asm_.mov(dword_ptr(edx, offsetof(AMX, stk)), esi); // params - data
+    EmitStoreHeap(edx, esi);
     asm_.mov(esp, dword_ptr(esp_label_));
     asm_.push(dword_ptr(amx_esp_label_));
     asm_.push(dword_ptr(amx_ebp_label_));
@@ -2040,6 +4531,7 @@ void CompilerImpl::EmitSysreqDHelper() {
     asm_.mov(esp, edx);
 
     asm_.mov(edx, dword_ptr(amx_ptr_label_));
+    EmitLoadHeap(edx, esi); // the native may have changed it
     asm_.mov(edi, dword_ptr(edx, offsetof(AMX, error)));
 
     // Check for errors and leave.
@@ -2049,10 +4541,10 @@ void CompilerImpl::EmitSysreqDHelper() {
     }
     asm_.cmp(edi, AMX_ERR_NONE);
     asm_.jne(error_label);
-    asm_.push(esi); // return address
-    asm_.ret();
+    asm_.ret(4);
 
   asm_.bind(error_label);
+    asm_.add(esp, 8);
     asm_.call(halt_helper_label_);
 
     if (enable_sleep_) {
@@ -2072,6 +4564,13 @@ void CompilerImpl::EmitSysreqDHelper() {
       asm_.mov(edx, dword_ptr(amx_ptr_label_));
       asm_.mov(dword_ptr(edx, offsetof(AMX, pri)), eax);
       asm_.mov(dword_ptr(edx, offsetof(AMX, alt)), ecx);
+
+      // CIP is looked up only now, so that native calls that don't sleep
+      // don't pay for it.
+      asm_.mov(eax, dword_ptr(esp)); // return address
+      asm_.call(reverse_jump_lookup_label_);
+      asm_.mov(dword_ptr(edx, offsetof(AMX, cip)), eax);
+
       asm_.mov(ecx, dword_ptr(reset_stk_label_));
       asm_.mov(dword_ptr(edx, offsetof(AMX, reset_stk)), ecx);
       asm_.mov(ecx, dword_ptr(reset_hea_label_));
@@ -2095,6 +4594,247 @@ void CompilerImpl::EmitDebugPrint(const char *message) {
   }
 }
 
+// Error paths are placed after all functions so that the code that checks
+// for errors falls through on the common path and keeps the error handling
+// out of the instruction cache. Each instruction gets its own path, which
+// sets amx->cip to the instruction's address for debuggers and crash
+// reports.
+void CompilerImpl::EmitErrorPaths() {
+  for (std::map<std::pair<cell, cell>, Label>::const_iterator it =
+         error_labels_.begin();
+       it != error_labels_.end(); it++) {
+    asm_.bind(it->second);
+      EmitDebugBreakpoint();
+      asm_.mov(esi, dword_ptr(amx_ptr_label_));
+      asm_.mov(dword_ptr(esi, offsetof(AMX, cip)), it->first.second);
+      asm_.mov(edi, it->first.first);
+      asm_.call(halt_helper_label_);
+  }
+}
+
+// void LazyCompileHelper(cell address [on stack]);
+void CompilerImpl::EmitLazyCompileHelper() {
+  Label error_label = asm_.newLabel();
+
+  asm_.bind(lazy_compile_helper_label_);
+    asm_.pop(edx); // function address
+
+    // Switch to the native stack: compiling may need a lot of it.
+    asm_.mov(dword_ptr(amx_ebp_label_), ebp);
+    asm_.mov(dword_ptr(amx_esp_label_), esp);
+    asm_.mov(ebp, dword_ptr(ebp_label_));
+    asm_.mov(esp, dword_ptr(esp_label_));
+    asm_.push(dword_ptr(amx_esp_label_));
+    asm_.push(dword_ptr(amx_ebp_label_));
+
+    // Preserve PRI and ALT, they may hold function arguments.
+    asm_.push(eax);
+    asm_.push(ecx);
+
+    asm_.lea(ecx, dword_ptr(rib_start_label_));
+    asm_.push(ecx);
+    asm_.push(edx);
+    asm_.call(reinterpret_cast<asmjit::Ptr>(&LazyCompile));
+    asm_.add(esp, 8);
+    asm_.mov(edi, eax);
+
+    asm_.pop(ecx);
+    asm_.pop(eax);
+
+    // Switch back to the AMX stack.
+    asm_.pop(edx);
+    asm_.mov(ebp, edx);
+    asm_.pop(edx);
+    asm_.mov(esp, edx);
+
+    // The return address of the original call is still on the stack, so
+    // jumping to the function is all that's left to do.
+    asm_.test(edi, edi);
+    asm_.jz(error_label);
+    asm_.jmp(edi);
+
+  asm_.bind(error_label);
+    asm_.mov(edi, AMX_ERR_INIT_JIT);
+    asm_.call(halt_helper_label_);
+}
+
+// void TierUpHelper(cell function [on stack], cell target [on stack]);
+void CompilerImpl::EmitTierUpHelper() {
+  Label osr_label = asm_.newLabel();
+
+  asm_.bind(tier_up_helper_label_);
+    asm_.mov(edx, dword_ptr(esp, 8)); // function address
+    asm_.mov(edi, dword_ptr(esp, 4)); // target address
+
+    // Switch to the native stack.
+    asm_.mov(dword_ptr(amx_ebp_label_), ebp);
+    asm_.mov(dword_ptr(amx_esp_label_), esp);
+    asm_.mov(ebp, dword_ptr(ebp_label_));
+    asm_.mov(esp, dword_ptr(esp_label_));
+    asm_.push(dword_ptr(amx_esp_label_));
+    asm_.push(dword_ptr(amx_ebp_label_));
+
+    // The counter may be checked in the middle of a function, so all
+    // registers must be preserved.
+    asm_.push(eax);
+    asm_.push(ecx);
+
+    asm_.lea(ecx, dword_ptr(rib_start_label_));
+    asm_.push(ecx);
+    asm_.push(edi);
+    asm_.push(edx);
+    asm_.call(reinterpret_cast<asmjit::Ptr>(&RequestTierUp));
+    asm_.add(esp, 12);
+    asm_.mov(edi, eax);
+
+    asm_.pop(ecx);
+    asm_.pop(eax);
+
+    // Switch back to the AMX stack.
+    asm_.pop(edx);
+    asm_.mov(ebp, edx);
+    asm_.pop(edx);
+    asm_.mov(esp, edx);
+
+    asm_.test(edi, edi);
+    asm_.jnz(osr_label);
+    asm_.ret(8);
+
+  asm_.bind(osr_label);
+    // Continue in the optimized code. Both tiers keep FRM, STK, PRI and ALT
+    // in the same places and nothing else lives across instructions, so
+    // there is no state to convert.
+    asm_.add(esp, 12);
+    asm_.jmp(edi);
+}
+
+// Loop headers are the targets of backward jumps within a function. Tiered
+// code checks counters there, so that long loops can move to optimized
+// code without waiting for the function to return.
+void CompilerImpl::FindLoopHeaders() {
+  cell code_base = reinterpret_cast<cell>(amx_.code());
+  cell function = -1;
+
+  Disassembler disasm(amx_);
+  Instruction instr;
+  while (disasm.Decode(instr)) {
+    if (instr.opcode().GetId() == OP_PROC) {
+      function = instr.address();
+      int index = static_cast<int>(tier_up_counters_.size());
+      tier_up_counters_.insert(std::make_pair(function, index));
+    } else if (function >= 0 && IsBackwardJump(instr, code_base)) {
+      cell target = instr.operand() - code_base;
+      if (target > function) {
+        loop_headers_.insert(target);
+      }
+    }
+  }
+}
+
+// Counts calls and loop iterations of a function. This is placed at the
+// start of each function, and it's at least 5 bytes long, so it can be
+// overwritten with a jump to the optimized code.
+void CompilerImpl::EmitTierUpCounter(cell function, cell target) {
+  std::map<cell, int>::const_iterator it = tier_up_counters_.find(function);
+  assert(it != tier_up_counters_.end());
+
+  Label skip_label = asm_.newLabel();
+  asm_.sub(dword_ptr(tier_up_counters_label_, it->second * 4), 1);
+  asm_.short_().jnz(skip_label);
+    asm_.push(function);
+    asm_.push(target);
+    asm_.call(tier_up_helper_label_);
+  asm_.bind(skip_label);
+}
+
+void CompilerImpl::EmitTierUpCounters() {
+  asm_.align(asmjit::kAlignData, 4);
+  asm_.bind(tier_up_counters_label_);
+  for (std::size_t i = 0; i < tier_up_counters_.size(); i++) {
+    asm_.dd(static_cast<int>(std::max(tier_up_threshold_, 1u)));
+  }
+}
+
+void CompilerImpl::EmitLazyStubs() {
+  const std::vector<Function*> &functions = program_->functions();
+  for (std::vector<Function*>::const_iterator it = functions.begin();
+       it != functions.end(); it++) {
+    cell address = (*it)->address();
+    if (IsDeadCode(address)) {
+      continue;
+    }
+
+    // The stub is overwritten with a 5-byte JMP once the function is
+    // compiled, so it must be at least that long.
+    asm_.bind(GetLabel(address));
+    instr_map_[address] = asm_.getCodeSize();
+    asm_.push(address);
+    asm_.long_().jmp(lazy_compile_helper_label_);
+  }
+}
+
+// Code of a lazily compiled function is placed in a separate buffer, so
+// the runtime helpers and other functions are reached through absolute
+// jumps.
+void CompilerImpl::EmitLazyThunks() {
+  asm_.bind(halt_helper_label_);
+    asm_.jmp(static_cast<asmjit::Ptr>(lazy_code_->halt_helper_));
+  asm_.bind(jump_helper_label_);
+    asm_.jmp(static_cast<asmjit::Ptr>(lazy_code_->jump_helper_));
+  asm_.bind(jump_lookup_label_);
+    asm_.jmp(static_cast<asmjit::Ptr>(lazy_code_->jump_lookup_));
+  asm_.bind(sysreq_c_helper_label_);
+    asm_.jmp(static_cast<asmjit::Ptr>(lazy_code_->sysreq_c_helper_));
+  asm_.bind(sysreq_d_helper_label_);
+    asm_.jmp(static_cast<asmjit::Ptr>(lazy_code_->sysreq_d_helper_));
+  asm_.bind(sysreq_bind_helper_label_);
+    asm_.jmp(static_cast<asmjit::Ptr>(lazy_code_->sysreq_bind_helper_));
+  asm_.bind(native_cache_helper_label_);
+    asm_.jmp(static_cast<asmjit::Ptr>(lazy_code_->native_cache_helper_));
+
+  // Jumps out of the function (only possible with #emit).
+  RuntimeInfoBlock *rib =
+    reinterpret_cast<RuntimeInfoBlock*>(lazy_code_->runtime_info_);
+  for (std::map<cell, Label>::const_iterator it = label_map_.begin();
+       it != label_map_.end(); it++) {
+    if (asm_.isLabelBound(it->second)) {
+      continue;
+    }
+    asm_.bind(it->second);
+    uintptr_t target = GetJITInstrPtr(it->first, rib);
+    if (target != 0) {
+      asm_.jmp(static_cast<asmjit::Ptr>(target));
+    } else {
+      asm_.long_().jmp(GetErrorLabel(AMX_ERR_INVINSTR, it->first));
+    }
+    // When compiling functions in parallel, the target may be compiled by
+    // another thread.
+    if (link_functions_) {
+      lazy_calls_.push_back(std::make_pair(asm_.getCodeSize(), it->first));
+    }
+  }
+
+  asm_.align(asmjit::kAlignData, 4);
+  asm_.bind(amx_ptr_label_);
+    asm_.dd(reinterpret_cast<intptr_t>(amx_.raw()));
+}
+
+void CompilerImpl::EmitLazyCall(cell address) {
+  std::map<cell, uintptr_t>::const_iterator it =
+    lazy_code_->functions_.find(address);
+  if (it != lazy_code_->functions_.end()) {
+    asm_.call(static_cast<asmjit::Ptr>(it->second));
+    return;
+  }
+  it = lazy_code_->stubs_.find(address);
+  if (it != lazy_code_->stubs_.end()) {
+    asm_.call(static_cast<asmjit::Ptr>(it->second));
+    lazy_calls_.push_back(std::make_pair(asm_.getCodeSize(), address));
+    return;
+  }
+  asm_.call(GetLabel(address));
+}
+
 void CompilerImpl::EmitDebugBreakpoint() {
   if ((debug_flags_ & DEBUG_BREAKPOINTS) && IsDebuggerPresent()) {
     asm_.int3();
@@ -2109,4 +4849,34 @@ const Label &CompilerImpl::GetLabel(cell address) {
   return label;
 }
 
+const Label &CompilerImpl::GetErrorLabel(cell error, cell address) {
+  Label &label = error_labels_[std::make_pair(error, address)];
+  if (label.getId() == asmjit::kInvalidValue) {
+    label = asm_.newLabel();
+  }
+  return label;
+}
+
+const Label &CompilerImpl::GetJumpLabel(cell address) {
+  // Jumps within a specialized function must stay within its copy.
+  if (specialization_ != 0
+      && specialization_->function()->Contains(address)) {
+    Label &label = specialization_label_map_[address];
+    if (label.getId() == asmjit::kInvalidValue) {
+      label = asm_.newLabel();
+    }
+    return label;
+  }
+  return GetLabel(address);
+}
+
+const Label &CompilerImpl::GetSpecializationLabel(
+  const Specialization *specialization) {
+  Label &label = specialization_labels_[specialization];
+  if (label.getId() == asmjit::kInvalidValue) {
+    label = asm_.newLabel();
+  }
+  return label;
+}
+
 }  // namespace amxjit
@@ -23,10 +23,18 @@
 // POSSIBILITY OF SUCH DAMAGE.
 
 #include <cstddef>
+#include <deque>
 #include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
 #include <asmjit/base.h>
 #include <asmjit/x86.h>
 #include "amxref.h"
+#include "compiler.h"
+#include "constfold.h"
+#include "cstdint.h"
 #include "macros.h"
 
 #ifndef AMXJIT_COMPILER_IMPL_H
@@ -34,10 +42,18 @@
 
 namespace amxjit {
 
-class CodeBuffer;
+class CodeImage;
 class CompileErrorHandler;
+class Function;
+class LazyCodeBuffer;
 class Logger;
 class Instruction;
+class Program;
+class Specialization;
+class Specializer;
+class TieredCodeBuffer;
+struct TierUpJob;
+class WriteAnalysis;
 
 class CompilerImpl {
  public:
@@ -58,8 +74,145 @@ class CompilerImpl {
   void SetDebugFlags(unsigned int flags) {
     debug_flags_ = flags;
   }
+  void SetSpecializationBudget(unsigned int budget) {
+    specialization_budget_ = budget;
+  }
+  void SetEvalStepLimit(unsigned int limit) {
+    eval_step_limit_ = limit;
+  }
+  void SetReadOnlyDataEnabled(bool flag) {
+    enable_read_only_data_ = flag;
+  }
+  void SetDeadCodeEliminationEnabled(bool flag) {
+    enable_dead_code_elimination_ = flag;
+  }
+  void SetFunctionReorderingEnabled(bool flag) {
+    enable_function_reordering_ = flag;
+  }
+  void SetBranchRelaxationEnabled(bool flag) {
+    enable_branch_relaxation_ = flag;
+  }
+  void SetLazyCompilationEnabled(bool flag) {
+    enable_lazy_compilation_ = flag;
+  }
+  void SetThreadCount(unsigned int count) {
+    thread_count_ = count;
+  }
+  void SetCacheDirectory(const std::string &directory) {
+    cache_directory_ = directory;
+  }
+  void SetCacheTag(const std::string &tag) {
+    cache_tag_ = tag;
+  }
+  void SetImageDirectory(const std::string &directory) {
+    image_directory_ = directory;
+  }
+  void SetTieredCompilationEnabled(bool flag) {
+    enable_tiered_compilation_ = flag;
+  }
+  void SetTierUpThreshold(unsigned int threshold) {
+    tier_up_threshold_ = threshold;
+  }
+  void SetTierUpLogger(Logger *logger) {
+    tier_up_logger_ = logger;
+  }
+  void SetResumeEnabled(bool flag) {
+    enable_resume_ = flag;
+  }
+  void SetInlineNativesEnabled(bool flag) {
+    enable_inline_natives_ = flag;
+  }
+  void SetDataSnapshot(const unsigned char *data) {
+    data_snapshot_ = data;
+  }
 
   CodeBuffer *Compile(AMXRef amx);
+  bool CompileImage(AMXRef amx, const std::string &directory);
+
+  // Compiles a function of a lazily compiled script on its first call and
+  // returns a pointer to its code, or 0 on error.
+  static uintptr_t CompileLazyFunction(LazyCodeBuffer *code, cell address);
+
+  static bool InstallTrapHandler();
+
+  // Compiles a group of functions of a lazily compiled script into a single
+  // piece of code. Calls and jumps to other functions go to their stubs and
+  // are recorded so that they can be relocated with LinkFunctions().
+  bool CompileFunctions(LazyCodeBuffer *code,
+                        const std::vector<const Function*> &functions,
+                        Instruction &instr);
+
+  // Called from baseline code of a tiered script when the counter of a
+  // function runs out at its start or at a loop header (target). Installs
+  // functions compiled in the background and schedules this one for
+  // recompilation. Returns the address of the target in the optimized code
+  // if the function has already been optimized, or 0.
+  static uintptr_t TierUp(TieredCodeBuffer *code,
+                          cell function,
+                          cell target);
+
+  // Called on the first execution of a call to a native that was not
+  // registered at compile time. If the native is registered now, the call
+  // is rewritten to go to SysreqDHelper and the native's address is
+  // returned, otherwise 0.
+  static uintptr_t BindNative(CodeBuffer *code,
+                              AMXRef amx,
+                              cell index,
+                              unsigned char *call_end,
+                              uintptr_t sysreq_d_helper);
+
+  // Called when the natives of an instance change. Returns code that can be
+  // rebound to the instance's natives: the same code if no other instance
+  // depends on it, otherwise a copy of its own, or 0 on failure.
+  static CodeBuffer *UnshareCode(CodeBuffer *code, AMXRef amx);
+
+  // Compiles a function of a tiered script with all optimizations. This
+  // runs on a background thread.
+  void *CompileOptimizedFunction(TieredCodeBuffer *code, cell address);
+
+  // Size of the code made by the last compilation.
+  std::size_t code_size() const { return asm_.getCodeSize(); }
+
+ private:
+  void FoldPureCalls();
+  void InitFunctionCompiler(LazyCodeBuffer *code);
+  bool EmitFunction(const Function *function, Instruction &instr);
+  void *CompileFunction(const Function *function);
+  void *MakeCode();
+  static uintptr_t LinkFunction(LazyCodeBuffer *code,
+                                cell address,
+                                void *function_code,
+                                const CompilerImpl &compiler,
+                                bool update_instr_table);
+  static void InstallOptimizedFunction(TieredCodeBuffer *code);
+  void InitLazyCode(LazyCodeBuffer *code, uintptr_t base);
+  static void AddNativeSites(
+    CodeBuffer *code,
+    uintptr_t base,
+    const std::vector<std::pair<uint32_t, uint32_t> > &native_fixups);
+  bool CompileInParallel(LazyCodeBuffer *code);
+  static bool LinkFunctions(LazyCodeBuffer *code,
+                            const std::vector<CompilerImpl*> &compilers);
+  uint64_t GetScriptHash() const;
+  uint64_t GetCacheKey(uint64_t script_hash) const;
+  uint64_t GetImageKey(uint64_t script_hash) const;
+  bool FindFixups(void *code, CodeImage &image);
+  void FinishCodeImage(void *code, CodeImage &image);
+  CodeBuffer *LoadCodeImage(const CodeImage &image);
+  CodeBuffer *FindSharedCode(uint64_t key) const;
+  CodeBuffer *ShareCode(CodeBuffer *code,
+                        const void *code_blob,
+                        const CodeImage &image) const;
+  void FindShortJumps(AMXRef amx);
+  void SetJumpForm(const Instruction &instr);
+  bool EmitInstruction(const Instruction &instr);
+  bool EmitFoldedCall(const Instruction &instr);
+  bool EmitSpecialization(const Specialization *specialization);
+  bool EmitFoldedInstruction(const Instruction &instr);
+  void EmitLoadConstant(const asmjit::X86GpReg &reg, cell value);
+  bool GetReadOnlyValue(cell address, cell &value) const;
+  bool IsDeadCode(cell address) const;
+  void LogInstruction(const Instruction &instr);
 
  private:
   bool EmitIntrinsic(const char *name);
@@ -83,6 +236,8 @@ class CompilerImpl {
  private:
   void EmitRuntimeInfo();
   void EmitInstrTable();
+  void EmitPublicTable();
+  void EmitDataEnd();
   void EmitExec();
   void EmitExecHelper();
   void EmitExecContHelper();
@@ -90,13 +245,39 @@ class CompilerImpl {
   void EmitJumpLookup();
   void EmitReverseJumpLookup();
   void EmitJumpHelper();
+  void EmitIndirectJump();
   void EmitSysreqCHelper();
   void EmitSysreqDHelper();
+  void EmitSysreqBindHelper();
+  void EmitNativeCaches();
+  asmjit::X86Mem GetNativeCacheEntry(cell address, std::size_t offset) const;
+  void EmitCachedNativeCall(cell address);
+  void EmitNativeCacheHelper();
+  void EmitNativeCall(cell address, cell index);
+  asmjit::X86Mem GetRuntimeInfoField(const asmjit::Label &label,
+                                     std::size_t offset) const;
+  void EmitStoreHeap(const asmjit::X86GpReg &amx,
+                     const asmjit::X86GpReg &temp);
+  void EmitLoadHeap(const asmjit::X86GpReg &amx,
+                    const asmjit::X86GpReg &temp);
   void EmitDebugPrint(const char *message);
   void EmitDebugBreakpoint();
+  void EmitErrorPaths();
+  void EmitLazyCompileHelper();
+  void EmitLazyStubs();
+  void EmitLazyThunks();
+  void EmitLazyCall(cell address);
+  void EmitTierUpHelper();
+  void FindLoopHeaders();
+  void EmitTierUpCounter(cell function, cell target);
+  void EmitTierUpCounters();
 
  private:
   const asmjit::Label &GetLabel(cell address);
+  const asmjit::Label &GetJumpLabel(cell address);
+  const asmjit::Label &GetErrorLabel(cell error, cell address);
+  const asmjit::Label &GetSpecializationLabel(
+    const Specialization *specialization);
 
  private:
   AMXRef amx_;
@@ -113,6 +294,8 @@ class CompilerImpl {
   asmjit::Label reset_esp_label_;
   asmjit::Label reset_stk_label_;
   asmjit::Label reset_hea_label_;
+  asmjit::Label hea_label_;
+  asmjit::Label public_table_label_;
   asmjit::Label exec_label_;
   asmjit::Label exec_helper_label_;
   asmjit::Label exec_exit_label_;
@@ -123,16 +306,175 @@ class CompilerImpl {
   asmjit::Label reverse_jump_lookup_label_;
   asmjit::Label sysreq_c_helper_label_;
   asmjit::Label sysreq_d_helper_label_;
+  asmjit::Label sysreq_bind_helper_label_;
+  asmjit::Label lazy_compile_helper_label_;
+  asmjit::Label tier_up_helper_label_;
+  asmjit::Label tier_up_counters_label_;
+  asmjit::Label native_caches_label_;
+  asmjit::Label native_cache_helper_label_;
 
   std::map<cell, asmjit::Label> label_map_;
+
+  // Error paths by error code and address of the instruction that raises
+  // the error.
+  std::map<std::pair<cell, cell>, asmjit::Label> error_labels_;
+
   std::map<cell, std::ptrdiff_t> instr_map_;
 
+  const Program *program_;
+  const WriteAnalysis *write_analysis_;
+  const Specializer *specializer_;
+  const Specialization *specialization_;
+  std::map<const Specialization*, asmjit::Label> specialization_labels_;
+  std::map<cell, asmjit::Label> specialization_label_map_;
+  RegisterState registers_;
+
+  // Maps addresses of calls evaluated at compile time to the size of their
+  // arguments and the return value.
+  std::map<cell, std::pair<cell, cell> > folded_calls_;
+
+  // Addresses of jumps that can be emitted in the short form. When
+  // measuring, the code offset of each jump and its target are recorded
+  // instead.
+  std::set<cell> short_jumps_;
+  std::map<cell, std::pair<std::ptrdiff_t, cell> > jump_offsets_;
+  bool measure_jumps_;
+
+  // When compiling a single function of a lazily compiled script: the
+  // script's code and the offsets of calls to other functions.
+  LazyCodeBuffer *lazy_code_;
+  const Function *function_;
+  std::vector<std::pair<std::ptrdiff_t, cell> > lazy_calls_;
+  bool link_functions_;
+
+  // Start of the function being compiled in tiered mode and the indexes
+  // of function counters.
+  cell tier_up_function_;
+  std::map<cell, int> tier_up_counters_;
+  std::set<cell> loop_headers_;
+
+  // SYSREQ.PRI instructions and the indexes of their native caches.
+  std::map<cell, int> native_caches_;
+
+  // Offsets of native function addresses embedded in the code and their
+  // indexes, needed to relocate cached code.
+  std::vector<std::pair<uint32_t, uint32_t> > native_fixups_;
+
   asmjit::Logger *asmjit_logger_;
   Logger *logger_;
   CompileErrorHandler *error_handler_;
   bool enable_sysreq_d_;
   bool enable_sleep_;
+  bool enable_read_only_data_;
+  bool enable_dead_code_elimination_;
+  bool enable_function_reordering_;
+  bool enable_branch_relaxation_;
+  bool enable_lazy_compilation_;
+  unsigned int thread_count_;
+  std::string cache_directory_;
+  std::string cache_tag_;
+  std::string image_directory_;
+  std::string image_output_directory_;
+  bool image_stored_;
+  bool share_code_;
+  uint64_t share_key_;
+  bool enable_tiered_compilation_;
+  bool enable_resume_;
+  bool enable_inline_natives_;
+  const unsigned char *data_snapshot_;
+  unsigned int tier_up_threshold_;
+  Logger *tier_up_logger_;
+  unsigned int debug_flags_;
+  unsigned int specialization_budget_;
+  unsigned int eval_step_limit_;
+};
+
+// LazyCodeBuffer holds the code of a script compiled in lazy mode: the
+// runtime helpers and a stub for each function that compiles the function
+// when it's called for the first time.
+class LazyCodeBuffer: public CodeBuffer {
+ public:
+  LazyCodeBuffer(void *code, std::size_t size, AMXRef amx);
+  virtual ~LazyCodeBuffer();
+
+ private:
+  friend class CompilerImpl;
+
+  AMXRef amx_;
+  void *runtime_info_;
+  const Program *program_;
+  const WriteAnalysis *write_analysis_;
+  std::map<cell, std::pair<cell, cell> > folded_calls_;
+  bool enable_sysreq_d_;
+  bool enable_sleep_;
+  bool enable_inline_natives_;
   unsigned int debug_flags_;
+
+  // Addresses of the runtime helpers used by compiled functions.
+  uintptr_t halt_helper_;
+  uintptr_t jump_helper_;
+  uintptr_t jump_lookup_;
+  uintptr_t sysreq_c_helper_;
+  uintptr_t sysreq_d_helper_;
+  uintptr_t sysreq_bind_helper_;
+  uintptr_t native_cache_helper_;
+
+  // SYSREQ.PRI instruction => index of its native cache.
+  std::map<cell, int> native_caches_;
+
+  // Function address => stub / compiled code.
+  std::map<cell, uintptr_t> stubs_;
+  std::map<cell, uintptr_t> functions_;
+
+  // Function address => calls to its stub that need to be patched once the
+  // function is compiled (pointers to the end of the CALL instruction).
+  std::map<cell, std::vector<unsigned char*> > pending_calls_;
+  std::vector<std::pair<void*, std::size_t> > functions_code_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(LazyCodeBuffer);
+};
+
+// TieredCodeBuffer holds baseline code of a script compiled in tiered
+// mode. Each function has a counter that is decremented on every call and
+// backward jump. When it reaches zero the function is recompiled with all
+// optimizations on a background thread, and its baseline entry point is
+// replaced with a jump to the new code.
+class TieredCodeBuffer: public LazyCodeBuffer {
+ public:
+  TieredCodeBuffer(void *code, std::size_t size, AMXRef amx);
+  virtual ~TieredCodeBuffer();
+
+ private:
+  friend class CompilerImpl;
+
+  uint32_t *counters_;
+  std::map<cell, int> counter_index_;
+
+  // Loop headers and their addresses in optimized code, where execution
+  // can move from the baseline code (on-stack replacement).
+  std::set<cell> loop_headers_;
+  std::map<cell, uintptr_t> osr_entries_;
+  unsigned int threshold_;
+  Logger *logger_;
+
+  // Optimizations used by the optimizing tier. Program analysis is done
+  // when the first function is recompiled.
+  bool enable_read_only_data_;
+  unsigned int eval_step_limit_;
+  bool analyzed_;
+
+  // Functions waiting to be compiled and the one being compiled now.
+  std::deque<cell> queue_;
+  std::set<cell> queued_;
+  std::set<cell> failed_;
+  TierUpJob *job_;
+
+  // Total time spent compiling installed functions, in milliseconds.
+  long total_time_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(TieredCodeBuffer);
 };
 
 }  // namespace amxjit
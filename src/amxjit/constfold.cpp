@@ -0,0 +1,442 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "constfold.h"
+
+namespace amxjit {
+namespace {
+
+KnownValue Known(ucell value) {
+  return KnownValue(static_cast<cell>(value));
+}
+
+KnownValue Compare(bool result) {
+  return KnownValue(result ? 1 : 0);
+}
+
+} // anonymous namespace
+
+void RegisterState::Reset() {
+  pri_ = KnownValue();
+  alt_ = KnownValue();
+}
+
+int RegisterState::Apply(const Instruction &instr) {
+  ucell pri = static_cast<ucell>(pri_.value());
+  ucell alt = static_cast<ucell>(alt_.value());
+  bool both_known = pri_.is_known() && alt_.is_known();
+
+  switch (instr.opcode().GetId()) {
+    case OP_CONST_PRI:
+      pri_ = KnownValue(instr.operand());
+      return REG_PRI;
+    case OP_CONST_ALT:
+      alt_ = KnownValue(instr.operand());
+      return REG_ALT;
+    case OP_ZERO_PRI:
+      pri_ = KnownValue(0);
+      return REG_PRI;
+    case OP_ZERO_ALT:
+      alt_ = KnownValue(0);
+      return REG_ALT;
+    case OP_MOVE_PRI:
+      pri_ = alt_;
+      return REG_PRI;
+    case OP_MOVE_ALT:
+      alt_ = pri_;
+      return REG_ALT;
+    case OP_XCHG: {
+      KnownValue tmp = pri_;
+      pri_ = alt_;
+      alt_ = tmp;
+      return REG_PRI | REG_ALT;
+    }
+    case OP_LCTRL:
+      switch (instr.operand()) {
+        case 6:
+          pri_ = KnownValue(instr.address() + instr.size());
+          break;
+        case 7:
+          pri_ = KnownValue(1);
+          break;
+        default:
+          Reset();
+          return REG_PRI | REG_ALT;
+      }
+      return REG_PRI;
+    case OP_ALIGN_PRI:
+      if (pri_.is_known()
+          && static_cast<ucell>(instr.operand()) < sizeof(cell)) {
+        pri_ = Known(pri ^ (sizeof(cell) - instr.operand()));
+      }
+      return REG_PRI;
+    case OP_ALIGN_ALT:
+      if (alt_.is_known()
+          && static_cast<ucell>(instr.operand()) < sizeof(cell)) {
+        alt_ = Known(alt ^ (sizeof(cell) - instr.operand()));
+      }
+      return REG_ALT;
+    case OP_IDXADDR:
+      pri_ = both_known ? Known(alt + pri * sizeof(cell)) : KnownValue();
+      return REG_PRI;
+    case OP_IDXADDR_B:
+      pri_ = both_known ? Known(alt + (pri << (instr.operand() & 31)))
+                        : KnownValue();
+      return REG_PRI;
+    case OP_SHL:
+      pri_ = both_known ? Known(pri << (alt & 31)) : KnownValue();
+      return REG_PRI;
+    case OP_SHR:
+      pri_ = both_known ? Known(pri >> (alt & 31)) : KnownValue();
+      return REG_PRI;
+    case OP_SSHR:
+      pri_ = both_known
+        ? KnownValue(static_cast<cell>(pri) >> (alt & 31))
+        : KnownValue();
+      return REG_PRI;
+    case OP_SHL_C_PRI:
+      if (pri_.is_known()) {
+        pri_ = Known(pri << (instr.operand() & 31));
+      }
+      return REG_PRI;
+    case OP_SHL_C_ALT:
+      if (alt_.is_known()) {
+        alt_ = Known(alt << (instr.operand() & 31));
+      }
+      return REG_ALT;
+    case OP_SHR_C_PRI:
+      if (pri_.is_known()) {
+        pri_ = Known(pri >> (instr.operand() & 31));
+      }
+      return REG_PRI;
+    case OP_SHR_C_ALT:
+      if (alt_.is_known()) {
+        alt_ = Known(alt >> (instr.operand() & 31));
+      }
+      return REG_ALT;
+    case OP_SMUL:
+    case OP_UMUL:
+      // The low 32 bits of the product are the same in both cases.
+      pri_ = both_known ? Known(pri * alt) : KnownValue();
+      return REG_PRI;
+    case OP_ADD:
+      pri_ = both_known ? Known(pri + alt) : KnownValue();
+      return REG_PRI;
+    case OP_SUB:
+      pri_ = both_known ? Known(pri - alt) : KnownValue();
+      return REG_PRI;
+    case OP_SUB_ALT:
+      pri_ = both_known ? Known(alt - pri) : KnownValue();
+      return REG_PRI;
+    case OP_AND:
+      pri_ = both_known ? Known(pri & alt) : KnownValue();
+      return REG_PRI;
+    case OP_OR:
+      pri_ = both_known ? Known(pri | alt) : KnownValue();
+      return REG_PRI;
+    case OP_XOR:
+      pri_ = both_known ? Known(pri ^ alt) : KnownValue();
+      return REG_PRI;
+    case OP_NOT:
+      if (pri_.is_known()) {
+        pri_ = Compare(pri == 0);
+      }
+      return REG_PRI;
+    case OP_NEG:
+      if (pri_.is_known()) {
+        pri_ = Known(0 - pri);
+      }
+      return REG_PRI;
+    case OP_INVERT:
+      if (pri_.is_known()) {
+        pri_ = Known(~pri);
+      }
+      return REG_PRI;
+    case OP_ADD_C:
+      if (pri_.is_known()) {
+        pri_ = Known(pri + static_cast<ucell>(instr.operand()));
+      }
+      return REG_PRI;
+    case OP_SMUL_C:
+      if (pri_.is_known()) {
+        pri_ = Known(pri * static_cast<ucell>(instr.operand()));
+      }
+      return REG_PRI;
+    case OP_SIGN_PRI:
+      if (pri_.is_known()) {
+        pri_ = KnownValue(static_cast<signed char>(pri & 0xFF));
+      }
+      return REG_PRI;
+    case OP_SIGN_ALT:
+      if (alt_.is_known()) {
+        alt_ = KnownValue(static_cast<signed char>(alt & 0xFF));
+      }
+      return REG_ALT;
+    case OP_EQ:
+      pri_ = both_known ? Compare(pri == alt) : KnownValue();
+      return REG_PRI;
+    case OP_NEQ:
+      pri_ = both_known ? Compare(pri != alt) : KnownValue();
+      return REG_PRI;
+    case OP_LESS:
+      pri_ = both_known ? Compare(pri < alt) : KnownValue();
+      return REG_PRI;
+    case OP_LEQ:
+      pri_ = both_known ? Compare(pri <= alt) : KnownValue();
+      return REG_PRI;
+    case OP_GRTR:
+      pri_ = both_known ? Compare(pri > alt) : KnownValue();
+      return REG_PRI;
+    case OP_GEQ:
+      pri_ = both_known ? Compare(pri >= alt) : KnownValue();
+      return REG_PRI;
+    case OP_SLESS:
+      pri_ = both_known ? Compare(pri_.value() < alt_.value()) : KnownValue();
+      return REG_PRI;
+    case OP_SLEQ:
+      pri_ = both_known ? Compare(pri_.value() <= alt_.value()) : KnownValue();
+      return REG_PRI;
+    case OP_SGRTR:
+      pri_ = both_known ? Compare(pri_.value() > alt_.value()) : KnownValue();
+      return REG_PRI;
+    case OP_SGEQ:
+      pri_ = both_known ? Compare(pri_.value() >= alt_.value()) : KnownValue();
+      return REG_PRI;
+    case OP_EQ_C_PRI:
+      if (pri_.is_known()) {
+        pri_ = Compare(pri_.value() == instr.operand());
+      }
+      return REG_PRI;
+    case OP_EQ_C_ALT:
+      pri_ = alt_.is_known() ? Compare(alt_.value() == instr.operand())
+                             : KnownValue();
+      return REG_PRI;
+    case OP_INC_PRI:
+      if (pri_.is_known()) {
+        pri_ = Known(pri + 1);
+      }
+      return REG_PRI;
+    case OP_INC_ALT:
+      if (alt_.is_known()) {
+        alt_ = Known(alt + 1);
+      }
+      return REG_ALT;
+    case OP_DEC_PRI:
+      if (pri_.is_known()) {
+        pri_ = Known(pri - 1);
+      }
+      return REG_PRI;
+    case OP_DEC_ALT:
+      if (alt_.is_known()) {
+        alt_ = Known(alt - 1);
+      }
+      return REG_ALT;
+    case OP_LOAD_PRI:
+    case OP_LOAD_S_PRI:
+    case OP_LREF_PRI:
+    case OP_LREF_S_PRI:
+    case OP_LOAD_I:
+    case OP_LODB_I:
+    case OP_ADDR_PRI:
+    case OP_LIDX:
+    case OP_LIDX_B:
+    case OP_POP_PRI:
+    case OP_SWAP_PRI:
+    case OP_CMPS:
+      pri_ = KnownValue();
+      return REG_PRI;
+    case OP_LOAD_ALT:
+    case OP_LOAD_S_ALT:
+    case OP_LREF_ALT:
+    case OP_LREF_S_ALT:
+    case OP_ADDR_ALT:
+    case OP_POP_ALT:
+    case OP_SWAP_ALT:
+    case OP_STACK:
+    case OP_HEAP:
+      alt_ = KnownValue();
+      return REG_ALT;
+    case OP_STOR_PRI:
+    case OP_STOR_ALT:
+    case OP_STOR_S_PRI:
+    case OP_STOR_S_ALT:
+    case OP_SREF_PRI:
+    case OP_SREF_ALT:
+    case OP_SREF_S_PRI:
+    case OP_SREF_S_ALT:
+    case OP_STOR_I:
+    case OP_STRB_I:
+    case OP_PUSH_PRI:
+    case OP_PUSH_ALT:
+    case OP_PUSH_C:
+    case OP_PUSH:
+    case OP_PUSH_S:
+    case OP_PUSH_ADR:
+    case OP_PROC:
+    case OP_ZERO:
+    case OP_ZERO_S:
+    case OP_INC:
+    case OP_INC_S:
+    case OP_INC_I:
+    case OP_DEC:
+    case OP_DEC_S:
+    case OP_DEC_I:
+    case OP_MOVS:
+    case OP_FILL:
+    case OP_BOUNDS:
+    case OP_JUMP:
+    case OP_JZER:
+    case OP_JNZ:
+    case OP_JEQ:
+    case OP_JNEQ:
+    case OP_JLESS:
+    case OP_JLEQ:
+    case OP_JGRTR:
+    case OP_JGEQ:
+    case OP_JSLESS:
+    case OP_JSLEQ:
+    case OP_JSGRTR:
+    case OP_JSGEQ:
+    case OP_SWITCH:
+    case OP_CASETBL:
+    case OP_NOP:
+    case OP_BREAK:
+      return REG_NONE;
+    default:
+      Reset();
+      return REG_PRI | REG_ALT;
+  }
+}
+
+bool RegisterState::EvaluateJump(const Instruction &instr, bool &taken) const {
+  switch (instr.opcode().GetId()) {
+    case OP_JZER:
+    case OP_JNZ:
+      if (!pri_.is_known()) {
+        return false;
+      }
+      taken = (pri_.value() == 0) == (instr.opcode().GetId() == OP_JZER);
+      return true;
+    case OP_JEQ:
+    case OP_JNEQ:
+    case OP_JLESS:
+    case OP_JLEQ:
+    case OP_JGRTR:
+    case OP_JGEQ:
+    case OP_JSLESS:
+    case OP_JSLEQ:
+    case OP_JSGRTR:
+    case OP_JSGEQ:
+      break;
+    default:
+      return false;
+  }
+
+  if (!pri_.is_known() || !alt_.is_known()) {
+    return false;
+  }
+
+  cell pri = pri_.value();
+  cell alt = alt_.value();
+  ucell upri = static_cast<ucell>(pri);
+  ucell ualt = static_cast<ucell>(alt);
+
+  switch (instr.opcode().GetId()) {
+    case OP_JEQ:
+      taken = pri == alt;
+      break;
+    case OP_JNEQ:
+      taken = pri != alt;
+      break;
+    case OP_JLESS:
+      taken = upri < ualt;
+      break;
+    case OP_JLEQ:
+      taken = upri <= ualt;
+      break;
+    case OP_JGRTR:
+      taken = upri > ualt;
+      break;
+    case OP_JGEQ:
+      taken = upri >= ualt;
+      break;
+    case OP_JSLESS:
+      taken = pri < alt;
+      break;
+    case OP_JSLEQ:
+      taken = pri <= alt;
+      break;
+    case OP_JSGRTR:
+      taken = pri > alt;
+      break;
+    case OP_JSGEQ:
+      taken = pri >= alt;
+      break;
+  }
+  return true;
+}
+
+bool IsRegisterOnly(const Instruction &instr) {
+  switch (instr.opcode().GetId()) {
+    case OP_LOAD_PRI:   case OP_LOAD_ALT:   case OP_LOAD_S_PRI:
+    case OP_LOAD_S_ALT: case OP_LREF_PRI:   case OP_LREF_ALT:
+    case OP_LREF_S_PRI: case OP_LREF_S_ALT: case OP_LOAD_I:
+    case OP_LODB_I:     case OP_CONST_PRI:  case OP_CONST_ALT:
+    case OP_ADDR_PRI:   case OP_ADDR_ALT:   case OP_LIDX:
+    case OP_LIDX_B:     case OP_IDXADDR:    case OP_IDXADDR_B:
+    case OP_ALIGN_PRI:  case OP_ALIGN_ALT:  case OP_MOVE_PRI:
+    case OP_MOVE_ALT:   case OP_XCHG:       case OP_SHL:
+    case OP_SHR:        case OP_SSHR:       case OP_SHL_C_PRI:
+    case OP_SHL_C_ALT:  case OP_SHR_C_PRI:  case OP_SHR_C_ALT:
+    case OP_SMUL:       case OP_UMUL:       case OP_ADD:
+    case OP_SUB:        case OP_SUB_ALT:    case OP_AND:
+    case OP_OR:         case OP_XOR:        case OP_NOT:
+    case OP_NEG:        case OP_INVERT:     case OP_ADD_C:
+    case OP_SMUL_C:     case OP_ZERO_PRI:   case OP_ZERO_ALT:
+    case OP_SIGN_PRI:   case OP_SIGN_ALT:   case OP_EQ:
+    case OP_NEQ:        case OP_LESS:       case OP_LEQ:
+    case OP_GRTR:       case OP_GEQ:        case OP_SLESS:
+    case OP_SLEQ:       case OP_SGRTR:      case OP_SGEQ:
+    case OP_EQ_C_PRI:   case OP_EQ_C_ALT:   case OP_INC_PRI:
+    case OP_INC_ALT:    case OP_DEC_PRI:    case OP_DEC_ALT:
+    case OP_NOP:
+      return true;
+  }
+  return false;
+}
+
+bool IsPush(const Instruction &instr) {
+  switch (instr.opcode().GetId()) {
+    case OP_PUSH_PRI:
+    case OP_PUSH_ALT:
+    case OP_PUSH_C:
+    case OP_PUSH:
+    case OP_PUSH_S:
+    case OP_PUSH_ADR:
+      return true;
+  }
+  return false;
+}
+
+} // namespace amxjit
@@ -0,0 +1,85 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef AMXJIT_CONSTFOLD_H
+#define AMXJIT_CONSTFOLD_H
+
+#include "amxref.h"
+#include "disasm.h"
+#include "opcode.h"
+
+namespace amxjit {
+
+class KnownValue {
+ public:
+  KnownValue(): known_(false), value_(0) {}
+  explicit KnownValue(cell value): known_(true), value_(value) {}
+
+  bool is_known() const { return known_; }
+  cell value() const { return value_; }
+
+ private:
+  bool known_;
+  cell value_;
+};
+
+// RegisterState keeps track of PRI and ALT values that can be computed at
+// compile time, e.g. after "const.pri" or arithmetic on known values.
+class RegisterState {
+ public:
+  RegisterState() {}
+
+  const KnownValue &pri() const { return pri_; }
+  const KnownValue &alt() const { return alt_; }
+
+  void set_pri(const KnownValue &value) { pri_ = value; }
+  void set_alt(const KnownValue &value) { alt_ = value; }
+
+  void Reset();
+
+  // Updates the state according to the effect of the instruction and
+  // returns a mask of registers (REG_PRI, REG_ALT) that it modifies.
+  // Instructions not recognized here invalidate both registers.
+  int Apply(const Instruction &instr);
+
+  // Determines whether a conditional jump will be taken. Returns false if
+  // this can't be decided from the known register values.
+  bool EvaluateJump(const Instruction &instr, bool &taken) const;
+
+ private:
+  KnownValue pri_;
+  KnownValue alt_;
+};
+
+// Returns true if the instruction has no effect other than modifying PRI
+// and/or ALT (i.e. it does not write memory, change STK, HEA or FRM,
+// transfer control or abort execution).
+bool IsRegisterOnly(const Instruction &instr);
+
+// Returns true if the instruction pushes a single cell onto the stack.
+bool IsPush(const Instruction &instr);
+
+} // namespace amxjit
+
+#endif // !AMXJIT_CONSTFOLD_H
@@ -205,6 +205,20 @@ cell Instruction::operand(std::size_t index) const {
   return operands_[index];
 }
 
+bool Instruction::IsCodeAddressOperand(std::size_t index) const {
+  switch (opcode_.GetId()) {
+    case OP_JREL:
+      return false;
+    case OP_SWITCH:
+      return true;
+    case OP_CASETBL:
+      // Records are (value, address) pairs, the first one holds the number
+      // of cases and the default address.
+      return index % 2 == 1;
+  }
+  return opcode_.IsJump() || opcode_.IsCall();
+}
+
 const char *Instruction::name() const {
   if (opcode_.GetId() >= 0 && opcode_.GetId() < NUM_OPCODES) {
     return info[opcode_.GetId()].name;
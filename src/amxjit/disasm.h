@@ -65,6 +65,10 @@ class Instruction {
 
   cell operand(std::size_t index = 0) const;
 
+  // Returns true if the operand is a code address. The AMX turns these
+  // into absolute addresses when the script is loaded.
+  bool IsCodeAddressOperand(std::size_t index) const;
+
   const std::vector<cell> &operands() const {
     return operands_;
   }
@@ -0,0 +1,444 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include "constfold.h"
+#include "evaluator.h"
+#include "program.h"
+#include "writeanalysis.h"
+
+namespace amxjit {
+namespace {
+
+const cell kMaxStackSize = 16384;
+
+cell Add(cell a, cell b) {
+  return static_cast<cell>(static_cast<ucell>(a) + static_cast<ucell>(b));
+}
+
+cell Index(cell base, cell index, cell shift) {
+  return static_cast<cell>(static_cast<ucell>(base)
+                           + (static_cast<ucell>(index) << shift));
+}
+
+// Signed division the way compiled code does it: the quotient is rounded
+// towards zero, the remainder is adjusted to have the sign of the divisor.
+bool SignedDivide(cell dividend, cell divisor, cell &quotient,
+                  cell &remainder) {
+  if (divisor == 0
+      || (dividend == std::numeric_limits<cell>::min() && divisor == -1)) {
+    return false;
+  }
+  quotient = dividend / divisor;
+  remainder = Add(dividend % divisor, divisor) % divisor;
+  return true;
+}
+
+bool UnsignedDivide(cell dividend, cell divisor, cell &quotient,
+                    cell &remainder) {
+  if (divisor == 0) {
+    return false;
+  }
+  quotient = static_cast<cell>(static_cast<ucell>(dividend)
+                               / static_cast<ucell>(divisor));
+  remainder = static_cast<cell>(static_cast<ucell>(dividend)
+                                % static_cast<ucell>(divisor));
+  return true;
+}
+
+} // anonymous namespace
+
+Evaluator::Evaluator(const Program &program):
+  program_(program),
+  amx_(program.amx()),
+  write_analysis_(),
+  step_limit_(0),
+  steps_(0),
+  depth_(0),
+  stack_base_(0),
+  stack_top_(0),
+  pri_(0),
+  alt_(0),
+  stk_(0),
+  frm_(0)
+{
+  // Place the stack at the same addresses as the real one so that it can't
+  // overlap with the data section.
+  stack_top_ = amx_.header()->stp - amx_.header()->dat;
+  cell stack_size = std::min(kMaxStackSize,
+                             stack_top_ - static_cast<cell>(amx_.data_size()));
+  stack_size = std::max(stack_size, 0);
+  stack_size -= stack_size % static_cast<cell>(sizeof(cell));
+  stack_base_ = stack_top_ - stack_size;
+  stack_.resize(stack_size / sizeof(cell));
+}
+
+bool Evaluator::Call(const Function *function,
+                     const std::vector<cell> &args,
+                     cell &result) {
+  std::fill(stack_.begin(), stack_.end(), 0);
+  steps_ = 0;
+  depth_ = 0;
+  pri_ = 0;
+  alt_ = 0;
+  stk_ = stack_top_;
+  frm_ = 0;
+
+  for (std::vector<cell>::const_reverse_iterator it = args.rbegin();
+       it != args.rend(); it++) {
+    if (!Push(*it)) {
+      return false;
+    }
+  }
+  if (!Push(static_cast<cell>(args.size() * sizeof(cell))) || !Push(0)) {
+    return false;
+  }
+  if (!Execute(function->address())) {
+    return false;
+  }
+
+  result = pri_;
+  return true;
+}
+
+bool Evaluator::Execute(cell address) {
+  Instruction instr;
+  while (depth_ >= 0) {
+    if (++steps_ > step_limit_
+        || !DecodeInstruction(amx_, address, instr)
+        || !Step(instr, address)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Evaluator::Step(const Instruction &instr, cell &next_address) {
+  cell address;
+  cell value;
+
+  next_address = instr.address() + static_cast<cell>(instr.size());
+
+  switch (instr.opcode().GetId()) {
+    case OP_LOAD_PRI:
+      return Read(instr.operand(), pri_);
+    case OP_LOAD_ALT:
+      return Read(instr.operand(), alt_);
+    case OP_LOAD_S_PRI:
+      return Read(Add(frm_, instr.operand()), pri_);
+    case OP_LOAD_S_ALT:
+      return Read(Add(frm_, instr.operand()), alt_);
+    case OP_LREF_PRI:
+      return Read(instr.operand(), address) && Read(address, pri_);
+    case OP_LREF_ALT:
+      return Read(instr.operand(), address) && Read(address, alt_);
+    case OP_LREF_S_PRI:
+      return Read(Add(frm_, instr.operand()), address)
+          && Read(address, pri_);
+    case OP_LREF_S_ALT:
+      return Read(Add(frm_, instr.operand()), address)
+          && Read(address, alt_);
+    case OP_LOAD_I:
+      return Read(pri_, pri_);
+    case OP_LODB_I:
+      return Read(pri_, pri_, instr.operand());
+    case OP_STOR_PRI:
+      return Write(instr.operand(), pri_);
+    case OP_STOR_ALT:
+      return Write(instr.operand(), alt_);
+    case OP_STOR_S_PRI:
+      return Write(Add(frm_, instr.operand()), pri_);
+    case OP_STOR_S_ALT:
+      return Write(Add(frm_, instr.operand()), alt_);
+    case OP_SREF_PRI:
+      return Read(instr.operand(), address) && Write(address, pri_);
+    case OP_SREF_ALT:
+      return Read(instr.operand(), address) && Write(address, alt_);
+    case OP_SREF_S_PRI:
+      return Read(Add(frm_, instr.operand()), address)
+          && Write(address, pri_);
+    case OP_SREF_S_ALT:
+      return Read(Add(frm_, instr.operand()), address)
+          && Write(address, alt_);
+    case OP_STOR_I:
+      return Write(alt_, pri_);
+    case OP_STRB_I:
+      return Write(alt_, pri_, instr.operand());
+    case OP_LIDX:
+      return Read(Index(alt_, pri_, 2), pri_);
+    case OP_LIDX_B:
+      return Read(Index(alt_, pri_, instr.operand()), pri_);
+    case OP_ADDR_PRI:
+      pri_ = Add(frm_, instr.operand());
+      return true;
+    case OP_ADDR_ALT:
+      alt_ = Add(frm_, instr.operand());
+      return true;
+    case OP_PUSH_PRI:
+      return Push(pri_);
+    case OP_PUSH_ALT:
+      return Push(alt_);
+    case OP_PUSH_C:
+      return Push(instr.operand());
+    case OP_PUSH:
+      return Read(instr.operand(), value) && Push(value);
+    case OP_PUSH_S:
+      return Read(Add(frm_, instr.operand()), value) && Push(value);
+    case OP_PUSH_ADR:
+      return Push(Add(frm_, instr.operand()));
+    case OP_POP_PRI:
+      return Pop(pri_);
+    case OP_POP_ALT:
+      return Pop(alt_);
+    case OP_STACK:
+      alt_ = stk_;
+      stk_ = Add(stk_, instr.operand());
+      return stk_ >= stack_base_ && stk_ <= stack_top_;
+    case OP_PROC:
+      if (!Push(frm_)) {
+        return false;
+      }
+      frm_ = stk_;
+      return true;
+    case OP_RET:
+      depth_--;
+      return Pop(frm_) && Pop(next_address);
+    case OP_RETN:
+      depth_--;
+      if (!Pop(frm_) || !Pop(next_address) || !Pop(value)) {
+        return false;
+      }
+      stk_ = Add(stk_, value);
+      return stk_ >= stack_base_ && stk_ <= stack_top_;
+    case OP_CALL:
+      depth_++;
+      if (!Push(next_address)) {
+        return false;
+      }
+      next_address = program_.GetJumpTarget(instr);
+      return true;
+    case OP_JUMP:
+      next_address = program_.GetJumpTarget(instr);
+      return true;
+    case OP_JZER:
+    case OP_JNZ:
+    case OP_JEQ:
+    case OP_JNEQ:
+    case OP_JLESS:
+    case OP_JLEQ:
+    case OP_JGRTR:
+    case OP_JGEQ:
+    case OP_JSLESS:
+    case OP_JSLEQ:
+    case OP_JSGRTR:
+    case OP_JSGEQ: {
+      RegisterState registers;
+      registers.set_pri(KnownValue(pri_));
+      registers.set_alt(KnownValue(alt_));
+      bool taken;
+      if (!registers.EvaluateJump(instr, taken)) {
+        return false;
+      }
+      if (taken) {
+        next_address = program_.GetJumpTarget(instr);
+      }
+      return true;
+    }
+    case OP_SWITCH: {
+      CaseTable case_table(amx_, instr.operand());
+      next_address = case_table.GetDefaultAddress();
+      for (int i = 0; i < case_table.num_cases(); i++) {
+        if (case_table.GetCaseValue(i) == pri_) {
+          next_address = case_table.GetCaseAddress(i);
+          break;
+        }
+      }
+      return true;
+    }
+    case OP_ZERO:
+      return Write(instr.operand(), 0);
+    case OP_ZERO_S:
+      return Write(Add(frm_, instr.operand()), 0);
+    case OP_INC:
+      return Read(instr.operand(), value)
+          && Write(instr.operand(), Add(value, 1));
+    case OP_INC_S:
+      address = Add(frm_, instr.operand());
+      return Read(address, value) && Write(address, Add(value, 1));
+    case OP_INC_I:
+      return Read(pri_, value) && Write(pri_, Add(value, 1));
+    case OP_DEC:
+      return Read(instr.operand(), value)
+          && Write(instr.operand(), Add(value, -1));
+    case OP_DEC_S:
+      address = Add(frm_, instr.operand());
+      return Read(address, value) && Write(address, Add(value, -1));
+    case OP_DEC_I:
+      return Read(pri_, value) && Write(pri_, Add(value, -1));
+    case OP_MOVS: {
+      cell num_bytes = instr.operand();
+      // Overlapping blocks are copied differently depending on the block
+      // size, don't bother with them.
+      if (num_bytes < 0
+          || (pri_ < Add(alt_, num_bytes) && alt_ < Add(pri_, num_bytes))) {
+        return false;
+      }
+      for (cell i = 0; i < num_bytes; i++) {
+        if (!Read(Add(pri_, i), value, 1) || !Write(Add(alt_, i), value, 1)) {
+          return false;
+        }
+      }
+      return true;
+    }
+    case OP_FILL: {
+      cell num_bytes = instr.operand();
+      for (cell i = 0; i + static_cast<cell>(sizeof(cell)) <= num_bytes;
+           i += sizeof(cell)) {
+        if (!Write(Add(alt_, i), pri_)) {
+          return false;
+        }
+      }
+      return true;
+    }
+    case OP_BOUNDS:
+      return pri_ >= 0 && pri_ <= instr.operand();
+    case OP_SWAP_PRI:
+      if (!Read(stk_, value) || !Write(stk_, pri_)) {
+        return false;
+      }
+      pri_ = value;
+      return true;
+    case OP_SWAP_ALT:
+      if (!Read(stk_, value) || !Write(stk_, alt_)) {
+        return false;
+      }
+      alt_ = value;
+      return true;
+    case OP_SDIV:
+      return SignedDivide(pri_, alt_, pri_, alt_);
+    case OP_SDIV_ALT:
+      return SignedDivide(alt_, pri_, pri_, alt_);
+    case OP_UDIV:
+      return UnsignedDivide(pri_, alt_, pri_, alt_);
+    case OP_UDIV_ALT:
+      return UnsignedDivide(alt_, pri_, pri_, alt_);
+    case OP_CASETBL:
+    case OP_NOP:
+    case OP_BREAK:
+      return true;
+    default: {
+      if (!IsRegisterOnly(instr)) {
+        return false;
+      }
+      RegisterState registers;
+      registers.set_pri(KnownValue(pri_));
+      registers.set_alt(KnownValue(alt_));
+      registers.Apply(instr);
+      if (!registers.pri().is_known() || !registers.alt().is_known()) {
+        return false;
+      }
+      pri_ = registers.pri().value();
+      alt_ = registers.alt().value();
+      return true;
+    }
+  }
+}
+
+unsigned char *Evaluator::GetStackPointer(cell address, cell size) {
+  if (address < stack_base_ || address > stack_top_ - size) {
+    return 0;
+  }
+  return reinterpret_cast<unsigned char*>(&stack_[0])
+         + (address - stack_base_);
+}
+
+const unsigned char *Evaluator::GetReadPointer(cell address, cell size) {
+  if (write_analysis_ != 0 && write_analysis_->IsReadOnly(address, size)) {
+    return program_.data() + address;
+  }
+  return GetStackPointer(address, size);
+}
+
+bool Evaluator::Read(cell address, cell &value, cell size) {
+  const unsigned char *ptr = GetReadPointer(address, size);
+  if (ptr == 0) {
+    return false;
+  }
+  switch (size) {
+    case 1:
+      value = *ptr;
+      return true;
+    case 2: {
+      unsigned short word;
+      std::memcpy(&word, ptr, sizeof(word));
+      value = word;
+      return true;
+    }
+    case 4:
+      std::memcpy(&value, ptr, sizeof(value));
+      return true;
+  }
+  return false;
+}
+
+bool Evaluator::Write(cell address, cell value, cell size) {
+  unsigned char *ptr = GetStackPointer(address, size);
+  if (ptr == 0) {
+    return false;
+  }
+  switch (size) {
+    case 1:
+      *ptr = static_cast<unsigned char>(value);
+      return true;
+    case 2: {
+      unsigned short word = static_cast<unsigned short>(value);
+      std::memcpy(ptr, &word, sizeof(word));
+      return true;
+    }
+    case 4:
+      std::memcpy(ptr, &value, sizeof(value));
+      return true;
+  }
+  return false;
+}
+
+bool Evaluator::Push(cell value) {
+  if (stk_ - static_cast<cell>(sizeof(cell)) < stack_base_) {
+    return false;
+  }
+  stk_ -= sizeof(cell);
+  return Write(stk_, value);
+}
+
+bool Evaluator::Pop(cell &value) {
+  if (!Read(stk_, value)) {
+    return false;
+  }
+  stk_ += sizeof(cell);
+  return true;
+}
+
+} // namespace amxjit
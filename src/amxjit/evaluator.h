@@ -0,0 +1,97 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef AMXJIT_EVALUATOR_H
+#define AMXJIT_EVALUATOR_H
+
+#include <cstddef>
+#include <vector>
+#include "amxref.h"
+#include "disasm.h"
+#include "macros.h"
+
+namespace amxjit {
+
+class Function;
+class Program;
+class WriteAnalysis;
+
+// Evaluator runs functions at compile time. The code is executed on a
+// private stack, and any attempt to access memory outside of it (global
+// variables, the heap, etc.) or to call a native function makes the
+// evaluation fail. The only exception is data that is known to never
+// change, such as string literals and constant lookup tables.
+class Evaluator {
+ public:
+  explicit Evaluator(const Program &program);
+
+  // Maximum number of instructions that may be executed in a single call.
+  void set_step_limit(unsigned int limit) { step_limit_ = limit; }
+
+  // Allows reading parts of the data section that are never written.
+  void set_write_analysis(const WriteAnalysis *analysis) {
+    write_analysis_ = analysis;
+  }
+
+  // Calls the function with the specified arguments (in parameter order)
+  // and stores its return value in result. Returns false if the function
+  // could not be evaluated.
+  bool Call(const Function *function,
+            const std::vector<cell> &args,
+            cell &result);
+
+ private:
+  bool Execute(cell address);
+  bool Step(const Instruction &instr, cell &next_address);
+
+  unsigned char *GetStackPointer(cell address, cell size);
+  const unsigned char *GetReadPointer(cell address, cell size);
+
+  bool Read(cell address, cell &value, cell size = sizeof(cell));
+  bool Write(cell address, cell value, cell size = sizeof(cell));
+  bool Push(cell value);
+  bool Pop(cell &value);
+
+ private:
+  const Program &program_;
+  AMXRef amx_;
+  const WriteAnalysis *write_analysis_;
+  unsigned int step_limit_;
+  unsigned int steps_;
+  int depth_;
+  std::vector<cell> stack_;
+  cell stack_base_;
+  cell stack_top_;
+  cell pri_;
+  cell alt_;
+  cell stk_;
+  cell frm_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(Evaluator);
+};
+
+} // namespace amxjit
+
+#endif // !AMXJIT_EVALUATOR_H
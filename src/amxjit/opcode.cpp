@@ -97,4 +97,19 @@ bool Opcode::IsJump() const {
   return false;
 }
 
+bool Opcode::IsTerminator() const {
+  switch (id) {
+    case OP_RET:
+    case OP_RETN:
+    case OP_HALT:
+    case OP_JUMP:
+    case OP_JUMP_PRI:
+    case OP_JREL:
+    case OP_SWITCH:
+    case OP_CASETBL:
+      return true;
+  }
+  return false;
+}
+
 } // namespace amxjit
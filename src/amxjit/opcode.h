@@ -96,6 +96,9 @@ class Opcode {
   bool IsCall() const;
   bool IsJump() const;
 
+  // Returns true if execution never continues at the next instruction.
+  bool IsTerminator() const;
+
  private:
   OpcodeID id;
 };
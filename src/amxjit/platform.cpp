@@ -26,9 +26,122 @@
 #ifdef _WIN32
   #define _WIN32_LEAN_AND_MEAN
   #include <windows.h>
+#else
+  #include <cstdlib>
+  #include <cstring>
+  #include <pthread.h>
+  #include <signal.h>
+  #include <ucontext.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <sys/time.h>
 #endif
 
 namespace amxjit {
+namespace {
+
+struct ThreadStart {
+  Thread::Function function;
+  void *arg;
+};
+
+#ifdef _WIN32
+  DWORD WINAPI ThreadProc(LPVOID param) {
+    ThreadStart *start = static_cast<ThreadStart*>(param);
+    start->function(start->arg);
+    return 0;
+  }
+#else
+  void *ThreadProc(void *param) {
+    ThreadStart *start = static_cast<ThreadStart*>(param);
+    start->function(start->arg);
+    return 0;
+  }
+#endif
+
+TrapHandler trap_handler;
+
+#ifdef _WIN32
+  LONG CALLBACK VectoredHandler(EXCEPTION_POINTERS *info) {
+    Trap trap;
+    switch (info->ExceptionRecord->ExceptionCode) {
+      case EXCEPTION_INT_DIVIDE_BY_ZERO:
+      case EXCEPTION_INT_OVERFLOW:
+        trap = TRAP_DIVIDE;
+        break;
+      case EXCEPTION_ACCESS_VIOLATION:
+        trap = TRAP_ACCESS;
+        break;
+      default:
+        return EXCEPTION_CONTINUE_SEARCH;
+    }
+    CONTEXT *registers = info->ContextRecord;
+    TrapContext context;
+    context.eip = registers->Eip;
+    context.esp = registers->Esp;
+    context.edi = registers->Edi;
+    context.handler_esp = reinterpret_cast<uintptr_t>(&context);
+    if (!trap_handler(trap, context)) {
+      return EXCEPTION_CONTINUE_SEARCH;
+    }
+    registers->Eip = context.eip;
+    registers->Esp = context.esp;
+    registers->Edi = context.edi;
+    return EXCEPTION_CONTINUE_EXECUTION;
+  }
+#else
+  struct sigaction old_sigfpe_action;
+  struct sigaction old_sigsegv_action;
+
+  // Faults in JIT code happen on the AMX stack, which may not have enough
+  // room for a signal frame, so each thread that runs the code gets a
+  // stack of its own. It's freed when the thread exits.
+  const std::size_t kSignalStackSize = 65536;
+  pthread_key_t signal_stack_key;
+  pthread_once_t signal_stack_once = PTHREAD_ONCE_INIT;
+
+  void FreeSignalStack(void *memory) {
+    stack_t stack;
+    std::memset(&stack, 0, sizeof(stack));
+    stack.ss_flags = SS_DISABLE;
+    sigaltstack(&stack, 0);
+    std::free(memory);
+  }
+
+  void CreateSignalStackKey() {
+    pthread_key_create(&signal_stack_key, FreeSignalStack);
+  }
+
+  void SignalHandler(int signum, siginfo_t *info, void *ucontext) {
+    greg_t *registers = static_cast<ucontext_t*>(ucontext)->uc_mcontext.gregs;
+    TrapContext context;
+    context.eip = registers[REG_EIP];
+    context.esp = registers[REG_ESP];
+    context.edi = registers[REG_EDI];
+    context.handler_esp = reinterpret_cast<uintptr_t>(&context);
+    if (trap_handler(signum == SIGFPE ? TRAP_DIVIDE : TRAP_ACCESS, context)) {
+      registers[REG_EIP] = context.eip;
+      registers[REG_ESP] = context.esp;
+      registers[REG_EDI] = context.edi;
+      return;
+    }
+
+    struct sigaction *old_action =
+      signum == SIGFPE ? &old_sigfpe_action : &old_sigsegv_action;
+    if ((old_action->sa_flags & SA_SIGINFO) != 0) {
+      old_action->sa_sigaction(signum, info, ucontext);
+    } else if (old_action->sa_handler != SIG_DFL
+               && old_action->sa_handler != SIG_IGN) {
+      old_action->sa_handler(signum);
+    } else {
+      // The faulting instruction runs again and gets the default treatment.
+      sigaction(signum, old_action, 0);
+    }
+  }
+#endif
+
+} // anonymous namespace
 
 bool IsDebuggerPresent() {
   #ifdef _WIN32
@@ -38,4 +151,224 @@ bool IsDebuggerPresent() {
   #endif
 }
 
+long GetTimeMilliseconds() {
+  #ifdef _WIN32
+    return ::GetTickCount();
+  #else
+    timeval t;
+    gettimeofday(&t, 0);
+    return t.tv_sec * 1000 + t.tv_usec / 1000;
+  #endif
+}
+
+unsigned long GetProcessId() {
+  #ifdef _WIN32
+    return ::GetCurrentProcessId();
+  #else
+    return static_cast<unsigned long>(getpid());
+  #endif
+}
+
+bool MakeDirectory(const char *path) {
+  #ifdef _WIN32
+    return ::CreateDirectoryA(path, 0) != 0;
+  #else
+    return mkdir(path, 0755) == 0;
+  #endif
+}
+
+std::size_t GetPageSize() {
+  #ifdef _WIN32
+    SYSTEM_INFO info;
+    ::GetSystemInfo(&info);
+    return info.dwPageSize;
+  #else
+    return static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  #endif
+}
+
+void *AllocatePages(std::size_t size) {
+  #ifdef _WIN32
+    return ::VirtualAlloc(0, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  #else
+    void *address = mmap(0, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return address != MAP_FAILED ? address : 0;
+  #endif
+}
+
+void FreePages(void *address, std::size_t size) {
+  #ifdef _WIN32
+    ::VirtualFree(address, 0, MEM_RELEASE);
+  #else
+    munmap(address, size);
+  #endif
+}
+
+bool ProtectPages(void *address, std::size_t size, bool executable) {
+  #ifdef _WIN32
+    DWORD old_protect;
+    return ::VirtualProtect(address,
+                            size,
+                            executable ? PAGE_EXECUTE_READ : PAGE_READWRITE,
+                            &old_protect) != 0;
+  #else
+    return mprotect(address,
+                    size,
+                    executable ? PROT_READ | PROT_EXEC
+                               : PROT_READ | PROT_WRITE) == 0;
+  #endif
+}
+
+void AdviseHugePages(void *address, std::size_t size) {
+  #if defined MADV_HUGEPAGE
+    madvise(address, size, MADV_HUGEPAGE);
+  #else
+    (void)address;
+    (void)size;
+  #endif
+}
+
+bool SetTrapHandler(TrapHandler handler) {
+  trap_handler = handler;
+  #ifdef _WIN32
+    return AddVectoredExceptionHandler(1, VectoredHandler) != 0;
+  #else
+    if (!SetTrapStack()) {
+      return false;
+    }
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_sigaction = SignalHandler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    return sigaction(SIGFPE, &action, &old_sigfpe_action) == 0
+        && sigaction(SIGSEGV, &action, &old_sigsegv_action) == 0;
+  #endif
+}
+
+bool SetTrapStack() {
+  #ifdef _WIN32
+    return true;
+  #else
+    stack_t stack;
+    if (sigaltstack(0, &stack) != 0) {
+      return false;
+    }
+    if ((stack.ss_flags & SS_DISABLE) == 0) {
+      return true;
+    }
+    pthread_once(&signal_stack_once, CreateSignalStackKey);
+    void *memory = std::malloc(kSignalStackSize);
+    if (memory == 0) {
+      return false;
+    }
+    std::memset(&stack, 0, sizeof(stack));
+    stack.ss_sp = memory;
+    stack.ss_size = kSignalStackSize;
+    if (sigaltstack(&stack, 0) != 0) {
+      std::free(memory);
+      return false;
+    }
+    pthread_setspecific(signal_stack_key, memory);
+    return true;
+  #endif
+}
+
+Thread::Thread(Function function, void *arg):
+  function_(function),
+  arg_(arg),
+  handle_(),
+  start_()
+{
+}
+
+Thread::~Thread() {
+  Join();
+}
+
+bool Thread::Start() {
+  if (handle_ != 0) {
+    return false;
+  }
+  ThreadStart *start = new ThreadStart;
+  start->function = function_;
+  start->arg = arg_;
+  #ifdef _WIN32
+    handle_ = ::CreateThread(0, 0, ThreadProc, start, 0, 0);
+  #else
+    pthread_t *thread = new pthread_t;
+    if (pthread_create(thread, 0, ThreadProc, start) == 0) {
+      handle_ = thread;
+    } else {
+      delete thread;
+    }
+  #endif
+  if (handle_ == 0) {
+    delete start;
+    return false;
+  }
+  // The start info is needed only until the function is called, but it's
+  // simpler to keep it around until the thread is joined.
+  start_ = start;
+  return true;
+}
+
+void Thread::Join() {
+  if (handle_ == 0) {
+    return;
+  }
+  #ifdef _WIN32
+    ::WaitForSingleObject(handle_, INFINITE);
+    ::CloseHandle(handle_);
+  #else
+    pthread_t *thread = static_cast<pthread_t*>(handle_);
+    pthread_join(*thread, 0);
+    delete thread;
+  #endif
+  handle_ = 0;
+  delete static_cast<ThreadStart*>(start_);
+  start_ = 0;
+}
+
+Mutex::Mutex() {
+  #ifdef _WIN32
+    CRITICAL_SECTION *cs = new CRITICAL_SECTION;
+    ::InitializeCriticalSection(cs);
+    handle_ = cs;
+  #else
+    pthread_mutex_t *mutex = new pthread_mutex_t;
+    pthread_mutex_init(mutex, 0);
+    handle_ = mutex;
+  #endif
+}
+
+Mutex::~Mutex() {
+  #ifdef _WIN32
+    CRITICAL_SECTION *cs = static_cast<CRITICAL_SECTION*>(handle_);
+    ::DeleteCriticalSection(cs);
+    delete cs;
+  #else
+    pthread_mutex_t *mutex = static_cast<pthread_mutex_t*>(handle_);
+    pthread_mutex_destroy(mutex);
+    delete mutex;
+  #endif
+}
+
+void Mutex::Lock() {
+  #ifdef _WIN32
+    ::EnterCriticalSection(static_cast<CRITICAL_SECTION*>(handle_));
+  #else
+    pthread_mutex_lock(static_cast<pthread_mutex_t*>(handle_));
+  #endif
+}
+
+void Mutex::Unlock() {
+  #ifdef _WIN32
+    ::LeaveCriticalSection(static_cast<CRITICAL_SECTION*>(handle_));
+  #else
+    pthread_mutex_unlock(static_cast<pthread_mutex_t*>(handle_));
+  #endif
+}
+
 } // namespace amxjit
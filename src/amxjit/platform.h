@@ -25,10 +25,118 @@
 #ifndef AMXJIT_PLATFORM_H
 #define AMXJIT_PLATFORM_H
 
+#include <cstddef>
+#include "cstdint.h"
+#include "macros.h"
+
 namespace amxjit {
 
 bool IsDebuggerPresent();
 
+// Returns the current time in milliseconds, for measuring intervals.
+long GetTimeMilliseconds();
+
+// Returns the ID of the current process.
+unsigned long GetProcessId();
+
+// Creates a directory. Returns false if it couldn't be created, including
+// when it already exists.
+bool MakeDirectory(const char *path);
+
+std::size_t GetPageSize();
+
+// Allocates whole pages of readable and writable memory for generated code.
+// Returns 0 on failure.
+void *AllocatePages(std::size_t size);
+void FreePages(void *address, std::size_t size);
+
+// Switches pages between read/write and read/execute access. Code is never
+// writable and executable at the same time.
+bool ProtectPages(void *address, std::size_t size, bool executable);
+
+// Asks the system to back a range of pages with huge pages, if supported.
+void AdviseHugePages(void *address, std::size_t size);
+
+enum Trap {
+  TRAP_DIVIDE, // integer division by zero or overflow
+  TRAP_ACCESS  // access to memory that isn't mapped or allowed
+};
+
+// Registers of the faulting thread that a trap handler may change, and
+// the stack pointer of the handler itself. The system writes the exception
+// frame between the two if the thread has no separate trap stack (see
+// SetTrapStack()).
+struct TrapContext {
+  uintptr_t eip;
+  uintptr_t esp;
+  uintptr_t edi;
+  uintptr_t handler_esp;
+};
+
+// A trap handler returns true if it dealt with the fault. Execution then
+// continues with the modified context, otherwise the fault is passed on to
+// the handler that was there before.
+typedef bool (*TrapHandler)(Trap trap, TrapContext &context);
+
+// Installs a process-wide trap handler. Can be called only once. The
+// calling thread also gets a trap stack (see SetTrapStack()).
+bool SetTrapHandler(TrapHandler handler);
+
+// Gives the calling thread a separate stack for handling traps if it has
+// none, so that a trap handler doesn't run on the stack of the code that
+// faulted. Must be called on every thread that runs compiled code. Windows
+// has no such stacks: exceptions are always handled on the faulting stack.
+bool SetTrapStack();
+
+// Thread runs a function on a separate thread. The destructor waits for
+// the thread to finish.
+class Thread {
+ public:
+  typedef void (*Function)(void *arg);
+
+  Thread(Function function, void *arg);
+  ~Thread();
+
+  bool Start();
+  void Join();
+
+ private:
+  Function function_;
+  void *arg_;
+  void *handle_;
+  void *start_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(Thread);
+};
+
+class Mutex {
+ public:
+  Mutex();
+  ~Mutex();
+
+  void Lock();
+  void Unlock();
+
+ private:
+  void *handle_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(Mutex);
+};
+
+class ScopedLock {
+ public:
+  explicit ScopedLock(Mutex &mutex): mutex_(mutex) { mutex_.Lock(); }
+  ~ScopedLock() { mutex_.Unlock(); }
+
+ private:
+  Mutex &mutex_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(ScopedLock);
+};
+
 } // namespace amxjit
 
 #endif // !AMXJIT_PLATFORM_H
@@ -0,0 +1,587 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <utility>
+#include "program.h"
+
+namespace amxjit {
+namespace {
+
+bool CompareFunctionAddress(cell address, const Function *function) {
+  return address < function->address();
+}
+
+bool CompareCallees(const std::pair<int, const Function*> &c1,
+                    const std::pair<int, const Function*> &c2) {
+  if (c1.first != c2.first) {
+    return c1.first < c2.first;
+  }
+  return c1.second->address() > c2.second->address();
+}
+
+} // anonymous namespace
+
+CallSite::CallSite(cell address, cell callee):
+  address_(address),
+  callee_(callee),
+  args_address_(address),
+  args_size_(-1),
+  in_loop_(false)
+{
+}
+
+Function::Function(cell address, cell end_address):
+  address_(address),
+  end_address_(end_address),
+  flags_(0),
+  effects_(0),
+  reachable_(true)
+{
+}
+
+int Function::GetFrameAccess(cell offset) const {
+  std::map<cell, int>::const_iterator it = frame_access_.find(offset);
+  if (it != frame_access_.end()) {
+    return it->second;
+  }
+  return 0;
+}
+
+Program::Program(AMXRef amx, const unsigned char *data):
+  amx_(amx),
+  data_copy_(),
+  data_(amx.data()),
+  unknown_references_(false)
+{
+  if (data != 0) {
+    data_copy_.assign(data, data + amx.data_size());
+    data_ = data_copy_.empty() ? amx.data() : &data_copy_[0];
+  }
+}
+
+Program::~Program() {
+  for (std::vector<Function*>::iterator it = functions_.begin();
+       it != functions_.end(); it++) {
+    delete *it;
+  }
+}
+
+bool Program::Analyze() {
+  Disassembler disasm(amx_);
+  Instruction instr;
+  bool error = false;
+  std::vector<cell> function_starts;
+
+  // Split the code into functions and collect all jump targets.
+  while (disasm.Decode(instr, error)) {
+    switch (instr.opcode().GetId()) {
+      case OP_PROC:
+        function_starts.push_back(instr.address());
+        break;
+      case OP_JUMP:
+      case OP_JZER:
+      case OP_JNZ:
+      case OP_JEQ:
+      case OP_JNEQ:
+      case OP_JLESS:
+      case OP_JLEQ:
+      case OP_JGRTR:
+      case OP_JGEQ:
+      case OP_JSLESS:
+      case OP_JSLEQ:
+      case OP_JSGRTR:
+      case OP_JSGEQ:
+        jump_targets_.insert(GetJumpTarget(instr));
+        break;
+      case OP_SWITCH: {
+        CaseTable case_table(amx_, instr.operand());
+        jump_targets_.insert(case_table.GetDefaultAddress());
+        for (int i = 0; i < case_table.num_cases(); i++) {
+          jump_targets_.insert(case_table.GetCaseAddress(i));
+        }
+        break;
+      }
+    }
+    if (function_starts.empty()) {
+      // Code that precedes the first function (usually just "halt 0").
+      function_starts.push_back(instr.address());
+    }
+  }
+
+  if (error) {
+    return false;
+  }
+
+  cell code_end = static_cast<cell>(amx_.code_size());
+  for (std::size_t i = 0; i < function_starts.size(); i++) {
+    cell end_address = i + 1 < function_starts.size() ? function_starts[i + 1]
+                                                      : code_end;
+    functions_.push_back(new Function(function_starts[i], end_address));
+  }
+
+  std::vector<Instruction> instrs;
+  for (std::vector<Function*>::iterator it = functions_.begin();
+       it != functions_.end(); it++) {
+    Function *function = *it;
+    instrs.clear();
+    for (cell address = function->address();
+         address < function->end_address(); address += instr.size()) {
+      if (!DecodeInstruction(amx_, address, instr)) {
+        return false;
+      }
+      instrs.push_back(instr);
+    }
+    AnalyzeFunction(function, instrs);
+  }
+
+  AnalyzeCallGraph();
+  return true;
+}
+
+const Function *Program::FindFunction(cell address) const {
+  std::vector<Function*>::const_iterator it =
+    std::upper_bound(functions_.begin(),
+                     functions_.end(),
+                     address,
+                     CompareFunctionAddress);
+  if (it == functions_.begin()) {
+    return 0;
+  }
+  const Function *function = *--it;
+  return function->Contains(address) ? function : 0;
+}
+
+cell Program::GetJumpTarget(const Instruction &instr) const {
+  return instr.operand() - reinterpret_cast<cell>(amx_.code());
+}
+
+void Program::GetLayout(std::vector<const Function*> &layout) const {
+  std::set<const Function*> placed;
+  std::vector<const Function*> stack;
+  std::vector<cell> roots;
+
+  GetRoots(roots);
+  for (std::vector<cell>::const_reverse_iterator it = roots.rbegin();
+       it != roots.rend(); it++) {
+    const Function *function = FindFunction(*it);
+    if (function != 0) {
+      stack.push_back(function);
+    }
+  }
+
+  while (!stack.empty()) {
+    const Function *function = stack.back();
+    stack.pop_back();
+    if (!placed.insert(function).second) {
+      continue;
+    }
+    layout.push_back(function);
+
+    // Calls made in loops count more than the ones outside of loops.
+    std::map<const Function*, int> weights;
+    const std::vector<CallSite> &call_sites = function->call_sites_;
+    for (std::vector<CallSite>::const_iterator it = call_sites.begin();
+         it != call_sites.end(); it++) {
+      const Function *callee = FindFunction(it->callee());
+      if (callee != 0 && placed.find(callee) == placed.end()) {
+        weights[callee] += it->in_loop() ? 8 : 1;
+      }
+    }
+    std::vector<std::pair<int, const Function*> > callees;
+    for (std::map<const Function*, int>::const_iterator it = weights.begin();
+         it != weights.end(); it++) {
+      callees.push_back(std::make_pair(it->second, it->first));
+    }
+
+    // Put the heaviest callee on top of the stack so that it's placed right
+    // after the caller. Ties are resolved in favor of lower addresses.
+    std::sort(callees.begin(), callees.end(), CompareCallees);
+    for (std::vector<std::pair<int, const Function*> >::const_iterator it =
+           callees.begin();
+         it != callees.end(); it++) {
+      stack.push_back(it->second);
+    }
+  }
+
+  for (std::vector<Function*>::const_iterator it = functions_.begin();
+       it != functions_.end(); it++) {
+    if (placed.find(*it) == placed.end()) {
+      layout.push_back(*it);
+    }
+  }
+}
+
+bool Program::IsReachable(cell address) const {
+  if (unknown_references_) {
+    return true;
+  }
+  const Function *function = FindFunction(address);
+  return function == 0 || function->is_reachable();
+}
+
+void Program::AnalyzeFunction(Function *function,
+                              const std::vector<Instruction> &instrs) {
+  for (std::size_t i = 0; i < instrs.size(); i++) {
+    const Instruction &instr = instrs[i];
+    const char *native_name = 0;
+
+    switch (instr.opcode().GetId()) {
+      case OP_LOAD_S_PRI:
+      case OP_LOAD_S_ALT:
+      case OP_LREF_S_PRI:
+      case OP_LREF_S_ALT:
+      case OP_SREF_S_PRI:
+      case OP_SREF_S_ALT:
+      case OP_PUSH_S:
+        function->frame_access_[instr.operand()] |= FRAME_READ;
+        break;
+      case OP_STOR_S_PRI:
+      case OP_STOR_S_ALT:
+      case OP_ZERO_S:
+      case OP_INC_S:
+      case OP_DEC_S:
+        function->frame_access_[instr.operand()] |= FRAME_WRITE;
+        break;
+      case OP_ADDR_PRI:
+      case OP_ADDR_ALT:
+      case OP_PUSH_ADR:
+        function->frame_access_[instr.operand()] |= FRAME_ADDRESS;
+        break;
+      case OP_LCTRL:
+        // "lctrl 0" gives the address of the code section which can be used
+        // to compute the address of any function.
+        if (instr.operand() == 0) {
+          unknown_references_ = true;
+        }
+        function->flags_ |= FUNCTION_USES_EMIT;
+        break;
+      case OP_JREL:
+        unknown_references_ = true;
+        function->flags_ |= FUNCTION_USES_EMIT;
+        break;
+      case OP_SCTRL:
+      case OP_JUMP_PRI:
+      case OP_CALL_PRI:
+      case OP_PUSH_R:
+        function->flags_ |= FUNCTION_USES_EMIT;
+        break;
+      case OP_STOR_PRI:
+      case OP_STOR_ALT:
+      case OP_SREF_PRI:
+      case OP_SREF_ALT:
+      case OP_ZERO:
+      case OP_INC:
+      case OP_DEC:
+        function->flags_ |= FUNCTION_WRITES_GLOBALS;
+        break;
+      case OP_SYSREQ_PRI:
+        // Could be any native, including setarg().
+        function->flags_ |= FUNCTION_USES_EMIT
+                          | FUNCTION_MODIFIES_ARGS
+                          | FUNCTION_CALLS_NATIVES;
+        break;
+      case OP_SYSREQ_C:
+        function->flags_ |= FUNCTION_CALLS_NATIVES;
+        native_name = amx_.GetNativeName(instr.operand());
+        break;
+      case OP_SYSREQ_D:
+        function->flags_ |= FUNCTION_CALLS_NATIVES;
+        native_name = amx_.GetNativeName(amx_.FindNative(instr.operand()));
+        break;
+      case OP_CALL: {
+        CallSite call_site(instr.address(), GetJumpTarget(instr));
+        AnalyzeCallSite(call_site, instrs, i);
+        function->call_sites_.push_back(call_site);
+        function->references_.push_back(call_site.callee());
+        break;
+      }
+      case OP_JUMP:
+      case OP_JZER:
+      case OP_JNZ:
+      case OP_JEQ:
+      case OP_JNEQ:
+      case OP_JLESS:
+      case OP_JLEQ:
+      case OP_JGRTR:
+      case OP_JGEQ:
+      case OP_JSLESS:
+      case OP_JSLEQ:
+      case OP_JSGRTR:
+      case OP_JSGEQ: {
+        cell target = GetJumpTarget(instr);
+        if (!function->Contains(target)) {
+          function->references_.push_back(target);
+        }
+        break;
+      }
+      case OP_SWITCH: {
+        CaseTable case_table(amx_, instr.operand());
+        for (int j = -1; j < case_table.num_cases(); j++) {
+          cell target = j < 0 ? case_table.GetDefaultAddress()
+                              : case_table.GetCaseAddress(j);
+          if (!function->Contains(target)) {
+            function->references_.push_back(target);
+          }
+        }
+        break;
+      }
+      case OP_CONST_PRI:
+      case OP_CONST_ALT:
+      case OP_PUSH_C: {
+        // The address of a function may be loaded with #emit and then
+        // called indirectly.
+        const Function *target = FindFunction(instr.operand());
+        if (target != 0
+            && target->address() == instr.operand()
+            && target != function) {
+          function->references_.push_back(instr.operand());
+        }
+        break;
+      }
+    }
+
+    if (native_name != 0 && std::strcmp(native_name, "setarg") == 0) {
+      function->flags_ |= FUNCTION_MODIFIES_ARGS;
+    }
+  }
+
+  // Code that doesn't end with a RETN or a jump falls through to the next
+  // function.
+  if (!instrs.empty()
+      && !instrs.back().opcode().IsTerminator()
+      && function->end_address() < static_cast<cell>(amx_.code_size())) {
+    function->references_.push_back(function->end_address());
+  }
+
+  for (std::size_t i = 0; i < instrs.size(); i++) {
+    const Instruction &instr = instrs[i];
+    if (!instr.opcode().IsJump() || instr.opcode().GetId() == OP_JUMP_PRI
+        || instr.opcode().GetId() == OP_JREL) {
+      continue;
+    }
+    cell target = GetJumpTarget(instr);
+    if (target > instr.address() || !function->Contains(target)) {
+      continue;
+    }
+    for (std::vector<CallSite>::iterator it = function->call_sites_.begin();
+         it != function->call_sites_.end(); it++) {
+      if (it->address() >= target && it->address() < instr.address()) {
+        it->in_loop_ = true;
+      }
+    }
+  }
+}
+
+void Program::AnalyzeCallGraph() {
+  AnalyzeReachability();
+  AnalyzeEffects();
+}
+
+void Program::GetRoots(std::vector<cell> &roots) const {
+  // The roots are main(), public functions and the code that precedes the
+  // first function.
+  if (amx_.header()->cip >= 0) {
+    roots.push_back(amx_.header()->cip);
+  }
+  for (int i = 0; i < amx_.num_publics(); i++) {
+    roots.push_back(amx_.GetPublicAddress(i));
+  }
+  roots.push_back(0);
+}
+
+void Program::AnalyzeReachability() {
+  std::vector<Function*> queue;
+
+  for (std::vector<Function*>::iterator it = functions_.begin();
+       it != functions_.end(); it++) {
+    (*it)->reachable_ = false;
+  }
+
+  std::vector<cell> roots;
+  GetRoots(roots);
+
+  // Function addresses can't normally be stored in variables, but there
+  // is nothing that prevents one from doing so with #emit.
+  const cell *data = reinterpret_cast<const cell*>(data_);
+  for (std::size_t i = 0; i < amx_.data_size() / sizeof(cell); i++) {
+    const Function *function = FindFunction(data[i]);
+    if (function != 0 && function->address() == data[i]) {
+      roots.push_back(data[i]);
+    }
+  }
+
+  for (std::vector<cell>::const_iterator it = roots.begin();
+       it != roots.end(); it++) {
+    Function *function = const_cast<Function*>(FindFunction(*it));
+    if (function != 0 && !function->reachable_) {
+      function->reachable_ = true;
+      queue.push_back(function);
+    }
+  }
+
+  while (!queue.empty()) {
+    Function *function = queue.back();
+    queue.pop_back();
+    for (std::vector<cell>::const_iterator it = function->references_.begin();
+         it != function->references_.end(); it++) {
+      Function *callee = const_cast<Function*>(FindFunction(*it));
+      if (callee != 0 && !callee->reachable_) {
+        callee->reachable_ = true;
+        queue.push_back(callee);
+      }
+    }
+  }
+}
+
+void Program::AnalyzeEffects() {
+  const int effect_flags = FUNCTION_USES_EMIT
+                         | FUNCTION_CALLS_NATIVES
+                         | FUNCTION_WRITES_GLOBALS;
+
+  for (std::vector<Function*>::iterator it = functions_.begin();
+       it != functions_.end(); it++) {
+    (*it)->effects_ = (*it)->flags_ & effect_flags;
+  }
+
+  // Propagate effects from callees to callers until nothing changes. This
+  // also takes care of recursion.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (std::vector<Function*>::iterator it = functions_.begin();
+         it != functions_.end(); it++) {
+      Function *function = *it;
+      int effects = function->effects_;
+      for (std::vector<CallSite>::const_iterator call_it =
+             function->call_sites_.begin();
+           call_it != function->call_sites_.end(); call_it++) {
+        const Function *callee = FindFunction(call_it->callee());
+        if (callee != 0) {
+          effects |= callee->effects_;
+        }
+      }
+      if (effects != function->effects_) {
+        function->effects_ = effects;
+        changed = true;
+      }
+    }
+  }
+
+  // Only functions called by their exact address can be evaluated.
+  for (std::vector<Function*>::iterator it = functions_.begin();
+       it != functions_.end(); it++) {
+    Function *function = *it;
+    if ((function->effects_ & effect_flags) != 0) {
+      continue;
+    }
+    bool known_callees = true;
+    for (std::vector<CallSite>::const_iterator call_it =
+           function->call_sites_.begin();
+         call_it != function->call_sites_.end(); call_it++) {
+      const Function *callee = FindFunction(call_it->callee());
+      if (callee == 0 || callee->address() != call_it->callee()) {
+        known_callees = false;
+        break;
+      }
+    }
+    if (known_callees) {
+      function->flags_ |= FUNCTION_PURE;
+    }
+  }
+}
+
+void Program::AnalyzeCallSite(CallSite &call_site,
+                              const std::vector<Instruction> &instrs,
+                              std::size_t call_index) {
+  if (call_index == 0
+      || instrs[call_index - 1].opcode().GetId() != OP_PUSH_C
+      || IsJumpTarget(instrs[call_index].address())) {
+    return;
+  }
+
+  cell args_size = instrs[call_index - 1].operand();
+  if (args_size < 0 || args_size % static_cast<cell>(sizeof(cell)) != 0) {
+    return;
+  }
+
+  // Walk backwards until we find all the pushed arguments. Only pushes and
+  // instructions that compute values in PRI/ALT are allowed in between, and
+  // none of them may be a jump target (except the first one).
+  std::size_t num_args = args_size / sizeof(cell);
+  std::size_t num_pushes = 0;
+  std::size_t start = call_index - 1;
+  while (num_pushes < num_args) {
+    if (start == 0 || IsJumpTarget(instrs[start].address())) {
+      return;
+    }
+    start--;
+    if (IsPush(instrs[start])) {
+      num_pushes++;
+    } else if (!IsRegisterOnly(instrs[start])) {
+      return;
+    }
+  }
+
+  // Include instructions that compute the value of the first argument.
+  while (start > 0
+         && !IsJumpTarget(instrs[start].address())
+         && IsRegisterOnly(instrs[start - 1])) {
+    start--;
+  }
+
+  // Now go forward and see which of the pushed values are known.
+  RegisterState registers;
+  std::vector<KnownValue> values;
+  for (std::size_t i = start; i < call_index - 1; i++) {
+    const Instruction &instr = instrs[i];
+    if (!IsPush(instr)) {
+      registers.Apply(instr);
+      continue;
+    }
+    switch (instr.opcode().GetId()) {
+      case OP_PUSH_C:
+        values.push_back(KnownValue(instr.operand()));
+        break;
+      case OP_PUSH_PRI:
+        values.push_back(registers.pri());
+        break;
+      case OP_PUSH_ALT:
+        values.push_back(registers.alt());
+        break;
+      default:
+        values.push_back(KnownValue());
+        break;
+    }
+  }
+
+  assert(values.size() == num_args);
+  call_site.args_.assign(values.rbegin(), values.rend());
+  call_site.args_size_ = args_size;
+  call_site.args_address_ = instrs[start].address();
+}
+
+} // namespace amxjit
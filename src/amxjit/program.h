@@ -0,0 +1,226 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef AMXJIT_PROGRAM_H
+#define AMXJIT_PROGRAM_H
+
+#include <cstddef>
+#include <map>
+#include <set>
+#include <vector>
+#include "amxref.h"
+#include "constfold.h"
+#include "disasm.h"
+#include "macros.h"
+
+namespace amxjit {
+
+// CallSite describes a CALL instruction along with the sequence of pushes
+// that precedes it. Arguments are indexed in parameter order, i.e. the
+// first argument is the last value pushed before "push.c <args_size>".
+class CallSite {
+ public:
+  CallSite(cell address, cell callee);
+
+  // Address of the CALL instruction.
+  cell address() const { return address_; }
+
+  // Address of the called function.
+  cell callee() const { return callee_; }
+
+  // Address of the first instruction of the argument sequence. Everything
+  // from here up to the CALL itself only pushes arguments or computes them
+  // in PRI/ALT, and nothing jumps into the middle of it.
+  cell args_address() const { return args_address_; }
+
+  // Returns false if the argument sequence could not be recognized. In this
+  // case none of the methods below return meaningful values.
+  bool has_args_info() const { return args_size_ >= 0; }
+
+  // Number of bytes of arguments (the value of the hidden argument count).
+  cell args_size() const { return args_size_; }
+
+  int num_args() const { return static_cast<int>(args_.size()); }
+  const KnownValue &arg(int index) const { return args_[index]; }
+
+  // Returns true if the call is located between a backward jump and its
+  // target, i.e. it is likely executed more than once per function call.
+  bool in_loop() const { return in_loop_; }
+
+ private:
+  friend class Program;
+
+  cell address_;
+  cell callee_;
+  cell args_address_;
+  cell args_size_;
+  std::vector<KnownValue> args_;
+  bool in_loop_;
+};
+
+enum FrameAccess {
+  FRAME_READ = 1,
+  FRAME_WRITE = 2,
+  FRAME_ADDRESS = 4
+};
+
+enum FunctionFlags {
+  // The function contains instructions that are normally produced only by
+  // #emit: LCTRL, SCTRL, JREL, JUMP.PRI, CALL.PRI, etc.
+  FUNCTION_USES_EMIT = 1,
+  // The function calls setarg(), which can modify arguments behind its back.
+  FUNCTION_MODIFIES_ARGS = 2,
+  // The function calls native functions.
+  FUNCTION_CALLS_NATIVES = 4,
+  // The function writes to global variables directly (i.e. not through
+  // references passed to it).
+  FUNCTION_WRITES_GLOBALS = 8,
+  // Neither the function nor any function it calls uses #emit, calls
+  // natives or writes global variables. Such functions may be evaluated at
+  // compile time.
+  FUNCTION_PURE = 16
+};
+
+// Function is a range of code starting at a PROC instruction and ending
+// right before the next PROC (or at the end of the code section).
+class Function {
+ public:
+  Function(cell address, cell end_address);
+
+  cell address() const { return address_; }
+  cell end_address() const { return end_address_; }
+  cell size() const { return end_address_ - address_; }
+
+  bool Contains(cell address) const {
+    return address >= address_ && address < end_address_;
+  }
+
+  // Flags describing what the function itself does.
+  int flags() const { return flags_; }
+
+  // Same as flags() but also includes effects of all functions called from
+  // this function, directly or indirectly.
+  int effects() const { return effects_; }
+
+  // Returns false if the function can't be called from any public function
+  // or main().
+  bool is_reachable() const { return reachable_; }
+
+  // Returns a combination of FrameAccess flags for [FRM + offset].
+  int GetFrameAccess(cell offset) const;
+
+  // Offset of the Nth parameter relative to FRM.
+  static cell GetParamOffset(int index) {
+    return static_cast<cell>(3 * sizeof(cell) + index * sizeof(cell));
+  }
+
+  const std::vector<CallSite> &call_sites() const { return call_sites_; }
+
+  // Addresses of code outside of this function that it refers to: call
+  // targets, jumps into other functions and function addresses loaded
+  // into registers.
+  const std::vector<cell> &references() const { return references_; }
+
+ private:
+  friend class Program;
+
+  cell address_;
+  cell end_address_;
+  int flags_;
+  int effects_;
+  bool reachable_;
+  std::map<cell, int> frame_access_;
+  std::vector<CallSite> call_sites_;
+  std::vector<cell> references_;
+};
+
+// Program performs a quick analysis pass over the whole code section:
+// splits it into functions, finds jump targets and call sites, and builds
+// a call graph rooted at public functions and main() to find out which
+// functions are reachable and what effects they have.
+class Program {
+ public:
+  // If data is given, the analyses use a copy of it instead of the AMX's
+  // data section, e.g. a snapshot taken before the script started running.
+  explicit Program(AMXRef amx, const unsigned char *data = 0);
+  ~Program();
+
+  // Returns false if an invalid instruction was encountered.
+  bool Analyze();
+
+  AMXRef amx() const { return amx_; }
+
+  // Initial values of global variables as seen by the analyses.
+  const unsigned char *data() const { return data_; }
+
+  const std::vector<Function*> &functions() const { return functions_; }
+
+  // Finds the function that contains the specified address.
+  const Function *FindFunction(cell address) const;
+
+  // Returns true if the instruction at the specified address can be reached
+  // by a jump or a switch.
+  bool IsJumpTarget(cell address) const {
+    return jump_targets_.find(address) != jump_targets_.end();
+  }
+
+  // Returns the destination address of a jump or call instruction.
+  cell GetJumpTarget(const Instruction &instr) const;
+
+  // Orders functions so that callers are followed by the functions they
+  // call most often, starting from main() and public functions. Functions
+  // that can't be reached this way come last, in their original order.
+  void GetLayout(std::vector<const Function*> &layout) const;
+
+  // Returns false if the code at the specified address is never executed.
+  // If the program computes code addresses at run time (e.g. "lctrl 0" or
+  // "jrel"), everything is considered reachable.
+  bool IsReachable(cell address) const;
+
+ private:
+  void AnalyzeFunction(Function *function,
+                       const std::vector<Instruction> &instrs);
+  void AnalyzeCallGraph();
+  void GetRoots(std::vector<cell> &roots) const;
+  void AnalyzeReachability();
+  void AnalyzeEffects();
+  void AnalyzeCallSite(CallSite &call_site,
+                       const std::vector<Instruction> &instrs,
+                       std::size_t call_index);
+
+ private:
+  AMXRef amx_;
+  std::vector<unsigned char> data_copy_;
+  const unsigned char *data_;
+  std::vector<Function*> functions_;
+  std::set<cell> jump_targets_;
+  bool unknown_references_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(Program);
+};
+
+} // namespace amxjit
+
+#endif // !AMXJIT_PROGRAM_H
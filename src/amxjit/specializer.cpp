@@ -0,0 +1,184 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <algorithm>
+#include <map>
+#include "program.h"
+#include "specializer.h"
+
+namespace amxjit {
+namespace {
+
+struct Candidate {
+  const Function *function;
+  cell args_size;
+  Specialization::ArgList args;
+  std::vector<cell> call_sites;
+};
+
+typedef std::pair<cell, std::pair<cell, Specialization::ArgList> >
+  CandidateKey;
+
+bool CompareCandidates(const Candidate *c1, const Candidate *c2) {
+  if (c1->call_sites.size() != c2->call_sites.size()) {
+    return c1->call_sites.size() > c2->call_sites.size();
+  }
+  return c1->function->size() < c2->function->size();
+}
+
+} // anonymous namespace
+
+Specialization::Specialization(const Function *function,
+                               cell args_size,
+                               const ArgList &args):
+  function_(function),
+  args_size_(args_size),
+  args_(args)
+{
+}
+
+bool Specialization::GetFrameValue(cell offset, cell &value) const {
+  if (function_->GetFrameAccess(offset) & (FRAME_WRITE | FRAME_ADDRESS)) {
+    return false;
+  }
+  if (offset == static_cast<cell>(2 * sizeof(cell))) {
+    value = args_size_;
+    return true;
+  }
+  for (ArgList::const_iterator it = args_.begin(); it != args_.end(); it++) {
+    if (Function::GetParamOffset(it->first) == offset) {
+      value = it->second;
+      return true;
+    }
+  }
+  return false;
+}
+
+Specializer::Specializer(const Program &program):
+  program_(program),
+  budget_(0)
+{
+}
+
+Specializer::~Specializer() {
+  for (std::vector<Specialization*>::iterator it = specializations_.begin();
+       it != specializations_.end(); it++) {
+    delete *it;
+  }
+}
+
+void Specializer::Run() {
+  std::map<CandidateKey, Candidate> candidates;
+  const std::vector<Function*> &functions = program_.functions();
+
+  for (std::vector<Function*>::const_iterator func_it = functions.begin();
+       func_it != functions.end(); func_it++) {
+    // Don't waste the budget on calls that are never executed.
+    if (!program_.IsReachable((*func_it)->address())) {
+      continue;
+    }
+    const std::vector<CallSite> &call_sites = (*func_it)->call_sites();
+    for (std::vector<CallSite>::const_iterator it = call_sites.begin();
+         it != call_sites.end(); it++) {
+      const CallSite &call_site = *it;
+      if (!call_site.has_args_info()) {
+        continue;
+      }
+
+      const Function *callee = program_.FindFunction(call_site.callee());
+      if (callee == 0
+          || callee->address() != call_site.callee()
+          || (callee->flags() & (FUNCTION_USES_EMIT | FUNCTION_MODIFIES_ARGS))
+          || static_cast<std::size_t>(callee->size()) > budget_) {
+        continue;
+      }
+
+      // Only consider arguments that the callee actually reads and never
+      // modifies or takes the address of.
+      Specialization::ArgList args;
+      for (int i = 0; i < call_site.num_args(); i++) {
+        if (!call_site.arg(i).is_known()) {
+          continue;
+        }
+        int access = callee->GetFrameAccess(Function::GetParamOffset(i));
+        if ((access & FRAME_READ) != 0
+            && (access & (FRAME_WRITE | FRAME_ADDRESS)) == 0) {
+          args.push_back(std::make_pair(i, call_site.arg(i).value()));
+        }
+      }
+      if (args.empty()) {
+        continue;
+      }
+
+      CandidateKey key(callee->address(),
+                       std::make_pair(call_site.args_size(), args));
+      Candidate &candidate = candidates[key];
+      candidate.function = callee;
+      candidate.args_size = call_site.args_size();
+      candidate.args = args;
+      candidate.call_sites.push_back(call_site.address());
+    }
+  }
+
+  std::vector<const Candidate*> sorted_candidates;
+  for (std::map<CandidateKey, Candidate>::const_iterator it =
+         candidates.begin(); it != candidates.end(); it++) {
+    sorted_candidates.push_back(&it->second);
+  }
+  std::stable_sort(sorted_candidates.begin(),
+                   sorted_candidates.end(),
+                   CompareCandidates);
+
+  std::size_t used = 0;
+  for (std::vector<const Candidate*>::const_iterator it =
+         sorted_candidates.begin(); it != sorted_candidates.end(); it++) {
+    const Candidate *candidate = *it;
+    std::size_t size = candidate->function->size();
+    if (used + size > budget_) {
+      continue;
+    }
+    used += size;
+
+    Specialization *specialization = new Specialization(candidate->function,
+                                                        candidate->args_size,
+                                                        candidate->args);
+    specializations_.push_back(specialization);
+    for (std::vector<cell>::const_iterator call_it =
+           candidate->call_sites.begin();
+         call_it != candidate->call_sites.end(); call_it++) {
+      call_sites_[*call_it] = specialization;
+    }
+  }
+}
+
+const Specialization *Specializer::GetSpecialization(cell call_address) const {
+  std::map<cell, const Specialization*>::const_iterator it =
+    call_sites_.find(call_address);
+  if (it != call_sites_.end()) {
+    return it->second;
+  }
+  return 0;
+}
+
+} // namespace amxjit
@@ -0,0 +1,103 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef AMXJIT_SPECIALIZER_H
+#define AMXJIT_SPECIALIZER_H
+
+#include <cstddef>
+#include <map>
+#include <utility>
+#include <vector>
+#include "amxref.h"
+#include "macros.h"
+
+namespace amxjit {
+
+class Function;
+class Program;
+
+// Specialization is a copy of a function compiled for a particular set of
+// constant arguments. Within such a copy the arguments can be treated as
+// constants, which lets the compiler fold away branches that depend on them.
+class Specialization {
+ public:
+  typedef std::vector<std::pair<int, cell> > ArgList;
+
+  Specialization(const Function *function, cell args_size,
+                 const ArgList &args);
+
+  const Function *function() const { return function_; }
+
+  // Total size of arguments passed to the function, in bytes.
+  cell args_size() const { return args_size_; }
+
+  // Pairs of (parameter index, value) for each constant parameter.
+  const ArgList &args() const { return args_; }
+
+  // Returns true if [FRM + offset] is known to hold a constant value for
+  // the whole duration of the call.
+  bool GetFrameValue(cell offset, cell &value) const;
+
+ private:
+  const Function *function_;
+  cell args_size_;
+  ArgList args_;
+};
+
+// Specializer picks call sites that pass constant arguments to functions
+// that depend on them and decides which functions should be specialized.
+// Since there is no profile information available at compile time, call
+// sites are ranked by the number of identical specializations they share:
+// the more call sites can reuse a single copy, the better.
+class Specializer {
+ public:
+  explicit Specializer(const Program &program);
+  ~Specializer();
+
+  // Maximum total size of bytecode (in bytes) that can be duplicated.
+  void set_budget(std::size_t budget) { budget_ = budget; }
+
+  void Run();
+
+  const std::vector<Specialization*> &specializations() const {
+    return specializations_;
+  }
+
+  // Returns the specialization to be called from the CALL instruction at
+  // the specified address, or 0 if there is none.
+  const Specialization *GetSpecialization(cell call_address) const;
+
+ private:
+  const Program &program_;
+  std::size_t budget_;
+  std::vector<Specialization*> specializations_;
+  std::map<cell, const Specialization*> call_sites_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(Specializer);
+};
+
+} // namespace amxjit
+
+#endif // !AMXJIT_SPECIALIZER_H
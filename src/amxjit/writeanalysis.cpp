@@ -0,0 +1,874 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <algorithm>
+#include <cstring>
+#include "constfold.h"
+#include "cstdint.h"
+#include "disasm.h"
+#include "program.h"
+#include "writeanalysis.h"
+
+namespace amxjit {
+namespace {
+
+// Natives that don't modify any of their arguments other than the ones
+// listed in the mask (bit N corresponds to argument N). Any other native
+// is assumed to write through all of its arguments.
+struct NativeInfo {
+  const char *name;
+  unsigned int written_args;
+};
+
+const NativeInfo kNatives[] = {
+  {"clamp",                   0x0},
+  {"deleteproperty",          0x0},
+  {"existproperty",           0x0},
+  {"float",                   0x0},
+  {"floatabs",                0x0},
+  {"floatadd",                0x0},
+  {"floatcmp",                0x0},
+  {"floatcos",                0x0},
+  {"floatdiv",                0x0},
+  {"floatfract",              0x0},
+  {"floatlog",                0x0},
+  {"floatmul",                0x0},
+  {"floatpower",              0x0},
+  {"floatround",              0x0},
+  {"floatsin",                0x0},
+  {"floatsqroot",             0x0},
+  {"floatstr",                0x0},
+  {"floatsub",                0x0},
+  {"floattan",                0x0},
+  {"format",                  0x1},
+  {"funcidx",                 0x0},
+  {"GameTextForAll",          0x0},
+  {"GameTextForPlayer",       0x0},
+  {"getarg",                  0x0},
+  {"GetPlayerArmour",         0x2},
+  {"GetPlayerHealth",         0x2},
+  {"GetPlayerName",           0x2},
+  {"GetPlayerPos",            0xE},
+  {"getproperty",             0x8},
+  {"heapspace",               0x0},
+  {"IsPlayerConnected",       0x0},
+  {"ispacked",                0x0},
+  {"max",                     0x0},
+  {"memcpy",                  0x1},
+  {"min",                     0x0},
+  {"numargs",                 0x0},
+  {"print",                   0x0},
+  {"printf",                  0x0},
+  {"random",                  0x0},
+  {"SendClientMessage",       0x0},
+  {"SendClientMessageToAll",  0x0},
+  {"SendRconCommand",         0x0},
+  {"SetGameModeText",         0x0},
+  {"SetPlayerArmour",         0x0},
+  {"SetPlayerHealth",         0x0},
+  {"SetPlayerPos",            0x0},
+  {"setproperty",             0x0},
+  {"strcat",                  0x1},
+  {"strcmp",                  0x0},
+  {"strdel",                  0x1},
+  {"strfind",                 0x0},
+  {"strins",                  0x1},
+  {"strlen",                  0x0},
+  {"strmid",                  0x1},
+  {"strpack",                 0x1},
+  {"strunpack",               0x1},
+  {"strval",                  0x0},
+  {"swapchars",               0x0},
+  {"tolower",                 0x0},
+  {"toupper",                 0x0},
+  {"uudecode",                0x1},
+  {"uuencode",                0x1},
+  {"valstr",                  0x1}
+};
+
+bool IsArgWrittenByNative(const char *name, int arg) {
+  if (name != 0) {
+    for (std::size_t i = 0; i < sizeof(kNatives) / sizeof(*kNatives); i++) {
+      if (std::strcmp(kNatives[i].name, name) == 0) {
+        return arg < 32 && (kNatives[i].written_args & (1u << arg)) != 0;
+      }
+    }
+  }
+  return true;
+}
+
+const std::size_t kMaxStackSize = 1024;
+
+enum SourceKind {
+  SOURCE_GLOBAL,
+  SOURCE_PARAM,
+  SOURCE_LOCAL,
+  SOURCE_HEAP
+};
+
+// Source is an address that a value may have been derived from: a global
+// address, a parameter of the current function (which may hold an address
+// passed by the caller), or the address of a local variable or heap block.
+struct Source {
+  Source(SourceKind kind, cell base): kind(kind), base(base) {}
+
+  bool operator==(const Source &other) const {
+    return kind == other.kind && base == other.base;
+  }
+
+  SourceKind kind;
+  cell base;
+};
+
+// Abstract value of a register or a cell pushed onto the stack. Values
+// without sources are plain numbers. Pawn doesn't have pointer variables,
+// so values loaded from memory are never treated as addresses (except for
+// indirection vectors of multi-dimensional arrays, which hold offsets
+// that are added to the address of the vector).
+struct Value {
+  Value(): bounded(false), min(0), max(0) {}
+
+  static Value Number(cell min, cell max) {
+    Value value;
+    value.bounded = true;
+    value.min = min;
+    value.max = max;
+    return value;
+  }
+
+  static Value Address(SourceKind kind, cell base) {
+    Value value;
+    value.sources.push_back(Source(kind, base));
+    return value;
+  }
+
+  void AddSource(const Source &source) {
+    if (std::find(sources.begin(), sources.end(), source) == sources.end()) {
+      sources.push_back(source);
+    }
+  }
+
+  void AddSources(const Value &other) {
+    for (std::size_t i = 0; i < other.sources.size(); i++) {
+      AddSource(other.sources[i]);
+    }
+  }
+
+  void SetRange(int64_t new_min, int64_t new_max) {
+    bounded = new_min >= static_cast<int64_t>(kCellMin)
+           && new_max <= static_cast<int64_t>(kCellMax);
+    min = bounded ? static_cast<cell>(new_min) : 0;
+    max = bounded ? static_cast<cell>(new_max) : 0;
+  }
+
+  static const cell kCellMin = -0x7fffffff - 1;
+  static const cell kCellMax = 0x7fffffff;
+
+  std::vector<Source> sources;
+  bool bounded;
+  cell min;
+  cell max;
+};
+
+Value Merge(const Value &a, const Value &b) {
+  Value result = a;
+  result.AddSources(b);
+  if (a.bounded && b.bounded) {
+    result.SetRange(std::min(a.min, b.min), std::max(a.max, b.max));
+  } else {
+    result.bounded = false;
+  }
+  return result;
+}
+
+// Computes base + index * scale. Pawn always keeps the address in the
+// first operand when indexing arrays, so sources of the index are ignored
+// unless the base is not an address at all.
+Value Index(const Value &base, const Value &index, cell scale) {
+  Value result = base;
+  if (base.sources.empty()) {
+    result.AddSources(index);
+  }
+  if (base.bounded && index.bounded) {
+    result.SetRange(base.min + static_cast<int64_t>(index.min) * scale,
+                    base.max + static_cast<int64_t>(index.max) * scale);
+  } else {
+    result.bounded = false;
+  }
+  return result;
+}
+
+// Computes a + b. Either of the operands may be an address.
+Value Add(const Value &a, const Value &b) {
+  Value result = a;
+  result.AddSources(b);
+  if (a.bounded && b.bounded) {
+    result.SetRange(static_cast<int64_t>(a.min) + b.min,
+                    static_cast<int64_t>(a.max) + b.max);
+  } else {
+    result.bounded = false;
+  }
+  return result;
+}
+
+struct State {
+  Value pri;
+  Value alt;
+  std::vector<Value> stack;
+};
+
+} // anonymous namespace
+
+// Scanner tracks values of PRI, ALT and pushed arguments within a single
+// function and reports writes and escaping addresses to WriteAnalysis.
+class WriteAnalysis::Scanner {
+ public:
+  Scanner(WriteAnalysis &analysis, const Function *function);
+
+  // Returns false if the code does something that can't be tracked.
+  bool Run();
+
+ private:
+  bool Step(const Instruction &instr);
+  void Escape(const Value &value);
+  void EscapeState(const State &state);
+  void WriteThrough(const Value &pointer, cell size);
+  void Jump(cell target, cell address);
+  Value Constant(cell value) const;
+  Value Param(cell offset) const;
+  Value Pop();
+  bool GetArgCount(int &num_args) const;
+  void SetParamWritten(int param);
+
+ private:
+  WriteAnalysis &analysis_;
+  const Function *function_;
+  FunctionInfo &info_;
+  State state_;
+  std::map<cell, State> incoming_;
+  std::map<cell, bool> stack_mismatch_;
+  bool reachable_;
+  bool ok_;
+};
+
+WriteAnalysis::Scanner::Scanner(WriteAnalysis &analysis,
+                                const Function *function):
+  analysis_(analysis),
+  function_(function),
+  info_(analysis.functions_[function->address()]),
+  reachable_(true),
+  ok_(true)
+{
+}
+
+bool WriteAnalysis::Scanner::Run() {
+  Instruction instr;
+
+  for (cell address = function_->address();
+       ok_ && address < function_->end_address();
+       address += instr.size()) {
+    if (!DecodeInstruction(analysis_.amx_, address, instr)) {
+      return false;
+    }
+
+    // Combine the states of all forward jumps to this instruction.
+    std::map<cell, State>::iterator it = incoming_.find(address);
+    if (it != incoming_.end()) {
+      if (!reachable_) {
+        state_ = it->second;
+      } else {
+        const State &other = it->second;
+        state_.pri = Merge(state_.pri, other.pri);
+        state_.alt = Merge(state_.alt, other.alt);
+        if (state_.stack.size() == other.stack.size()) {
+          for (std::size_t i = 0; i < other.stack.size(); i++) {
+            state_.stack[i] = Merge(state_.stack[i], other.stack[i]);
+          }
+        } else {
+          stack_mismatch_[address] = true;
+        }
+      }
+      if (stack_mismatch_[address]) {
+        for (std::size_t i = 0; i < it->second.stack.size(); i++) {
+          Escape(it->second.stack[i]);
+        }
+        for (std::size_t i = 0; i < state_.stack.size(); i++) {
+          Escape(state_.stack[i]);
+        }
+        state_.stack.clear();
+      }
+      incoming_.erase(it);
+    } else if (!reachable_) {
+      state_ = State();
+    }
+
+    reachable_ = true;
+    if (!Step(instr)) {
+      return false;
+    }
+  }
+
+  return ok_;
+}
+
+bool WriteAnalysis::Scanner::Step(const Instruction &instr) {
+  cell address = instr.address();
+
+  switch (instr.opcode().GetId()) {
+    case OP_CONST_PRI:
+      state_.pri = Constant(instr.operand());
+      break;
+    case OP_CONST_ALT:
+      state_.alt = Constant(instr.operand());
+      break;
+    case OP_ZERO_PRI:
+      state_.pri = Value::Number(0, 0);
+      break;
+    case OP_ZERO_ALT:
+      state_.alt = Value::Number(0, 0);
+      break;
+    case OP_MOVE_PRI:
+      state_.pri = state_.alt;
+      break;
+    case OP_MOVE_ALT:
+      state_.alt = state_.pri;
+      break;
+    case OP_XCHG:
+      std::swap(state_.pri, state_.alt);
+      break;
+    case OP_ADDR_PRI:
+      state_.pri = Value::Address(SOURCE_LOCAL, 0);
+      break;
+    case OP_ADDR_ALT:
+      state_.alt = Value::Address(SOURCE_LOCAL, 0);
+      break;
+    case OP_LOAD_S_PRI:
+      state_.pri = Param(instr.operand());
+      break;
+    case OP_LOAD_S_ALT:
+      state_.alt = Param(instr.operand());
+      break;
+    case OP_IDXADDR:
+      state_.pri = Index(state_.alt, state_.pri, sizeof(cell));
+      break;
+    case OP_IDXADDR_B:
+      state_.pri = Index(state_.alt, state_.pri, 1 << instr.operand());
+      break;
+    case OP_ADD:
+      state_.pri = Add(state_.pri, state_.alt);
+      break;
+    case OP_ADD_C:
+      state_.pri = Add(state_.pri,
+                       Value::Number(instr.operand(), instr.operand()));
+      break;
+    case OP_INC_PRI:
+      state_.pri = Add(state_.pri, Value::Number(1, 1));
+      break;
+    case OP_DEC_PRI:
+      state_.pri = Add(state_.pri, Value::Number(-1, -1));
+      break;
+    case OP_INC_ALT:
+      state_.alt = Add(state_.alt, Value::Number(1, 1));
+      break;
+    case OP_DEC_ALT:
+      state_.alt = Add(state_.alt, Value::Number(-1, -1));
+      break;
+    case OP_SUB:
+      // Address minus a number is still an address.
+      state_.pri.bounded = false;
+      break;
+    case OP_SUB_ALT:
+      state_.pri = state_.alt;
+      state_.pri.bounded = false;
+      break;
+    case OP_ALIGN_PRI:
+      state_.pri.bounded = false;
+      break;
+    case OP_ALIGN_ALT:
+      state_.alt.bounded = false;
+      break;
+    case OP_BOUNDS:
+      state_.pri.SetRange(0, instr.operand());
+      break;
+    case OP_HEAP:
+      state_.alt = Value::Address(SOURCE_HEAP, 0);
+      break;
+    case OP_STACK: {
+      cell num_cells = instr.operand() / static_cast<cell>(sizeof(cell));
+      if (num_cells > 0) {
+        state_.stack.resize(
+          state_.stack.size() - std::min(state_.stack.size(),
+                                         static_cast<std::size_t>(num_cells)));
+      } else {
+        // Local arrays can be huge, and only the values on top of the stack
+        // are interesting anyway.
+        state_.stack.resize(std::min(state_.stack.size() - num_cells,
+                                     kMaxStackSize));
+      }
+      state_.alt = Value::Address(SOURCE_LOCAL, 0);
+      break;
+    }
+    case OP_PUSH_PRI:
+      state_.stack.push_back(state_.pri);
+      break;
+    case OP_PUSH_ALT:
+      state_.stack.push_back(state_.alt);
+      break;
+    case OP_PUSH_C:
+      state_.stack.push_back(Constant(instr.operand()));
+      break;
+    case OP_PUSH_S:
+      state_.stack.push_back(Param(instr.operand()));
+      break;
+    case OP_PUSH_ADR:
+      state_.stack.push_back(Value::Address(SOURCE_LOCAL, 0));
+      break;
+    case OP_PUSH:
+      state_.stack.push_back(Value());
+      break;
+    case OP_POP_PRI:
+      state_.pri = Pop();
+      break;
+    case OP_POP_ALT:
+      state_.alt = Pop();
+      break;
+    case OP_SWAP_PRI:
+    case OP_SWAP_ALT: {
+      Value &reg = instr.opcode().GetId() == OP_SWAP_PRI ? state_.pri
+                                                          : state_.alt;
+      if (state_.stack.empty()) {
+        Escape(reg);
+        reg = Value();
+      } else {
+        std::swap(reg, state_.stack.back());
+      }
+      break;
+    }
+    case OP_STOR_PRI:
+    case OP_STOR_ALT:
+    case OP_ZERO:
+    case OP_INC:
+    case OP_DEC:
+      analysis_.AddWrite(instr.operand(),
+                         instr.operand() + static_cast<cell>(sizeof(cell)));
+      break;
+    case OP_SREF_S_PRI:
+    case OP_SREF_S_ALT:
+      if (instr.operand() < Function::GetParamOffset(0)) {
+        return false;
+      }
+      WriteThrough(Param(instr.operand()), sizeof(cell));
+      break;
+    case OP_SREF_PRI:
+    case OP_SREF_ALT:
+      // Global variables can't hold references.
+      return false;
+    case OP_STOR_I:
+      WriteThrough(state_.alt, sizeof(cell));
+      break;
+    case OP_STRB_I:
+    case OP_MOVS:
+    case OP_FILL:
+      WriteThrough(state_.alt, instr.operand());
+      if (instr.opcode().GetId() == OP_MOVS) {
+        state_.pri = Value();
+      }
+      break;
+    case OP_INC_I:
+    case OP_DEC_I:
+      WriteThrough(state_.pri, sizeof(cell));
+      break;
+    case OP_CALL: {
+      cell callee = analysis_.program_.GetJumpTarget(instr);
+      int num_args;
+      if (!GetArgCount(num_args)) {
+        EscapeState(state_);
+        state_.stack.clear();
+      } else {
+        // The callee pops the arguments as well as their size.
+        state_.stack.pop_back();
+        for (int i = 0; i < num_args && !state_.stack.empty(); i++) {
+          const Value &arg = state_.stack.back();
+          for (std::size_t j = 0; j < arg.sources.size(); j++) {
+            const Source &source = arg.sources[j];
+            if (source.kind == SOURCE_GLOBAL) {
+              analysis_.global_passes_.push_back(
+                ArgPass(source.base, callee, i));
+            } else if (source.kind == SOURCE_PARAM) {
+              info_.param_passes.push_back(ArgPass(source.base, callee, i));
+            }
+          }
+          state_.stack.pop_back();
+        }
+      }
+      state_.pri = Value();
+      state_.alt = Value();
+      break;
+    }
+    case OP_SYSREQ_C:
+    case OP_SYSREQ_D: {
+      AMXRef amx = analysis_.amx_;
+      const char *name;
+      if (instr.opcode().GetId() == OP_SYSREQ_C) {
+        name = amx.GetNativeName(instr.operand());
+      } else {
+        name = amx.GetNativeName(amx.FindNative(instr.operand()));
+      }
+      int num_args;
+      if (!GetArgCount(num_args)) {
+        EscapeState(state_);
+        state_.stack.clear();
+      } else {
+        // Arguments are popped by the STACK instruction that follows.
+        std::size_t size = state_.stack.size() - 1;
+        for (int i = 0; i < num_args && static_cast<std::size_t>(i) < size;
+             i++) {
+          if (IsArgWrittenByNative(name, i)) {
+            Escape(state_.stack[size - 1 - i]);
+          }
+        }
+      }
+      state_.pri = Value();
+      state_.alt = Value();
+      break;
+    }
+    case OP_JUMP:
+      Jump(analysis_.program_.GetJumpTarget(instr), address);
+      reachable_ = false;
+      break;
+    case OP_JZER:
+    case OP_JNZ:
+    case OP_JEQ:
+    case OP_JNEQ:
+    case OP_JLESS:
+    case OP_JLEQ:
+    case OP_JGRTR:
+    case OP_JGEQ:
+    case OP_JSLESS:
+    case OP_JSLEQ:
+    case OP_JSGRTR:
+    case OP_JSGEQ:
+      Jump(analysis_.program_.GetJumpTarget(instr), address);
+      break;
+    case OP_SWITCH: {
+      CaseTable case_table(analysis_.amx_, instr.operand());
+      Jump(case_table.GetDefaultAddress(), address);
+      for (int i = 0; i < case_table.num_cases(); i++) {
+        Jump(case_table.GetCaseAddress(i), address);
+      }
+      reachable_ = false;
+      break;
+    }
+    case OP_PROC:
+      state_ = State();
+      break;
+    case OP_RET:
+    case OP_RETN:
+    case OP_HALT:
+      state_ = State();
+      reachable_ = false;
+      break;
+    default:
+      if (!IsRegisterOnly(instr)) {
+        // Anything else doesn't write memory, but may clobber registers.
+        state_.pri = Value();
+        state_.alt = Value();
+      } else {
+        RegisterState registers;
+        int modified = registers.Apply(instr);
+        if (modified & REG_PRI) {
+          state_.pri = Value();
+        }
+        if (modified & REG_ALT) {
+          state_.alt = Value();
+        }
+      }
+      break;
+  }
+
+  return ok_;
+}
+
+void WriteAnalysis::Scanner::Escape(const Value &value) {
+  for (std::size_t i = 0; i < value.sources.size(); i++) {
+    const Source &source = value.sources[i];
+    switch (source.kind) {
+      case SOURCE_GLOBAL:
+        analysis_.AddUnboundedWrite(source.base);
+        break;
+      case SOURCE_PARAM:
+        SetParamWritten(source.base);
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+void WriteAnalysis::Scanner::EscapeState(const State &state) {
+  Escape(state.pri);
+  Escape(state.alt);
+  for (std::size_t i = 0; i < state.stack.size(); i++) {
+    Escape(state.stack[i]);
+  }
+}
+
+void WriteAnalysis::Scanner::WriteThrough(const Value &pointer, cell size) {
+  if (pointer.sources.empty()) {
+    // Writing to an arbitrary address.
+    ok_ = false;
+    return;
+  }
+  for (std::size_t i = 0; i < pointer.sources.size(); i++) {
+    const Source &source = pointer.sources[i];
+    switch (source.kind) {
+      case SOURCE_GLOBAL:
+        if (pointer.sources.size() == 1 && pointer.bounded && size > 0) {
+          analysis_.AddWrite(pointer.min, pointer.max + size);
+        } else {
+          analysis_.AddUnboundedWrite(source.base);
+        }
+        break;
+      case SOURCE_PARAM:
+        SetParamWritten(source.base);
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+void WriteAnalysis::Scanner::Jump(cell target, cell address) {
+  if (target <= address) {
+    // The target has already been scanned, so whatever flows into it
+    // through this jump can't be tracked any further.
+    EscapeState(state_);
+    return;
+  }
+  std::map<cell, State>::iterator it = incoming_.find(target);
+  if (it == incoming_.end()) {
+    incoming_[target] = state_;
+    return;
+  }
+  State &other = it->second;
+  other.pri = Merge(other.pri, state_.pri);
+  other.alt = Merge(other.alt, state_.alt);
+  if (other.stack.size() == state_.stack.size()) {
+    for (std::size_t i = 0; i < other.stack.size(); i++) {
+      other.stack[i] = Merge(other.stack[i], state_.stack[i]);
+    }
+  } else {
+    for (std::size_t i = 0; i < state_.stack.size(); i++) {
+      Escape(state_.stack[i]);
+    }
+    stack_mismatch_[target] = true;
+  }
+}
+
+Value WriteAnalysis::Scanner::Constant(cell value) const {
+  Value result = Value::Number(value, value);
+  if (value >= 0 && value < static_cast<cell>(analysis_.amx_.data_size())) {
+    result.AddSource(Source(SOURCE_GLOBAL, value));
+  }
+  return result;
+}
+
+Value WriteAnalysis::Scanner::Param(cell offset) const {
+  cell first_offset = Function::GetParamOffset(0);
+  if (offset < first_offset || offset % sizeof(cell) != 0) {
+    return Value();
+  }
+  return Value::Address(SOURCE_PARAM, (offset - first_offset) / sizeof(cell));
+}
+
+Value WriteAnalysis::Scanner::Pop() {
+  if (state_.stack.empty()) {
+    return Value();
+  }
+  Value value = state_.stack.back();
+  state_.stack.pop_back();
+  return value;
+}
+
+bool WriteAnalysis::Scanner::GetArgCount(int &num_args) const {
+  if (state_.stack.empty()) {
+    return false;
+  }
+  const Value &size = state_.stack.back();
+  if (!size.bounded
+      || size.min != size.max
+      || size.min < 0
+      || size.min % sizeof(cell) != 0) {
+    return false;
+  }
+  num_args = size.min / sizeof(cell);
+  return true;
+}
+
+void WriteAnalysis::Scanner::SetParamWritten(int param) {
+  if (info_.written_params.size() <= static_cast<std::size_t>(param)) {
+    info_.written_params.resize(param + 1);
+  }
+  info_.written_params[param] = true;
+}
+
+WriteAnalysis::WriteAnalysis(const Program &program):
+  program_(program),
+  amx_(program.amx()),
+  complete_(false),
+  unbounded_start_(0)
+{
+}
+
+bool WriteAnalysis::Run() {
+  complete_ = false;
+  unbounded_start_ = static_cast<cell>(amx_.data_size());
+  writes_.clear();
+  functions_.clear();
+  global_passes_.clear();
+
+  const std::vector<Function*> &functions = program_.functions();
+  for (std::vector<Function*>::const_iterator it = functions.begin();
+       it != functions.end(); it++) {
+    const Function *function = *it;
+    if (function->flags() & FUNCTION_USES_EMIT) {
+      return false;
+    }
+    Scanner scanner(*this, function);
+    if (!scanner.Run()) {
+      return false;
+    }
+    if (function->flags() & FUNCTION_MODIFIES_ARGS) {
+      functions_[function->address()].writes_all_params = true;
+    }
+  }
+
+  PropagateParamWrites();
+
+  for (std::vector<ArgPass>::const_iterator it = global_passes_.begin();
+       it != global_passes_.end(); it++) {
+    if (IsParamWritten(it->callee, it->arg)) {
+      AddUnboundedWrite(it->value);
+    }
+  }
+
+  // Public variables can be modified by the host application. They are
+  // always single cells.
+  AMX_FUNCSTUBNT *pubvars = amx_.pubvars();
+  for (int i = 0; i < amx_.num_pubvars(); i++) {
+    cell address = static_cast<cell>(pubvars[i].address);
+    AddWrite(address, address + static_cast<cell>(sizeof(cell)));
+  }
+
+  // Merge overlapping ranges so that lookups can use binary search.
+  std::sort(writes_.begin(), writes_.end());
+  std::vector<std::pair<cell, cell> > merged;
+  for (std::vector<std::pair<cell, cell> >::const_iterator it =
+         writes_.begin(); it != writes_.end(); it++) {
+    if (!merged.empty() && it->first <= merged.back().second) {
+      merged.back().second = std::max(merged.back().second, it->second);
+    } else {
+      merged.push_back(*it);
+    }
+  }
+  writes_.swap(merged);
+
+  complete_ = true;
+  return true;
+}
+
+bool WriteAnalysis::IsReadOnly(cell address, cell size) const {
+  if (!complete_
+      || address < 0
+      || size <= 0
+      || address > unbounded_start_ - size) {
+    return false;
+  }
+  std::vector<std::pair<cell, cell> >::const_iterator it =
+    std::lower_bound(writes_.begin(),
+                     writes_.end(),
+                     std::make_pair(address + size, cell(0)));
+  if (it == writes_.begin()) {
+    return true;
+  }
+  --it;
+  return it->second <= address;
+}
+
+bool WriteAnalysis::GetValue(cell address, cell &value) const {
+  if (!IsReadOnly(address, sizeof(cell))) {
+    return false;
+  }
+  std::memcpy(&value, program_.data() + address, sizeof(value));
+  return true;
+}
+
+void WriteAnalysis::AddWrite(cell start, cell end) {
+  if (start < end) {
+    writes_.push_back(std::make_pair(start, end));
+  }
+}
+
+void WriteAnalysis::AddUnboundedWrite(cell start) {
+  unbounded_start_ = std::min(unbounded_start_, std::max(start, cell(0)));
+}
+
+bool WriteAnalysis::IsParamWritten(cell function, int param) const {
+  std::map<cell, FunctionInfo>::const_iterator it = functions_.find(function);
+  if (it == functions_.end()) {
+    return true;
+  }
+  const FunctionInfo &info = it->second;
+  return info.writes_all_params
+      || (static_cast<std::size_t>(param) < info.written_params.size()
+          && info.written_params[param]);
+}
+
+void WriteAnalysis::PropagateParamWrites() {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (std::map<cell, FunctionInfo>::iterator it = functions_.begin();
+         it != functions_.end(); it++) {
+      FunctionInfo &info = it->second;
+      for (std::vector<ArgPass>::const_iterator pass_it =
+             info.param_passes.begin();
+           pass_it != info.param_passes.end(); pass_it++) {
+        int param = pass_it->value;
+        if (IsParamWritten(it->first, param)) {
+          continue;
+        }
+        if (IsParamWritten(pass_it->callee, pass_it->arg)) {
+          if (info.written_params.size() <= static_cast<std::size_t>(param)) {
+            info.written_params.resize(param + 1);
+          }
+          info.written_params[param] = true;
+          changed = true;
+        }
+      }
+    }
+  }
+}
+
+} // namespace amxjit
@@ -0,0 +1,105 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef AMXJIT_WRITEANALYSIS_H
+#define AMXJIT_WRITEANALYSIS_H
+
+#include <map>
+#include <utility>
+#include <vector>
+#include "amxref.h"
+#include "macros.h"
+
+namespace amxjit {
+
+class Function;
+class Program;
+
+// WriteAnalysis finds parts of the data section that can't be modified
+// after the script is loaded.
+//
+// Every instruction that writes memory is examined. For writes through a
+// pointer (STOR.I, MOVS, etc.) the analysis tracks where the pointer came
+// from: a global address, a parameter of the current function, a local
+// variable or the heap. Global addresses that escape - get passed to a
+// native function or a parameter that is written through, stored in
+// memory, etc. - are assumed to be writable from that address onwards.
+//
+// If the code does something that can't be tracked (uses #emit, writes
+// through an arbitrary value) the analysis gives up and reports that
+// nothing is read-only.
+class WriteAnalysis {
+ public:
+  explicit WriteAnalysis(const Program &program);
+
+  // Returns false if the analysis could not be completed.
+  bool Run();
+
+  // Returns true if none of the bytes in [address, address + size) can be
+  // modified by the script.
+  bool IsReadOnly(cell address, cell size) const;
+
+  // Reads a cell from the data section if it's known to be read-only.
+  bool GetValue(cell address, cell &value) const;
+
+ private:
+  struct ArgPass {
+    ArgPass(cell value, cell callee, int arg):
+      value(value), callee(callee), arg(arg) {}
+    cell value;  // address or parameter index
+    cell callee;
+    int arg;
+  };
+
+  struct FunctionInfo {
+    FunctionInfo(): writes_all_params(false) {}
+    bool writes_all_params;
+    std::vector<bool> written_params;
+    std::vector<ArgPass> param_passes;
+  };
+
+  class Scanner;
+  friend class Scanner;
+
+  void AddWrite(cell start, cell end);
+  void AddUnboundedWrite(cell start);
+  bool IsParamWritten(cell function, int param) const;
+  void PropagateParamWrites();
+
+ private:
+  const Program &program_;
+  AMXRef amx_;
+  bool complete_;
+  cell unbounded_start_;
+  std::vector<std::pair<cell, cell> > writes_;
+  std::map<cell, FunctionInfo> functions_;
+  std::vector<ArgPass> global_passes_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(WriteAnalysis);
+};
+
+} // namespace amxjit
+
+#endif // !AMXJIT_WRITEANALYSIS_H
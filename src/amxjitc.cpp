@@ -0,0 +1,229 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// amxjitc compiles AMX files ahead of time. The plugin loads the resulting
+// images instead of compiling the scripts when jit_images is enabled.
+//
+// Usage: amxjitc [options] <output directory> <file.amx>...
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <amx/amx.h>
+#include "pluginversion.h"
+#include "amxjit/compiler.h"
+#include "amxjit/disasm.h"
+#include "amxjit/opcode.h"
+
+#ifdef AMXJIT_RELOCATE_OPCODES
+
+// amxjit uses the opcode table of the server's amx_Exec() to map relocated
+// opcodes back to their numbers. Scripts loaded by this tool are not
+// relocated, so the table maps every opcode to itself.
+int AMXAPI amx_Exec(AMX *amx, cell *retval, int index) {
+  static cell opcode_table[amxjit::NUM_OPCODES];
+  for (int i = 0; i < amxjit::NUM_OPCODES; i++) {
+    opcode_table[i] = i;
+  }
+  *retval = reinterpret_cast<cell>(opcode_table);
+  return AMX_ERR_NONE;
+}
+
+#endif
+
+namespace {
+
+class ErrorHandler: public amxjit::CompileErrorHandler {
+ public:
+  virtual void Execute(const amxjit::Instruction &instr) {
+    std::fprintf(stderr,
+                 "Invalid or unsupported instruction at address %08x:\n",
+                 instr.address());
+    std::fprintf(stderr, "  => %s\n", instr.ToString().c_str());
+  }
+};
+
+// Loads an AMX file the same way the server does, as far as the compiler
+// is concerned: code addresses in jump, call and switch instructions are
+// made absolute.
+bool LoadAMX(const char *filename,
+             AMX &amx,
+             std::vector<unsigned char> &memory) {
+  std::ifstream file(filename, std::ios::in | std::ios::binary);
+  if (!file.is_open()) {
+    std::fprintf(stderr, "%s: could not open file\n", filename);
+    return false;
+  }
+
+  AMX_HEADER header;
+  if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)).good()
+      || header.magic != AMX_MAGIC
+      || header.file_version < MIN_FILE_VERSION
+      || header.file_version > CUR_FILE_VERSION
+      || header.size < static_cast<int32_t>(sizeof(header))
+      || header.stp < header.size) {
+    std::fprintf(stderr, "%s: not a valid AMX file\n", filename);
+    return false;
+  }
+  if ((header.flags & AMX_FLAG_COMPACT) != 0) {
+    std::fprintf(stderr, "%s: compact encoding is not supported, "
+                         "compile the script with -C-\n", filename);
+    return false;
+  }
+
+  memory.assign(header.stp, 0);
+  std::memcpy(&memory[0], &header, sizeof(header));
+  if (!file.read(reinterpret_cast<char*>(&memory[sizeof(header)]),
+                 header.size - sizeof(header)).good()) {
+    std::fprintf(stderr, "%s: unexpected end of file\n", filename);
+    return false;
+  }
+
+  std::memset(&amx, 0, sizeof(amx));
+  amx.base = &memory[0];
+  amx.cip = header.cip;
+  amx.hea = header.hea - header.dat;
+  amx.hlw = amx.hea;
+  amx.stp = header.stp - header.dat - sizeof(cell);
+  amx.stk = amx.stp;
+
+  amxjit::AMXRef amx_ref(&amx);
+  cell code_start = reinterpret_cast<cell>(amx_ref.code());
+  std::vector<cell> fixups;
+
+  amxjit::Instruction instr;
+  amxjit::Disassembler disasm(amx_ref);
+  bool error = false;
+  while (disasm.Decode(instr, error)) {
+    for (std::size_t i = 0; i < instr.operands().size(); i++) {
+      if (instr.IsCodeAddressOperand(i)) {
+        fixups.push_back(instr.address() + (i + 1) * sizeof(cell));
+      }
+    }
+  }
+  if (error) {
+    std::fprintf(stderr, "%s: invalid instruction at address %08x\n",
+                 filename, instr.address());
+    return false;
+  }
+
+  for (std::vector<cell>::const_iterator it = fixups.begin();
+       it != fixups.end(); it++) {
+    *reinterpret_cast<cell*>(amx_ref.code() + *it) += code_start;
+  }
+  return true;
+}
+
+void PrintUsage() {
+  std::fprintf(stderr,
+    "Usage: amxjitc [options] <output directory> <file.amx>...\n"
+    "\n"
+    "Options:\n"
+    "  --sleep                  support the sleep instruction\n"
+    "  --resume                 support jit_background\n"
+    "  --readonly-data          fold loads of data that is never written\n"
+    "  --dead-code              skip unreachable code\n"
+    "  --reorder-functions      order functions by call graph affinity\n"
+    "  --relax-branches         use short jumps where possible\n"
+    "  --inline-natives         call natives directly at call sites\n"
+    "  --specialize-budget=N    specialize functions for constant arguments\n"
+    "  --eval-steps=N           evaluate pure calls at compile time\n");
+}
+
+bool ParseNumber(const char *arg, const char *prefix, unsigned int &value) {
+  std::size_t length = std::strlen(prefix);
+  if (std::strncmp(arg, prefix, length) != 0) {
+    return false;
+  }
+  value = static_cast<unsigned int>(std::strtoul(arg + length, 0, 10));
+  return true;
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+  amxjit::Compiler compiler;
+  ErrorHandler error_handler;
+  compiler.SetErrorHandler(&error_handler);
+  compiler.SetCacheTag(PLUGIN_VERSION_STRING);
+
+  int arg_index = 1;
+  for (; arg_index < argc && std::strncmp(argv[arg_index], "--", 2) == 0;
+       arg_index++) {
+    const char *arg = argv[arg_index];
+    unsigned int value;
+    if (std::strcmp(arg, "--sleep") == 0) {
+      compiler.SetSleepEnabled(true);
+    } else if (std::strcmp(arg, "--resume") == 0) {
+      compiler.SetResumeEnabled(true);
+    } else if (std::strcmp(arg, "--readonly-data") == 0) {
+      compiler.SetReadOnlyDataEnabled(true);
+    } else if (std::strcmp(arg, "--dead-code") == 0) {
+      compiler.SetDeadCodeEliminationEnabled(true);
+    } else if (std::strcmp(arg, "--reorder-functions") == 0) {
+      compiler.SetFunctionReorderingEnabled(true);
+    } else if (std::strcmp(arg, "--relax-branches") == 0) {
+      compiler.SetBranchRelaxationEnabled(true);
+    } else if (std::strcmp(arg, "--inline-natives") == 0) {
+      compiler.SetInlineNativesEnabled(true);
+    } else if (ParseNumber(arg, "--specialize-budget=", value)) {
+      compiler.SetSpecializationBudget(value);
+    } else if (ParseNumber(arg, "--eval-steps=", value)) {
+      compiler.SetEvalStepLimit(value);
+    } else {
+      std::fprintf(stderr, "Unknown option: %s\n", arg);
+      PrintUsage();
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (argc - arg_index < 2) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+
+  const char *output_directory = argv[arg_index++];
+  int status = EXIT_SUCCESS;
+
+  for (; arg_index < argc; arg_index++) {
+    const char *filename = argv[arg_index];
+    AMX amx;
+    std::vector<unsigned char> memory;
+    if (!LoadAMX(filename, amx, memory)) {
+      status = EXIT_FAILURE;
+      continue;
+    }
+    if (!compiler.CompileImage(&amx, output_directory)) {
+      std::fprintf(stderr, "%s: compilation failed\n", filename);
+      status = EXIT_FAILURE;
+      continue;
+    }
+    std::printf("%s: OK\n", filename);
+  }
+
+  return status;
+}
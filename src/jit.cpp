@@ -39,9 +39,15 @@
 #endif
 
 typedef int (AMXAPI *AMX_EXEC)(AMX *amx, cell *retval, int index);
+typedef int (AMXAPI *AMX_REGISTER)(AMX *amx,
+                                   const AMX_NATIVE_INFO *nativelist,
+                                   int number);
+typedef int (AMXAPI *AMX_CLEANUP)(AMX *amx);
 
 extern void *pAMXFunctions;
 static subhook::Hook exec_hook;
+static subhook::Hook register_hook;
+static subhook::Hook cleanup_hook;
 
 #ifdef LINUX
   static cell *opcode_table = NULL;
@@ -105,14 +111,40 @@ int AMXAPI amx_Exec_JIT(AMX *amx, cell *retval, int index) {
       return AMX_ERR_NONE;
     }
   #endif
-  int error = JITHandler::GetHandler(amx)->Exec(retval, index);
+  JITHandler *handler = JITHandler::GetHandler(amx);
+  int error = handler->Exec(retval, index);
   if (error == AMX_ERR_INIT_JIT) {
     AMX_EXEC exec = (AMX_EXEC)exec_hook.GetTrampoline();
-    return exec(amx, retval, index);
+    handler->OnInterpreterEnter();
+    error = exec(amx, retval, index);
+    if (handler->OnInterpreterExit(index, error)) {
+      // The call was stopped midway to continue in compiled code.
+      error = handler->Exec(retval, AMX_EXEC_CONT);
+    }
+  }
+  return error;
+}
+
+int AMXAPI amx_Register_JIT(AMX *amx,
+                            const AMX_NATIVE_INFO *nativelist,
+                            int number) {
+  AMX_REGISTER register_ = (AMX_REGISTER)register_hook.GetTrampoline();
+  int error = register_(amx, nativelist, number);
+  JITHandler *handler = JITHandler::FindHandler(amx);
+  if (handler != 0) {
+    handler->OnNativesRegistered();
   }
   return error;
 }
 
+int AMXAPI amx_Cleanup_JIT(AMX *amx) {
+  // Instances made with amx_Clone() are not unloaded like scripts, so
+  // their code is released here.
+  JITHandler::DestroyHandler(amx);
+  AMX_CLEANUP cleanup = (AMX_CLEANUP)cleanup_hook.GetTrampoline();
+  return cleanup(amx);
+}
+
 } // anonymous namespace
 
 PLUGIN_EXPORT unsigned int PLUGIN_CALL Supports() {
@@ -145,11 +177,24 @@ PLUGIN_EXPORT bool PLUGIN_CALL Load(void **ppData) {
   #endif
   exec_hook.Install(exec_start, (void *)amx_Exec_JIT);
 
+  // Plugins may register natives after the script is compiled.
+  register_hook.Install(GetAMXFunction(PLUGIN_AMX_EXPORT_Register),
+                        (void *)amx_Register_JIT);
+  cleanup_hook.Install(GetAMXFunction(PLUGIN_AMX_EXPORT_Cleanup),
+                       (void *)amx_Cleanup_JIT);
+
+  // Division by zero and bad memory accesses in compiled code are caught
+  // by the CPU rather than by explicit checks.
+  if (!JITHandler::InstallTrapHandler()) {
+    logprintf("  JIT plugin could not install trap handler");
+  }
+
   logprintf("  JIT plugin %s", PLUGIN_VERSION_STRING);
   return true;
 }
 
 PLUGIN_EXPORT int PLUGIN_CALL AmxLoad(AMX *amx) {
+  JITHandler::GetHandler(amx)->StartBackgroundCompilation();
   return AMX_ERR_NONE;
 }
 
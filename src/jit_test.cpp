@@ -0,0 +1,139 @@
+#include <cstring>
+#include <vector>
+#include "plugin.h"
+
+/******************************************************************************
+
+Natives used by the tests that need more than one script instance or that
+change natives at run time.
+
+native CloneScript();
+native CallClone(const function[], value);
+native DestroyClone();
+native LateNative();
+native ReplaceLateNative();
+
+******************************************************************************/
+
+typedef void (*logprintf_t)(const char *format, ...);
+
+extern void *pAMXFunctions;
+static logprintf_t logprintf;
+
+namespace {
+  AMX clone;
+  std::vector<unsigned char> clone_data;
+  bool clone_loaded = false;
+}
+
+static cell AMX_NATIVE_CALL n_CloneScript(AMX *amx, cell *params) {
+  if (clone_loaded) {
+    return 0;
+  }
+  AMX_HEADER *hdr = reinterpret_cast<AMX_HEADER*>(amx->base);
+  clone_data.resize(hdr->stp - hdr->dat);
+  int error = amx_Clone(&clone, amx, &clone_data[0]);
+  if (error != AMX_ERR_NONE) {
+    logprintf("[test] Error: Could not clone script: %d", error);
+    return 0;
+  }
+  clone_loaded = true;
+  return 1;
+}
+
+static cell AMX_NATIVE_CALL n_CallClone(AMX *amx, cell *params) {
+  if (!clone_loaded || params[0] / sizeof(*params) < 2) {
+    return 0;
+  }
+
+  cell *function_addr;
+  int length;
+  amx_GetAddr(amx, params[1], &function_addr);
+  amx_StrLen(function_addr, &length);
+  std::vector<char> function(length + 1);
+  amx_GetString(&function[0], function_addr, 0, function.size());
+
+  int index;
+  int error = amx_FindPublic(&clone, &function[0], &index);
+  if (error != AMX_ERR_NONE) {
+    logprintf("[test] Error: %s does not exist", &function[0]);
+    return 0;
+  }
+
+  cell retval = 0;
+  amx_Push(&clone, params[2]);
+  error = amx_Exec(&clone, &retval, index);
+  if (error != AMX_ERR_NONE) {
+    logprintf("[test] Error: %s failed: %d", &function[0], error);
+    return 0;
+  }
+  return retval;
+}
+
+static cell AMX_NATIVE_CALL n_DestroyClone(AMX *amx, cell *params) {
+  if (!clone_loaded) {
+    return 0;
+  }
+  amx_Cleanup(&clone);
+  clone_loaded = false;
+  return 1;
+}
+
+static cell AMX_NATIVE_CALL n_LateNative(AMX *amx, cell *params) {
+  return 1;
+}
+
+static cell AMX_NATIVE_CALL n_LateNativeReplacement(AMX *amx, cell *params) {
+  return 2;
+}
+
+// amx_Register() only fills in natives that are not registered yet, so the
+// old address is cleared first.
+static cell AMX_NATIVE_CALL n_ReplaceLateNative(AMX *amx, cell *params) {
+  int index;
+  if (amx_FindNative(amx, "LateNative", &index) != AMX_ERR_NONE) {
+    return 0;
+  }
+  AMX_HEADER *hdr = reinterpret_cast<AMX_HEADER*>(amx->base);
+  AMX_FUNCSTUB *native = reinterpret_cast<AMX_FUNCSTUB*>(
+    amx->base + hdr->natives + index * hdr->defsize);
+  native->address = 0;
+
+  const AMX_NATIVE_INFO natives[] = {
+    {"LateNative", n_LateNativeReplacement}
+  };
+  return amx_Register(amx, natives, 1) == AMX_ERR_NONE;
+}
+
+PLUGIN_EXPORT unsigned int PLUGIN_CALL Supports() {
+  return SUPPORTS_VERSION | SUPPORTS_AMX_NATIVES;
+}
+
+PLUGIN_EXPORT bool PLUGIN_CALL Load(void **ppData) {
+  logprintf = (logprintf_t)ppData[PLUGIN_DATA_LOGPRINTF];
+  pAMXFunctions = ppData[PLUGIN_DATA_AMX_EXPORTS];
+  return true;
+}
+
+PLUGIN_EXPORT void PLUGIN_CALL Unload() {
+}
+
+PLUGIN_EXPORT int PLUGIN_CALL AmxLoad(AMX *amx) {
+  const AMX_NATIVE_INFO natives[] = {
+    {"CloneScript", n_CloneScript},
+    {"CallClone", n_CallClone},
+    {"DestroyClone", n_DestroyClone},
+    {"LateNative", n_LateNative},
+    {"ReplaceLateNative", n_ReplaceLateNative}
+  };
+  int error = amx_Register(amx, natives, sizeof(natives) / sizeof(natives[0]));
+  if (error != AMX_ERR_NONE) {
+    logprintf("[test] Error: Could not register natives: %d", error);
+    return error;
+  }
+  return AMX_ERR_NONE;
+}
+
+PLUGIN_EXPORT int PLUGIN_CALL AmxUnload(AMX *amx) {
+  return AMX_ERR_NONE;
+}
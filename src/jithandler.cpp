@@ -26,13 +26,16 @@
 #include <cstdarg>
 #include <cstdlib>
 #include <string>
+#include <vector>
 #include <configreader.h>
 #include "jithandler.h"
 #include "logprintf.h"
 #include "plugin.h"
+#include "pluginversion.h"
 #include "amxjit/compiler.h"
 #include "amxjit/disasm.h"
 #include "amxjit/logger.h"
+#include "amxjit/platform.h"
 
 #define logprintf Use_jit_printf_instead_of_logprintf
 
@@ -50,15 +53,77 @@ void jit_printf(const char *format, ...) {
   va_end(va);
 }
 
+// Errors are collected and printed after compilation because the compiler
+// may be running on a background thread.
 class ErrorHandler: public amxjit::CompileErrorHandler {
  public:
+  ErrorHandler(): address_(-1) {}
+
   virtual void Execute(const amxjit::Instruction &instr) {
-    jit_printf("Invalid or unsupported instruction at address %08x:",
-               instr.address());
-    jit_printf("  => %s", instr.ToString().c_str());
+    address_ = instr.address();
+    instr_ = instr.ToString();
+  }
+
+  void Print() const {
+    if (address_ >= 0) {
+      jit_printf("Invalid or unsupported instruction at address %08x:",
+                 address_);
+      jit_printf("  => %s", instr_.c_str());
+    }
   }
+
+ private:
+  cell address_;
+  std::string instr_;
 };
 
+// Reports tier-ups in the server log.
+class TierUpLogger: public amxjit::Logger {
+ public:
+  virtual void Write(const char *string) {
+    jit_printf("%s", string);
+  }
+};
+
+// Tiered code may outlive any handler, so the logger is never destroyed.
+TierUpLogger tier_up_logger;
+
+// Set if faults in compiled code are turned into AMX errors.
+bool traps_installed = false;
+
+struct Options {
+  bool enable_log;
+  bool enable_sysreq_d;
+  bool enable_inline_natives;
+  bool enable_sleep_support;
+  unsigned int debug_flags;
+  unsigned int specialization_budget;
+  unsigned int eval_step_limit;
+  bool enable_read_only_data;
+  bool enable_dead_code_elimination;
+  bool enable_function_reordering;
+  bool enable_branch_relaxation;
+  bool enable_lazy_compilation;
+  bool enable_background_compilation;
+  unsigned int thread_count;
+  bool enable_tiered_compilation;
+  unsigned int tier_up_threshold;
+  bool enable_cache;
+  bool enable_images;
+  bool report_code_size;
+  bool report_compile_time;
+  bool report_tier_up;
+  bool enable_traps;
+};
+
+// Environment variables override settings from server.cfg.
+void GetEnvValue(const char *name, unsigned int &value) {
+  const char *env_value = std::getenv(name);
+  if (env_value != 0) {
+    value = static_cast<unsigned int>(std::strtoul(env_value, 0, 10));
+  }
+}
+
 cell OnJITCompile(AMX *amx) {
   int index;
   if (amx_FindPublic(amx, "OnJITCompile", &index) == AMX_ERR_NONE) {
@@ -79,54 +144,300 @@ cell OnJITError(AMX *amx) {
   return 0;
 }
 
-amxjit::CodeBuffer *Compile(AMX *amx) {
-  if (!OnJITCompile(amx)) {
-    jit_printf("Compilation was disabled");
-    return 0;
-  }
+Options ReadOptions() {
+  Options options;
 
   ConfigReader server_cfg("server.cfg");
-  bool enable_log = false;
-  server_cfg.GetValue("jit_log", enable_log);
-  bool enable_sysreq_d = true;
-  server_cfg.GetValue("jit_sysreq_d", enable_sysreq_d);
-  bool enable_sleep_support = false;
-  server_cfg.GetValue("jit_sleep", enable_sleep_support);
-  unsigned int debug_flags = 0;
-  server_cfg.GetValue("jit_debug", debug_flags);
+  options.enable_log = false;
+  server_cfg.GetValue("jit_log", options.enable_log);
+  options.enable_sysreq_d = true;
+  server_cfg.GetValue("jit_sysreq_d", options.enable_sysreq_d);
+  options.enable_inline_natives = false;
+  server_cfg.GetValue("jit_inline_natives", options.enable_inline_natives);
+  options.enable_sleep_support = false;
+  server_cfg.GetValue("jit_sleep", options.enable_sleep_support);
+  options.debug_flags = 0;
+  server_cfg.GetValue("jit_debug", options.debug_flags);
+  options.specialization_budget = 0;
+  server_cfg.GetValue("jit_specialize_budget", options.specialization_budget);
+  options.eval_step_limit = 0;
+  server_cfg.GetValue("jit_eval_steps", options.eval_step_limit);
+  options.enable_read_only_data = false;
+  server_cfg.GetValue("jit_readonly_data", options.enable_read_only_data);
+  options.enable_dead_code_elimination = false;
+  server_cfg.GetValue("jit_dead_code", options.enable_dead_code_elimination);
+  options.enable_function_reordering = false;
+  server_cfg.GetValue("jit_reorder_functions",
+                      options.enable_function_reordering);
+  options.enable_branch_relaxation = false;
+  server_cfg.GetValue("jit_relax_branches", options.enable_branch_relaxation);
+  options.enable_lazy_compilation = false;
+  server_cfg.GetValue("jit_lazy", options.enable_lazy_compilation);
+  options.enable_background_compilation = false;
+  server_cfg.GetValue("jit_background",
+                      options.enable_background_compilation);
+  options.thread_count = 1;
+  server_cfg.GetValue("jit_threads", options.thread_count);
+  options.enable_tiered_compilation = false;
+  server_cfg.GetValue("jit_tiered", options.enable_tiered_compilation);
+  options.tier_up_threshold = 1000;
+  server_cfg.GetValue("jit_tier_threshold", options.tier_up_threshold);
+  options.enable_cache = false;
+  server_cfg.GetValue("jit_cache", options.enable_cache);
+  options.enable_images = false;
+  server_cfg.GetValue("jit_images", options.enable_images);
+  options.report_code_size = false;
+  server_cfg.GetValue("jit_report_size", options.report_code_size);
+  options.report_compile_time = false;
+  server_cfg.GetValue("jit_report_time", options.report_compile_time);
+  options.report_tier_up = false;
+  server_cfg.GetValue("jit_report_tier_up", options.report_tier_up);
+  options.enable_traps = false;
+  server_cfg.GetValue("jit_traps", options.enable_traps);
 
+  if (std::getenv("JIT_INLINE_NATIVES") != 0) {
+    options.enable_inline_natives = true;
+  }
   if (std::getenv("JIT_SLEEP") != 0) {
-    enable_sleep_support = true;
+    options.enable_sleep_support = true;
+  }
+  if (std::getenv("JIT_READONLY_DATA") != 0) {
+    options.enable_read_only_data = true;
+  }
+  if (std::getenv("JIT_DEAD_CODE") != 0) {
+    options.enable_dead_code_elimination = true;
+  }
+  if (std::getenv("JIT_REORDER_FUNCTIONS") != 0) {
+    options.enable_function_reordering = true;
+  }
+  if (std::getenv("JIT_RELAX_BRANCHES") != 0) {
+    options.enable_branch_relaxation = true;
+  }
+  if (std::getenv("JIT_LAZY") != 0) {
+    options.enable_lazy_compilation = true;
+  }
+  if (std::getenv("JIT_BACKGROUND") != 0) {
+    options.enable_background_compilation = true;
+  }
+  if (std::getenv("JIT_TIERED") != 0) {
+    options.enable_tiered_compilation = true;
+  }
+  if (std::getenv("JIT_CACHE") != 0) {
+    options.enable_cache = true;
   }
+  if (std::getenv("JIT_IMAGES") != 0) {
+    options.enable_images = true;
+  }
+  if (std::getenv("JIT_REPORT_SIZE") != 0) {
+    options.report_code_size = true;
+  }
+  if (std::getenv("JIT_REPORT_TIME") != 0) {
+    options.report_compile_time = true;
+  }
+  if (std::getenv("JIT_REPORT_TIER_UP") != 0) {
+    options.report_tier_up = true;
+  }
+  if (std::getenv("JIT_TRAPS") != 0) {
+    options.enable_traps = true;
+  }
+  GetEnvValue("JIT_SPECIALIZE_BUDGET", options.specialization_budget);
+  GetEnvValue("JIT_EVAL_STEPS", options.eval_step_limit);
+  GetEnvValue("JIT_THREADS", options.thread_count);
+  GetEnvValue("JIT_TIER_THRESHOLD", options.tier_up_threshold);
+
+  return options;
+}
 
+// Compiles the script without touching the server: this may be called from
+// a background thread. The caller passes the value of amx->sysreq_d as seen
+// before compilation started and, if the script can run in the meantime, a
+// copy of its data taken at the same time (or 0).
+amxjit::CodeBuffer *CompileAMX(AMX *amx,
+                               const Options &options,
+                               bool sysreq_d,
+                               const unsigned char *data,
+                               ErrorHandler &error_handler,
+                               long &compile_time) {
   amxjit::Logger *logger = 0;
-  if (enable_log) {
+  if (options.enable_log) {
     logger = new amxjit::FileLogger("plugins/jit.log");
   }
 
   amxjit::Compiler compiler;
-  ErrorHandler error_handler;
   compiler.SetLogger(logger);
   compiler.SetErrorHandler(&error_handler);
-  compiler.SetSysreqDEnabled(enable_sysreq_d);
-  compiler.SetSleepEnabled(enable_sleep_support);
-  compiler.SetDebugFlags(debug_flags);
+  compiler.SetSysreqDEnabled(options.enable_sysreq_d && sysreq_d);
+  compiler.SetInlineNativesEnabled(options.enable_inline_natives);
+  compiler.SetDataSnapshot(data);
+  compiler.SetSleepEnabled(options.enable_sleep_support);
+  compiler.SetDebugFlags(options.debug_flags);
+  compiler.SetSpecializationBudget(options.specialization_budget);
+  compiler.SetEvalStepLimit(options.eval_step_limit);
+  compiler.SetReadOnlyDataEnabled(options.enable_read_only_data);
+  compiler.SetDeadCodeEliminationEnabled(
+    options.enable_dead_code_elimination);
+  compiler.SetFunctionReorderingEnabled(options.enable_function_reordering);
+  compiler.SetBranchRelaxationEnabled(options.enable_branch_relaxation);
+  compiler.SetLazyCompilationEnabled(options.enable_lazy_compilation);
+  compiler.SetThreadCount(options.thread_count);
+  compiler.SetTieredCompilationEnabled(options.enable_tiered_compilation);
+  compiler.SetTierUpThreshold(options.tier_up_threshold);
+  compiler.SetResumeEnabled(options.enable_background_compilation);
+  if (options.report_tier_up) {
+    compiler.SetTierUpLogger(&tier_up_logger);
+  }
+  compiler.SetCacheTag(PLUGIN_VERSION_STRING);
+  if (options.enable_cache) {
+    compiler.SetCacheDirectory("plugins/jit_cache");
+  }
+  if (options.enable_images) {
+    compiler.SetImageDirectory("plugins/jit_images");
+  }
+
+  long start_time = amxjit::GetTimeMilliseconds();
   amxjit::CodeBuffer *code = compiler.Compile(amx);
+  compile_time = amxjit::GetTimeMilliseconds() - start_time;
   delete logger;
 
+  return code;
+}
+
+void ReportResult(AMX *amx,
+                  const Options &options,
+                  const ErrorHandler &error_handler,
+                  amxjit::CodeBuffer *code,
+                  long compile_time) {
+  error_handler.Print();
+  if (options.report_compile_time) {
+    jit_printf("Compilation took %ld ms", compile_time);
+  }
   if (code == 0) {
     jit_printf("Compilation failed");
     OnJITError(amx);
+  } else if (options.report_code_size) {
+    std::size_t bytecode_size = amxjit::AMXRef(amx).code_size();
+    jit_printf("Code size: %u bytes of bytecode, %u bytes of machine code",
+               static_cast<unsigned int>(bytecode_size),
+               static_cast<unsigned int>(code->size()));
+  }
+}
+
+amxjit::CodeBuffer *Compile(AMX *amx) {
+  if (!OnJITCompile(amx)) {
+    jit_printf("Compilation was disabled");
+    return 0;
   }
+
+  Options options = ReadOptions();
+  ErrorHandler error_handler;
+  long compile_time;
+  amxjit::CodeBuffer *code = CompileAMX(amx,
+                                        options,
+                                        amx->sysreq_d != 0,
+                                        0,
+                                        error_handler,
+                                        compile_time);
+  ReportResult(amx, options, error_handler, code, compile_time);
   return code;
 }
 
 } // anonymous namespace
 
+// Compiles a script on a separate thread while the interpreter keeps
+// running it.
+class JITHandler::Background {
+ public:
+  Background(AMX *amx, const Options &options):
+    amx_(amx),
+    options_(options),
+    sysreq_d_(amx->sysreq_d),
+    data_(),
+    code_(),
+    compile_time_(0),
+    done_(false),
+    thread_(Run, this)
+  {
+    // Stop the interpreter from replacing SYSREQ.C with SYSREQ.D while
+    // the compiler is reading the code.
+    amx->sysreq_d = 0;
+
+    // The interpreter keeps writing to the data, so the compiler works
+    // with a copy made before the script starts running.
+    amxjit::AMXRef amx_ref(amx);
+    data_.assign(amx_ref.data(), amx_ref.data() + amx_ref.data_size());
+  }
+
+  ~Background() {
+    thread_.Join();
+    amx_->sysreq_d = sysreq_d_;
+    if (code_ != 0) {
+      code_->Delete();
+    }
+  }
+
+  bool Start() {
+    return thread_.Start();
+  }
+
+  bool IsDone() {
+    amxjit::ScopedLock lock(mutex_);
+    return done_;
+  }
+
+  // Waits for the thread to finish, prints errors and returns the code. The
+  // caller becomes the owner of the code.
+  amxjit::CodeBuffer *Finish() {
+    thread_.Join();
+    amx_->sysreq_d = sysreq_d_;
+    ReportResult(amx_, options_, error_handler_, code_, compile_time_);
+    amxjit::CodeBuffer *code = code_;
+    code_ = 0;
+    return code;
+  }
+
+ private:
+  static void Run(void *arg) {
+    Background *background = static_cast<Background*>(arg);
+    amxjit::CodeBuffer *code = CompileAMX(background->amx_,
+                                          background->options_,
+                                          background->sysreq_d_ != 0,
+                                          background->data_.empty()
+                                            ? 0
+                                            : &background->data_[0],
+                                          background->error_handler_,
+                                          background->compile_time_);
+    amxjit::ScopedLock lock(background->mutex_);
+    background->code_ = code;
+    background->done_ = true;
+  }
+
+ private:
+  AMX *amx_;
+  Options options_;
+  cell sysreq_d_;
+  std::vector<unsigned char> data_;
+  ErrorHandler error_handler_;
+  amxjit::CodeBuffer *code_;
+  long compile_time_;
+  bool done_;
+  amxjit::Mutex mutex_;
+  amxjit::Thread thread_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(Background);
+};
+
 JITHandler::JITHandler(AMX *amx):
   AMXHandler<JITHandler>(amx),
   state_(INIT),
-  code_()
+  code_(),
+  entry_point_(),
+  background_(),
+  interpreter_depth_(0),
+  interpreter_sleeping_(false),
+  prev_debug_hook_(),
+  break_count_(0),
+  osr_pending_(false)
 {
   cell jit_var_addr;
   if (amx_FindPubVar(amx, "__JIT", &jit_var_addr) == AMX_ERR_NONE) {
@@ -138,25 +449,186 @@ JITHandler::JITHandler(AMX *amx):
 }
 
 JITHandler::~JITHandler() {
+  RemoveDebugHook();
+  delete background_;
   if (state_ == COMPILE_SUCCEDED) {
     assert(code_ != 0);
     code_->Delete();
   }
 }
 
-int JITHandler::Exec(cell *retval, int index) {
+// static
+bool JITHandler::InstallTrapHandler() {
+  if (!ReadOptions().enable_traps) {
+    return true;
+  }
+  traps_installed = amxjit::Compiler::InstallTrapHandler();
+  return traps_installed;
+}
+
+void JITHandler::StartBackgroundCompilation() {
+  if (state_ != INIT) {
+    return;
+  }
+  Options options = ReadOptions();
+  if (!options.enable_background_compilation) {
+    return;
+  }
+  background_ = new Background(amx(), options);
+  if (background_->Start()) {
+    state_ = COMPILE_BACKGROUND;
+    // Long calls are moved to compiled code at a BREAK instruction once
+    // the code is ready (needs debug info in the script).
+    prev_debug_hook_ = amx()->debug;
+    amx_SetDebugHook(amx(), DebugHook);
+  } else {
+    delete background_;
+    background_ = 0;
+  }
+}
+
+void JITHandler::OnInterpreterEnter() {
+  interpreter_depth_++;
+}
+
+bool JITHandler::OnInterpreterExit(int index, int error) {
+  interpreter_depth_--;
+  if (error == AMX_ERR_SLEEP && osr_pending_) {
+    osr_pending_ = false;
+    return true;
+  }
+  if (error == AMX_ERR_SLEEP) {
+    interpreter_sleeping_ = true;
+  } else if (index == AMX_EXEC_CONT) {
+    interpreter_sleeping_ = false;
+  }
+  return false;
+}
+
+int AMXAPI JITHandler::DebugHook(AMX *amx) {
+  return GetHandler(amx)->OnBreak();
+}
+
+int JITHandler::OnBreak() {
+  if (prev_debug_hook_ != 0) {
+    int error = prev_debug_hook_(amx());
+    if (error != AMX_ERR_NONE) {
+      return error;
+    }
+  }
+
+  // Only the outermost call can be moved to compiled code: calls made
+  // from natives have native frames between them. Checking for the code
+  // takes a lock, so it's not done at every BREAK.
+  if (state_ != COMPILE_BACKGROUND
+      || interpreter_depth_ != 1
+      || interpreter_sleeping_
+      || ++break_count_ % 256 != 0
+      || !background_->IsDone()) {
+    return AMX_ERR_NONE;
+  }
+
+  // The interpreter has stored its state in the AMX before calling the
+  // hook, and OnJITCompile() may overwrite it.
+  AMX *amx = this->amx();
+  cell cip = amx->cip;
+  cell frm = amx->frm;
+  cell stk = amx->stk;
+  cell hea = amx->hea;
+  bool switched = SwitchToCompiledCode();
+  amx->cip = cip;
+  amx->frm = frm;
+  amx->stk = stk;
+  amx->hea = hea;
+
+  // Make the interpreter return as if the script went to sleep, and
+  // continue from the same place in compiled code. If the stack can't be
+  // translated, the interpreter finishes this call.
+  if (switched && code_->TranslateFrames(amx)) {
+    osr_pending_ = true;
+    return AMX_ERR_SLEEP;
+  }
+  return AMX_ERR_NONE;
+}
+
+void JITHandler::RemoveDebugHook() {
+  if (amx()->debug == DebugHook) {
+    amx_SetDebugHook(amx(), prev_debug_hook_);
+  }
+}
+
+bool JITHandler::FinishBackgroundCompilation(int index) {
+  assert(state_ == COMPILE_BACKGROUND);
+
+  // Switch to compiled code only when no interpreter frames of this script
+  // are on the stack and there is no sleeping call to be resumed.
+  if (interpreter_depth_ > 0
+      || interpreter_sleeping_
+      || index == AMX_EXEC_CONT
+      || !background_->IsDone()) {
+    return false;
+  }
+  return SwitchToCompiledCode();
+}
+
+void JITHandler::OnNativesRegistered() {
+  if (state_ == COMPILE_SUCCEDED) {
+    code_ = code_->RebindNatives(amx());
+    entry_point_ = code_->GetEntryPoint();
+  }
+}
+
+bool JITHandler::SwitchToCompiledCode() {
+  RemoveDebugHook();
+
+  state_ = COMPILE;
+  amxjit::CodeBuffer *code = background_->Finish();
+  delete background_;
+  background_ = 0;
+
+  if (code != 0 && !OnJITCompile(amx())) {
+    jit_printf("Compilation was disabled");
+    code->Delete();
+    code = 0;
+  }
+  if ((code_ = code) != 0) {
+    state_ = COMPILE_SUCCEDED;
+    if (traps_installed) {
+      amxjit::SetTrapStack();
+    }
+    // Natives could be registered while the script was being compiled.
+    code_ = code_->RebindNatives(amx());
+    entry_point_ = code_->GetEntryPoint();
+    return true;
+  }
+  state_ = COMPILE_FAILED;
+  return false;
+}
+
+int JITHandler::CompileAndExec(cell *retval, int index) {
   switch (state_) {
     case INIT:
       state_ = COMPILE;
       if ((code_ = Compile(amx())) != 0) {
         state_ = COMPILE_SUCCEDED;
+        entry_point_ = code_->GetEntryPoint();
+        // Faults in the code are handled on a stack of this thread's own.
+        // A script is expected to keep running on the same thread.
+        if (traps_installed) {
+          amxjit::SetTrapStack();
+        }
       } else {
         state_ = COMPILE_FAILED;
         return AMX_ERR_INIT_JIT;
       }
+    case COMPILE_BACKGROUND:
+      if (state_ == COMPILE_BACKGROUND
+          && !FinishBackgroundCompilation(index)) {
+        return AMX_ERR_INIT_JIT;
+      }
     case COMPILE_SUCCEDED: {
       amxjit::CodeEntryPoint entry_point = code_->GetEntryPoint();
-      return entry_point(index, retval);
+      return entry_point(amx(), index, retval);
     }
     case COMPILE:
     case COMPILE_FAILED:
@@ -26,29 +26,70 @@
 #define JITHANDLER_H
 
 #include "amxhandler.h"
-
-namespace amxjit {
-  class CodeBuffer;
-}
+#include "amxjit/compiler.h"
 
 class JITHandler: public AMXHandler<JITHandler> {
  friend class AMXHandler<JITHandler>;
 
  public:
-  int Exec(cell *retval, int index);
+  // Once the script is compiled, calls go straight to the compiled code.
+  int Exec(cell *retval, int index) {
+    if (entry_point_ != 0) {
+      return entry_point_(amx(), index, retval);
+    }
+    return CompileAndExec(retval, index);
+  }
+
+  // Makes faults in compiled code halt the script with an error if this
+  // is enabled (jit_traps). Returns false if that's not possible.
+  static bool InstallTrapHandler();
+
+  // Starts compiling the script on a separate thread if background
+  // compilation is enabled. Until it finishes, Exec() returns
+  // AMX_ERR_INIT_JIT and the script runs in the interpreter.
+  void StartBackgroundCompilation();
+
+  // Must be called around every interpreter call so that the switch to
+  // compiled code happens only when the interpreter is not running.
+  // OnInterpreterExit() returns true if the interpreter was stopped so that
+  // the call could be continued in compiled code with AMX_EXEC_CONT.
+  void OnInterpreterEnter();
+  bool OnInterpreterExit(int index, int error);
+
+  // Must be called after natives are (re-)registered: calls to natives
+  // whose addresses were known at compile time are updated.
+  void OnNativesRegistered();
 
  private:
   explicit JITHandler(AMX *amx);
   ~JITHandler();
 
+  int CompileAndExec(cell *retval, int index);
+  bool FinishBackgroundCompilation(int index);
+  bool SwitchToCompiledCode();
+
+  static int AMXAPI DebugHook(AMX *amx);
+  int OnBreak();
+  void RemoveDebugHook();
+
  private:
+  class Background;
+
   enum State {
     INIT,
     COMPILE,
+    COMPILE_BACKGROUND,
     COMPILE_FAILED,
     COMPILE_SUCCEDED
   } state_;
   amxjit::CodeBuffer *code_;
+  amxjit::CodeEntryPoint entry_point_;
+  Background *background_;
+  int interpreter_depth_;
+  bool interpreter_sleeping_;
+  AMX_DEBUG prev_debug_hook_;
+  unsigned int break_count_;
+  bool osr_pending_;
 };
 
 #endif // !JITHANDLER_H